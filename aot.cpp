@@ -0,0 +1,230 @@
+#include "aot.hpp"
+#include "vm.hpp"
+#include <algorithm>
+using namespace std;
+
+void write_aot_prologue(ostream& out) {
+  out << "// Generated by aot_gen.exe; do not edit.\n"
+      << "#pragma once\n\n"
+      << "#include \"../ast.hpp\"\n"
+      << "#include \"../memory.hpp\"\n"
+      << "#include \"../nodestore.hpp\"\n"
+      << "#include \"../vm.hpp\"\n"
+      << "#include \"../worklist.hpp\"\n"
+      << "#include <stdexcept>\n"
+      << "#include <vector>\n\n";
+}
+
+// The statements that push a node's inactive dependencies and bail out
+// unless all of them are active, as should_execute and
+// ensure_dependencies_are_triggered do.
+static void write_wait(ostream& out, const AbsoluteAddress* begin, const AbsoluteAddress* end,
+                       const string& indent) {
+  if (begin == end)
+    return;
+  out << indent << "bool ready = true;\n";
+  for_each(begin, end, [&] (AbsoluteAddress dependency) {
+      out << indent << "if (!this->nodes.is_active(" << dependency << ")) { "
+          << "this->pending_instructions.push(" << dependency << "); ready = false; }\n";
+  });
+  out << indent << "if (!ready) return false;\n";
+}
+
+// Past its wait a node runs, which rules out a fixed point this step
+static void write_executed(ostream& out, const string& indent) {
+  out << indent << "this->executed = true;\n";
+}
+
+static string consume(const Program& program, AbsoluteAddress address, int i) {
+  return "this->consume(" + to_string(program.operand(address, i)) + ")";
+}
+
+static int register_index(Data immediate) {
+  return static_cast<uint8_t>(immediate) % MAX_REGISTERS;
+}
+
+static void write_node(ostream& out, const Program& program, AbsoluteAddress address) {
+  auto instruction = program.instructions[address];
+  auto& compiled = program.compiled[address];
+  auto output = "this->nodes.output(" + to_string(address) + ")";
+  out << "  // " << instruction_names.at(instruction) << "\n"
+      << "  bool node_" << address << "() {\n";
+  if (instruction == OP_IF) {
+    out << "    auto& state = this->nodes.extra_state(" << address << ");\n"
+        << "    switch (state) {\n";
+    for (int state = 0; state < 3; state++) {
+      out << "    case " << state << ": {\n";
+      write_wait(out, compiled.waits_begin(state), compiled.waits_end(state), "      ");
+      write_executed(out, "      ");
+      if (state == 0)
+        out << "      int cond = " << consume(program, address, 0) << ";\n"
+            << "      state = (cond % 2) ? 1 : 2;\n"
+            << "      return false;\n";
+      else
+        out << "      " << output << " = " << consume(program, address, state) << ";\n"
+            << "      state = 0;\n"
+            << "      return true;\n";
+      out << "    }\n";
+    }
+    out << "    }\n"
+        << "    throw logic_error(\"OP_IF in invalid state\");\n"
+        << "  }\n";
+    return;
+  }
+  write_wait(out, compiled.waits_begin(0), compiled.waits_end(0), "    ");
+  write_executed(out, "    ");
+  auto binop = [&] (const string& expression) {
+    out << "    Data i1 = " << consume(program, address, 0) << ";\n"
+        << "    Data i2 = " << consume(program, address, 1) << ";\n"
+        << "    " << output << " = " << expression << ";\n";
+  };
+  switch (instruction) {
+  case OP_ADD:
+    binop("i1 + i2");
+    break;
+  case OP_SUBTRACT:
+    binop("i1 - i2");
+    break;
+  case OP_MULTIPLY:
+    binop("i1 * i2");
+    break;
+  case OP_DIVIDE:
+    binop("i2 == 0 ? 0 : i1 / i2");
+    break;
+  case OP_GEQ:
+    binop("i1 >= i2");
+    break;
+  case OP_LEQ:
+    binop("i1 <= i2");
+    break;
+  case OP_CONST:
+    out << "    " << output << " = " << (int)program.immediates[address] << ";\n";
+    break;
+  case OP_GET_REGISTER:
+    out << "    " << output << " = this->registers[" << register_index(program.immediates[address]) << "];\n";
+    break;
+  case OP_SET_REGISTER:
+    out << "    Data value = " << consume(program, address, 0) << ";\n"
+        << "    this->registers[" << register_index(program.immediates[address]) << "] = value;\n"
+        << "    " << output << " = value;\n";
+    break;
+  case OP_OUTPUT:
+    out << "    this->output_data.push_back(" << consume(program, address, 0) << ");\n";
+    break;
+  case OP_GET_BYTE:
+    out << "    auto index = static_cast<uint8_t>(" << consume(program, address, 0) << ");\n";
+    if (translate_ring(program.immediates[address]) == RING_TARGET)
+      out << "    " << output << " = this->target.get(index);\n";
+    else
+      out << "    " << output << " = index < this->self.size ? this->self.data[index] : 0;\n";
+    break;
+  case OP_SET_BYTE:
+    // Writes to the genome itself are dropped, as in the interpreter
+    if (translate_ring(program.immediates[address]) == RING_TARGET)
+      out << "    auto index = static_cast<uint8_t>(" << consume(program, address, 0) << ");\n"
+          << "    Data value = " << consume(program, address, 1) << ";\n"
+          << "    this->write_target(index, value);\n";
+    else
+      out << "    " << consume(program, address, 0) << ";\n"
+          << "    Data value = " << consume(program, address, 1) << ";\n";
+    out << "    " << output << " = value;\n";
+    break;
+  case OP_BLOCK1:
+  case OP_BLOCK2:
+  case OP_BLOCK3:
+  case OP_BLOCK4:
+  case OP_NOP:
+  case OP_TRIGGER:
+    break;
+  default:
+    out << "    throw logic_error(\"Unimplemented instruction\");\n";
+    break;
+  }
+  out << "    return true;\n"
+      << "  }\n";
+}
+
+void write_aot_program(ostream& out, const Program& program, const string& class_name) {
+  auto size = program.size();
+  out << "struct " << class_name << " {\n"
+      << "  static const size_t num_nodes = " << size << ";\n"
+      << "  vector<Data> input_data;\n"
+      << "  vector<Data> output_data;\n"
+      << "  vector<Data> registers;\n"
+      << "  ByteSpan self;\n"
+      << "  shared_ptr<const PagedMemory> self_pages;\n"
+      << "  PagedMemory target;\n"
+      << "  NodeStore nodes;\n"
+      << "  Worklist pending_instructions;\n\n"
+      << "  " << class_name << "() : self(nullptr, 0) { this->reset(); }\n\n"
+      << "  void reset() {\n"
+      << "    this->input_data.clear();\n"
+      << "    this->output_data.clear();\n"
+      << "    this->registers.assign(MAX_REGISTERS, 0);\n"
+      << "    this->target.clear();\n"
+      << "    this->nodes.reset(num_nodes);\n"
+      << "    this->pending_instructions.reset(num_nodes);\n"
+      << "    this->last_step_settled = false;\n";
+  for_each(program.triggers.begin(), program.triggers.end(), [&] (AbsoluteAddress address) {
+      out << "    this->pending_instructions.push(" << address << ");\n";
+  });
+  out << "  }\n\n"
+      << "  void load_genome(ByteSpan genome) {\n"
+      << "    this->self = genome;\n"
+      << "    this->self_pages.reset();\n"
+      << "    this->target = PagedMemory();\n"
+      << "  }\n\n"
+      << "  bool is_pending(AbsoluteAddress address) {\n"
+      << "    return this->pending_instructions.contains(address % num_nodes);\n"
+      << "  }\n\n"
+      << "  bool settled() const { return this->last_step_settled; }\n\n"
+      << "  void step() {\n"
+      << "    auto& pending = this->pending_instructions;\n"
+      << "    auto num_pending = pending.size();\n"
+      << "    this->executed = false;\n"
+      << "    pending.begin_step();\n"
+      << "    for (auto it = pending.step_begin(); it != pending.step_end(); ++it) {\n"
+      << "      auto address = *it;\n"
+      << "      bool done = false;\n"
+      << "      switch (address) {\n";
+  for (size_t i = 0; i < size; i++)
+    out << "      case " << i << ": done = this->node_" << i << "(); break;\n";
+  out << "      }\n"
+      << "      if (done) {\n"
+      << "        this->nodes.set_active(address);\n"
+      << "        pending.retire(address);\n"
+      << "      } else {\n"
+      << "        pending.keep(address);\n"
+      << "      }\n"
+      << "    }\n"
+      << "    pending.end_step();\n"
+      << "    this->last_step_settled = !this->executed && pending.size() == num_pending;\n"
+      << "  }\n\n"
+      << "  StopReason step_until_done(int max_iterations) {\n"
+      << "    while (!this->pending_instructions.empty()) {\n"
+      << "      if (max_iterations-- <= 0)\n"
+      << "        return STOP_ITERATION_LIMIT;\n"
+      << "      this->step();\n"
+      << "      if (this->last_step_settled)\n"
+      << "        return STOP_FIXED_POINT;\n"
+      << "    }\n"
+      << "    return STOP_DONE;\n"
+      << "  }\n\n"
+      << "private:\n"
+      << "  bool executed; // By the current step\n"
+      << "  bool last_step_settled;\n\n"
+      << "  void write_target(uint8_t position, Data value) {\n"
+      << "    if (!this->self_pages && this->self.size > 0) {\n"
+      << "      this->self_pages = make_shared<const PagedMemory>(this->self);\n"
+      << "      this->target.set_base(this->self_pages);\n"
+      << "    }\n"
+      << "    this->target.set(position, value);\n"
+      << "  }\n\n"
+      << "  Data consume(AbsoluteAddress address) {\n"
+      << "    this->nodes.clear_active(address);\n"
+      << "    return this->nodes.output(address);\n"
+      << "  }\n\n";
+  for (size_t i = 0; i < size; i++)
+    write_node(out, program, i);
+  out << "};\n\n";
+}
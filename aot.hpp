@@ -0,0 +1,26 @@
+#pragma once
+
+#include "program.hpp"
+#include <iostream>
+#include <string>
+using namespace std;
+
+// Ahead-of-time compilation of fixed programs to C++.
+//
+// write_aot_program emits a class with ExecutionContext's evaluation
+// interface (input_data, output_data, registers, self, self_pages, target,
+// nodes, pending_instructions, reset, load_genome, step, step_until_done,
+// settled, is_pending) whose nodes are each an inline member function with
+// their operands,
+// dependencies, immediates and register indices written in as constants.
+// Firing order still depends on values computed at run time, so the
+// generated step keeps the interpreter's worklist and visits nodes through
+// a switch; the compiler sees each node's whole body and can inline and
+// schedule it. Runs are step for step the same as ExecutionContext's, and
+// step_until_done stops at fixed points as the interpreter's does, without
+// cycle detection.
+//
+// Instructions the interpreter leaves unimplemented throw the same
+// logic_error when they execute.
+extern void write_aot_prologue(ostream&);
+extern void write_aot_program(ostream&, const Program&, const string& class_name);
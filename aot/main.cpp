@@ -0,0 +1,19 @@
+// Writes the C++ for the fixed programs in corpus.hpp to standard output;
+// see aot.hpp. The Makefile turns this into aot/programs.hpp.
+
+#include "../aot.hpp"
+#include "../corpus.hpp"
+#include "../program.hpp"
+#include <iostream>
+using namespace std;
+
+int main() {
+  write_aot_prologue(cout);
+  write_aot_program(cout, compile_program(lift_bytes_to_graph(addition_genome())), "AotAddition");
+  write_aot_program(cout, compile_program(lift_bytes_to_graph(endless_loop_genome())), "AotEndlessLoop");
+  write_aot_program(cout, compile_program(lift_bytes_to_graph(endless_loops_genome(16))), "AotEndlessLoops16");
+  write_aot_program(cout, compile_program(lift_bytes_to_graph(livelock_genome())), "AotLivelock");
+  write_aot_program(cout, compile_program(lift_bytes_to_graph(livelocks_genome(16))), "AotLivelocks16");
+  write_aot_program(cout, compile_program(lift_bytes_to_graph(sample_genome())), "AotSample");
+  return 0;
+}
@@ -0,0 +1,20 @@
+#include "arena.hpp"
+#include <stdexcept>
+using namespace std;
+
+void Arena::reset(size_t bytes) {
+  auto words = arena_bytes(bytes) / sizeof(uint64_t);
+  if (words > this->block.size()) {
+    this->block.resize(words);
+    this->growths++;
+  }
+  this->used = 0;
+}
+
+size_t Arena::carve(size_t bytes) {
+  auto offset = this->used;
+  this->used += arena_bytes(bytes);
+  if (this->used > this->capacity())
+    throw logic_error("Arena overflow");
+  return offset;
+}
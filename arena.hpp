@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+// A single block that per-node arrays are carved out of. Carving is a
+// pointer bump, and the block is only reallocated when a reset asks for
+// more room than it has ever had, so resetting for programs no longer
+// than the longest one seen so far does not touch the heap.
+//
+// Carvings are returned as offsets rather than pointers. That way a
+// structure that owns an Arena can be copied like any other value.
+struct Arena {
+  Arena() : used(0), growths(0) { }
+  void reset(size_t bytes);  // Discards all carvings and ensures capacity
+  size_t carve(size_t bytes); // Returns the offset of a new 8-byte aligned array
+  size_t capacity() const { return block.size() * sizeof(uint64_t); }
+  unsigned long num_growths() const { return growths; }
+
+  template <typename T> T* at(size_t offset) {
+    return reinterpret_cast<T*>(reinterpret_cast<char*>(block.data()) + offset);
+  }
+  template <typename T> const T* at(size_t offset) const {
+    return reinterpret_cast<const T*>(reinterpret_cast<const char*>(block.data()) + offset);
+  }
+private:
+  vector<uint64_t> block;
+  size_t used;
+  unsigned long growths;
+};
+
+// Room one carving of the given size takes up
+inline size_t arena_bytes(size_t bytes) {
+  return (bytes + 7) & ~size_t(7);
+}
@@ -1,13 +1,16 @@
 #include "ast.hpp"
 #include <algorithm>
 #include <boost/assign/list_of.hpp>
+#include <iostream>
 #include <stdexcept>
 #include <vector>
 using namespace std;
 
-void consume_input(InstructionNode& node, InstructionType type, int input_no, int8_t block);
-
 vector<InstructionNode> lift_bytes_to_graph(const vector<int8_t>& bytes) {
+  return lift_bytes_to_graph(ByteSpan(bytes));
+}
+
+vector<InstructionNode> lift_bytes_to_graph(ByteSpan bytes) {
   vector<InstructionNode> ret;
   AbsoluteAddress next_address = 0;
   InstructionNode current;
@@ -24,6 +27,7 @@ vector<InstructionNode> lift_bytes_to_graph(const vector<int8_t>& bytes) {
       auto handle_new_instruction = [&] () {
         auto instruction = instruction_from_bytes(block);
         auto type = instruction_type(instruction);
+        current = InstructionNode();
         current.instruction = instruction;
         num_inputs = num_inputs_for_instruction_type(type);
       };
@@ -246,8 +250,9 @@ int num_inputs_for_instruction_type(InstructionType type) {
 string show_instruction_node(const InstructionNode& node) {
   auto instruction = node.instruction;
   auto type = instruction_type(instruction);
-  string instruction_name = instruction_names[instruction];
-  string instruction_type_name = instruction_type_names[type];
+  // at() rather than [] so concurrent callers never insert into the maps
+  string instruction_name = instruction_names.at(instruction);
+  string instruction_type_name = instruction_type_names.at(type);
   string base_output =
     instruction_name + " (" +
     "Active=" + string(node.active ? "Y" : "N") + "," + 
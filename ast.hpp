@@ -61,18 +61,31 @@ struct InstructionNode {
         struct { Ring r; RelativeAddress i1; } ring_unop;
         struct { Ring r; RelativeAddress i1, i2; } ring_binop;
     } input;
-  InstructionNode() : extra_state(0), active(false), output(0) { }
+  InstructionNode() : extra_state(0), active(false), output(0), input() { }
+};
+
+// Non-owning view of a run of genome bytes, such as one genome inside a
+// memory-mapped population file.
+struct ByteSpan {
+  const int8_t* data;
+  size_t size;
+  ByteSpan(const int8_t* _data, size_t _size) : data(_data), size(_size) { }
+  ByteSpan(const vector<int8_t>& bytes) : data(bytes.data()), size(bytes.size()) { }
+  const int8_t* begin() const { return data; }
+  const int8_t* end() const { return data + size; }
 };
 
 extern map<Instruction, string> instruction_names;
 extern map<InstructionType, string> instruction_type_names;
 
 extern Instruction instruction_from_bytes(int8_t);
+extern void consume_input(InstructionNode&, InstructionType, int input_no, int8_t block);
 extern string show_instruction_node(const InstructionNode&);
 extern void print_instruction_nodes(const vector<InstructionNode>&);
 extern int num_inputs_for_instruction_type(InstructionType);
 extern InstructionType instruction_type(Instruction);
 extern vector<InstructionNode> lift_bytes_to_graph(const vector<int8_t>&);
+extern vector<InstructionNode> lift_bytes_to_graph(ByteSpan);
 extern vector<AbsoluteAddress> dependencies(const InstructionNode&);
 extern AbsoluteAddress translate_relative(const InstructionNode&, RelativeAddress);
 extern AbsoluteAddress translate_relative(AbsoluteAddress, RelativeAddress);
@@ -0,0 +1,34 @@
+#include "batch.hpp"
+#include "jit.hpp"
+#include "vm.hpp"
+using namespace std;
+
+vector<vector<Data>> evaluate_batch(shared_ptr<const Program> program,
+                                    const vector<vector<Data>>& inputs,
+                                    int max_iterations) {
+  ExecutionContext context(program);
+  return evaluate_batch(context, inputs, max_iterations);
+}
+
+vector<vector<Data>> evaluate_batch(ExecutionContext& context,
+                                    const vector<vector<Data>>& inputs,
+                                    int max_iterations,
+                                    vector<PagedMemory>* targets) {
+  vector<vector<Data>> ret;
+  ret.reserve(inputs.size());
+  if (targets)
+    targets->reserve(targets->size() + inputs.size());
+  for_each(inputs.begin(), inputs.end(), [&] (const vector<Data>& input) {
+      context.reset();
+      context.input_data.assign(input.begin(), input.end());
+      auto reason = context.step_until_done(max_iterations);
+      ret.push_back(context.output_data);
+      if (targets)
+        targets->push_back(context.target);
+      // Worth tracing once it is clear the remaining runs are long
+      if (reason == STOP_ITERATION_LIMIT && ret.size() == 1 && inputs.size() > 1
+          && jit_available() && !context.program->trace)
+        context.program = make_shared<const Program>(jit_compile(*context.program));
+  });
+  return ret;
+}
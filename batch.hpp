@@ -0,0 +1,42 @@
+#pragma once
+
+#include "program.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <memory>
+#include <vector>
+using namespace std;
+
+// Runs one program once per input vector and returns the output of each
+// run, in order. A single ExecutionContext is reset between cases, so the
+// compiled program is shared and only the per-case state is rebuilt.
+extern vector<vector<Data>> evaluate_batch(shared_ptr<const Program>,
+                                           const vector<vector<Data>>& inputs,
+                                           int max_iterations);
+
+// As above, on a context that already holds the program. A program that
+// hits max_iterations on the first input is swapped for its jit_compile
+// copy for the rest, which the context keeps. With `targets`, each run's
+// target memory is appended to it; the copies share their pages with the
+// context's genome.
+extern vector<vector<Data>> evaluate_batch(ExecutionContext&,
+                                           const vector<vector<Data>>& inputs,
+                                           int max_iterations,
+                                           vector<PagedMemory>* targets = nullptr);
+
+// As above, for any context with ExecutionContext's reset, input_data,
+// step_until_done and output_data, such as the classes aot_gen.exe writes.
+template <typename Context>
+vector<vector<Data>> evaluate_batch(Context& context,
+                                    const vector<vector<Data>>& inputs,
+                                    int max_iterations) {
+  vector<vector<Data>> ret;
+  ret.reserve(inputs.size());
+  for_each(inputs.begin(), inputs.end(), [&] (const vector<Data>& input) {
+      context.reset();
+      context.input_data.assign(input.begin(), input.end());
+      context.step_until_done(max_iterations);
+      ret.push_back(context.output_data);
+  });
+  return ret;
+}
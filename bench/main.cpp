@@ -0,0 +1,384 @@
+// Benchmarks for the interpreter hot paths. Every corpus is built from
+// fixed seeds, so runs are comparable between builds; each measurement is
+// printed as one JSON object per line.
+//
+//   ./bench.exe [min_seconds_per_measurement]
+
+#include "../aot/programs.hpp"
+#include "../ast.hpp"
+#include "../corpus.hpp"
+#include "../event.hpp"
+#include "../island.hpp"
+#include "../jit.hpp"
+#include "../lockstep.hpp"
+#include "../batch.hpp"
+#include "../pipeline.hpp"
+#include "../population.hpp"
+#include "../program.hpp"
+#include "../scoring.hpp"
+#include "../vm.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+using namespace std;
+
+const int MAX_ITERATIONS = 10000;
+
+struct Corpus {
+  string name;
+  vector<Genome> genomes;
+};
+
+vector<Corpus> corpora() {
+  return vector<Corpus>{
+    Corpus{"sample", {sample_genome()}},
+    Corpus{"addition", {addition_genome()}},
+    Corpus{"livelock", {livelock_genome()}},
+    Corpus{"livelocks_x16", {livelocks_genome(16)}},
+    Corpus{"random_64", random_genomes(1, 256, 64)},
+    Corpus{"random_1024", random_genomes(2, 64, 1024)},
+    Corpus{"random_live_64", live_random_genomes(3, 8, 64, 1000)},
+  };
+}
+
+typedef chrono::steady_clock Clock;
+
+double seconds_since(Clock::time_point start) {
+  return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Runs `body` (which returns how many units of work it did) until at least
+// min_seconds have passed, and returns the total units and seconds.
+template <typename Body>
+pair<double, double> measure(double min_seconds, Body body) {
+  double units = 0;
+  auto start = Clock::now();
+  double elapsed;
+  do {
+    units += body();
+    elapsed = seconds_since(start);
+  } while (elapsed < min_seconds);
+  return make_pair(units, elapsed);
+}
+
+struct JsonLine {
+  ostringstream out;
+  JsonLine(const string& bench, const string& corpus) {
+    out.precision(12);
+    out << "{\"bench\":\"" << bench << "\",\"corpus\":\"" << corpus << "\"";
+  }
+  JsonLine& field(const string& name, double value) {
+    out << ",\"" << name << "\":" << value;
+    return *this;
+  }
+  ~JsonLine() {
+    cout << out.str() << "}" << endl;
+  }
+};
+
+// Steps each genome until it finishes, settles at a fixed point, hits the
+// cap or throws, and returns the number of steps taken. Steps past a fixed
+// point would only time the scheduler re-visiting nodes that cannot run.
+double count_steps(const vector<shared_ptr<const Program> >& programs, ExecutionContext& context) {
+  double steps = 0;
+  for_each(programs.begin(), programs.end(), [&] (const shared_ptr<const Program>& program) {
+      context.reset(program);
+      try {
+        for (int i = 0; i < MAX_ITERATIONS && !context.pending_instructions.empty(); i++) {
+          context.step();
+          steps++;
+          if (context.settled())
+            break;
+        }
+      } catch (const logic_error&) { }
+  });
+  return steps;
+}
+
+// The same runs through step_until_done, which runs traced programs as
+// native code
+void run_programs(const vector<shared_ptr<const Program> >& programs, ExecutionContext& context) {
+  for_each(programs.begin(), programs.end(), [&] (const shared_ptr<const Program>& program) {
+      context.reset(program);
+      try {
+        context.step_until_done(MAX_ITERATIONS);
+      } catch (const logic_error&) { }
+  });
+}
+
+void bench_lift(const Corpus& corpus, double min_seconds) {
+  auto result = measure(min_seconds, [&] () {
+      double bytes = 0;
+      for_each(corpus.genomes.begin(), corpus.genomes.end(), [&] (const Genome& genome) {
+          try {
+            lift_bytes_to_graph(genome);
+          } catch (const logic_error&) { }
+          bytes += genome.size();
+      });
+      return bytes;
+  });
+  JsonLine("lift", corpus.name)
+    .field("bytes", result.first)
+    .field("seconds", result.second)
+    .field("bytes_per_sec", result.first / result.second);
+}
+
+void bench_step(const Corpus& corpus, double min_seconds, bool jit) {
+  vector<shared_ptr<const Program> > programs;
+  for_each(corpus.genomes.begin(), corpus.genomes.end(), [&] (const Genome& genome) {
+      try {
+        auto program = compile_program(lift_bytes_to_graph(genome));
+        programs.push_back(make_shared<const Program>(jit ? jit_compile(program) : program));
+      } catch (const logic_error&) { }
+  });
+  if (programs.empty())
+    return;
+  ExecutionContext context(programs[0]);
+  auto steps = count_steps(programs, context);
+  auto result = measure(min_seconds, [&] () {
+      run_programs(programs, context);
+      return steps;
+  });
+  JsonLine(jit ? "step_jit" : "step", corpus.name)
+    .field("programs", programs.size())
+    .field("steps", result.first)
+    .field("seconds", result.second)
+    .field("ns_per_step", 1e9 * result.second / result.first)
+    .field("steps_per_sec", result.first / result.second);
+}
+
+// The same runs as bench_step, on the event-driven scheduler
+void bench_step_events(const Corpus& corpus, double min_seconds) {
+  vector<shared_ptr<const Program> > programs;
+  for_each(corpus.genomes.begin(), corpus.genomes.end(), [&] (const Genome& genome) {
+      try {
+        programs.push_back(make_shared<const Program>(compile_program(lift_bytes_to_graph(genome))));
+      } catch (const logic_error&) { }
+  });
+  if (programs.empty())
+    return;
+  EventContext context(programs[0]);
+  double visits = 0;
+  auto result = measure(min_seconds, [&] () {
+      double steps = 0;
+      for_each(programs.begin(), programs.end(), [&] (const shared_ptr<const Program>& program) {
+          context.reset(program);
+          try {
+            for (int i = 0; i < MAX_ITERATIONS && !context.empty(); i++) {
+              context.step();
+              steps++;
+              if (context.settled())
+                break;
+            }
+          } catch (const logic_error&) { }
+          visits += context.visits;
+      });
+      return steps;
+  });
+  JsonLine("step_events", corpus.name)
+    .field("programs", programs.size())
+    .field("steps", result.first)
+    .field("visits_per_step", visits / result.first)
+    .field("seconds", result.second)
+    .field("ns_per_step", 1e9 * result.second / result.first)
+    .field("steps_per_sec", result.first / result.second);
+}
+
+// A fixed test suite of LANES inputs for every program lockstep supports,
+// run through evaluate_batch and through evaluate_batch_lockstep
+void bench_step_lockstep(const Corpus& corpus, double min_seconds) {
+  vector<pair<shared_ptr<const Program>, ByteSpan> > programs;
+  for_each(corpus.genomes.begin(), corpus.genomes.end(), [&] (const Genome& genome) {
+      try {
+        auto program = prepare_program(lift_bytes_to_graph(genome));
+        if (lockstep_supports(*program))
+          programs.push_back(make_pair(program, ByteSpan(genome)));
+      } catch (const logic_error&) { }
+  });
+  if (programs.empty())
+    return;
+  vector<vector<Data> > inputs(LANES, vector<Data>{1, 2, 3});
+  auto run = [&] (bool lockstep) {
+    ExecutionContext context(programs[0].first);
+    return measure(min_seconds, [&] () {
+        for_each(programs.begin(), programs.end(), [&] (const pair<shared_ptr<const Program>, ByteSpan>& p) {
+            context.reset(p.first);
+            context.load_genome(p.second);
+            try {
+              if (lockstep)
+                evaluate_batch_lockstep(context, inputs, MAX_ITERATIONS);
+              else
+                evaluate_batch(context, inputs, MAX_ITERATIONS);
+            } catch (const logic_error&) { }
+        });
+        return double(programs.size() * inputs.size());
+    });
+  };
+  auto scalar = run(false);
+  auto lockstep = run(true);
+  JsonLine("step_lockstep", corpus.name)
+    .field("programs", programs.size())
+    .field("inputs", inputs.size())
+    .field("runs", lockstep.first)
+    .field("seconds", lockstep.second)
+    .field("runs_per_sec", lockstep.first / lockstep.second)
+    .field("batch_runs_per_sec", scalar.first / scalar.second)
+    .field("speedup", (lockstep.first / lockstep.second) / (scalar.first / scalar.second));
+}
+
+// The generated class for a corpus from aot/programs.hpp
+template <typename Aot>
+void bench_step_aot(const string& name, double min_seconds) {
+  Aot context;
+  auto result = measure(min_seconds, [&] () {
+      double steps = 0;
+      context.reset();
+      try {
+        for (int i = 0; i < MAX_ITERATIONS && !context.pending_instructions.empty(); i++) {
+          context.step();
+          steps++;
+          if (context.settled())
+            break;
+        }
+      } catch (const logic_error&) { }
+      return steps;
+  });
+  JsonLine("step_aot", name)
+    .field("steps", result.first)
+    .field("seconds", result.second)
+    .field("ns_per_step", 1e9 * result.second / result.first)
+    .field("steps_per_sec", result.first / result.second);
+}
+
+void bench_evaluate(const Corpus& corpus, double min_seconds, PopulationEvaluator& evaluator) {
+  vector<vector<Data> > inputs(8, vector<Data>{1, 2, 3});
+  double ok = 0;
+  auto result = measure(min_seconds, [&] () {
+      auto results = evaluator.evaluate(corpus.genomes, inputs, MAX_ITERATIONS);
+      ok = 0;
+      for_each(results.begin(), results.end(), [&] (const GenomeResult& r) { ok += r.ok; });
+      return double(results.size());
+  });
+  JsonLine("evaluate", corpus.name)
+    .field("threads", evaluator.pool.size())
+    .field("genomes", result.first)
+    .field("ok_per_batch", ok)
+    .field("seconds", result.second)
+    .field("genomes_per_sec", result.first / result.second);
+}
+
+// As bench_evaluate, but scoring against an expected output that only a
+// perfect genome matches, so scoring gives up on the first wrong output
+void bench_score(const Corpus& corpus, double min_seconds, PopulationEvaluator& evaluator) {
+  vector<vector<Data> > inputs(8, vector<Data>{1, 2, 3});
+  Scoring scoring;
+  scoring.expected.assign(inputs.size(), vector<Data>{6});
+  scoring.threshold = scoring.max_score() - 0.5;
+  double stopped = 0, steps = 0;
+  auto result = measure(min_seconds, [&] () {
+      auto results = score_population(evaluator, corpus.genomes, inputs, MAX_ITERATIONS, scoring);
+      stopped = steps = 0;
+      for_each(results.begin(), results.end(), [&] (const ScoreResult& r) {
+          stopped += r.stopped_early;
+          steps += r.steps;
+      });
+      return double(results.size());
+  });
+  JsonLine("score", corpus.name)
+    .field("threads", evaluator.pool.size())
+    .field("genomes", result.first)
+    .field("stopped_per_batch", stopped)
+    .field("steps_per_batch", steps)
+    .field("seconds", result.second)
+    .field("genomes_per_sec", result.first / result.second);
+}
+
+// One generation of children per iteration, bred from the corpus
+void bench_pipeline(const Corpus& corpus, double min_seconds, const PipelineOptions& options) {
+  vector<vector<Data> > inputs(8, vector<Data>{1, 2, 3});
+  vector<double> fitness(corpus.genomes.size(), 0);
+  GenerationPipeline pipeline(options);
+  PipelineStats total;
+  auto result = measure(min_seconds, [&] () {
+      auto children = pipeline.run(corpus.genomes, fitness, 1024, inputs, MAX_ITERATIONS,
+                                   [] (const GenomeResult& r) { return r.ok ? 1.0 : 0.0; });
+      total.breed.full_waits += pipeline.stats.breed.full_waits;
+      total.lift.full_waits += pipeline.stats.lift.full_waits;
+      total.lift.empty_waits += pipeline.stats.lift.empty_waits;
+      total.evaluate.empty_waits += pipeline.stats.evaluate.empty_waits;
+      total.breed.busy_seconds += pipeline.stats.breed.busy_seconds;
+      total.lift.busy_seconds += pipeline.stats.lift.busy_seconds;
+      total.evaluate.busy_seconds += pipeline.stats.evaluate.busy_seconds;
+      return double(children.size());
+  });
+  JsonLine("pipeline", corpus.name)
+    .field("breeders", options.breeders)
+    .field("lifters", options.lifters)
+    .field("evaluators", options.evaluators)
+    .field("genomes", result.first)
+    .field("seconds", result.second)
+    .field("genomes_per_sec", result.first / result.second)
+    .field("breed_busy", total.breed.busy_seconds / result.second)
+    .field("lift_busy", total.lift.busy_seconds / result.second)
+    .field("evaluate_busy", total.evaluate.busy_seconds / result.second)
+    .field("breed_full", total.breed.full_waits)
+    .field("lift_full", total.lift.full_waits)
+    .field("lift_empty", total.lift.empty_waits)
+    .field("evaluate_empty", total.evaluate.empty_waits);
+}
+
+// Each worker owns one island of a fixed size, so with enough cores the
+// genomes evaluated per second grow with the number of workers
+void bench_islands(const Corpus& corpus, double min_seconds, size_t workers) {
+  IslandOptions options;
+  options.island_size = 256;
+  options.epochs = 2;
+  options.generations_per_epoch = 2;
+  options.breeding.evaluators = 1;
+  IslandProblem problem;
+  problem.inputs.assign(8, vector<Data>{1, 2, 3});
+  problem.max_iterations = MAX_ITERATIONS;
+  problem.fitness = [] (const GenomeResult& r) { return r.ok ? 1.0 : 0.0; };
+  auto address = "unix:/tmp/gvm_bench_islands_" + to_string(getpid());
+  auto result = measure(min_seconds, [&] () {
+      return double(run_local_islands(address, corpus.genomes, workers, options, problem).evaluations);
+  });
+  JsonLine("islands", corpus.name)
+    .field("workers", workers)
+    .field("genomes", result.first)
+    .field("seconds", result.second)
+    .field("genomes_per_sec", result.first / result.second);
+}
+
+int main(int argc, char** argv) {
+  double min_seconds = argc > 1 ? atof(argv[1]) : 0.5;
+  PopulationEvaluator evaluator;
+  auto all = corpora();
+  for_each(all.begin(), all.end(), [&] (const Corpus& corpus) {
+      bench_lift(corpus, min_seconds);
+      bench_step(corpus, min_seconds, false);
+      if (jit_available())
+        bench_step(corpus, min_seconds, true);
+      bench_step_events(corpus, min_seconds);
+      bench_step_lockstep(corpus, min_seconds);
+      bench_evaluate(corpus, min_seconds, evaluator);
+      bench_score(corpus, min_seconds, evaluator);
+  });
+  PipelineOptions options;
+  options.evaluators = max(1, evaluator.pool.size() - 2);
+  bench_pipeline(all[4], min_seconds, options);
+  for (size_t workers = 1; workers <= 4; workers *= 2)
+    bench_islands(all[4], min_seconds, workers);
+  bench_step_aot<AotSample>("sample", min_seconds);
+  bench_step_aot<AotAddition>("addition", min_seconds);
+  bench_step_aot<AotLivelock>("livelock", min_seconds);
+  bench_step_aot<AotLivelocks16>("livelocks_x16", min_seconds);
+  return 0;
+}
@@ -0,0 +1,126 @@
+#include "cache.hpp"
+#include <algorithm>
+using namespace std;
+
+uint64_t hash_bytes(const uint8_t* data, size_t size, uint64_t seed) {
+  auto hash = seed;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t hash_tests(const vector<vector<Data> >& inputs, int max_iterations) {
+  auto hash = hash_bytes(reinterpret_cast<const uint8_t*>(&max_iterations), sizeof(max_iterations));
+  for_each(inputs.begin(), inputs.end(), [&] (const vector<Data>& input) {
+      uint64_t size = input.size();
+      hash = hash_bytes(reinterpret_cast<const uint8_t*>(&size), sizeof(size), hash);
+      hash = hash_bytes(reinterpret_cast<const uint8_t*>(input.data()), input.size(), hash);
+  });
+  return hash;
+}
+
+CacheKey::CacheKey(const vector<InstructionNode>& nodes, uint64_t _tests, ByteSpan genome)
+  : tests(_tests) {
+  bool reads_genome = false;
+  this->program.reserve(3 * nodes.size());
+  for_each(nodes.begin(), nodes.end(), [&] (const InstructionNode& node) {
+      reads_genome |= node.instruction == OP_GET_BYTE;
+      // Every member of the input union is a run of single bytes, so the
+      // decoded inputs are its first num_inputs bytes.
+      auto inputs = reinterpret_cast<const uint8_t*>(&node.input);
+      this->program.push_back(node.instruction);
+      this->program.insert(this->program.end(), inputs,
+                           inputs + num_inputs_for_instruction_type(instruction_type(node.instruction)));
+  });
+  if (reads_genome) {
+    // Ending with the node count keeps the key unambiguous
+    this->program.insert(this->program.end(), genome.begin(), genome.end());
+    uint32_t num_nodes = nodes.size();
+    auto count = reinterpret_cast<const uint8_t*>(&num_nodes);
+    this->program.insert(this->program.end(), count, count + sizeof(num_nodes));
+  }
+  this->hash = hash_bytes(this->program.data(), this->program.size(), _tests);
+}
+
+ResultCache::ResultCache(size_t capacity, int num_shards) {
+  num_shards = max(1, min<int>(num_shards, capacity));
+  this->shard_capacity = max<size_t>(1, capacity / num_shards);
+  for (int i = 0; i < num_shards; i++)
+    this->shards.push_back(unique_ptr<Shard>(new Shard()));
+}
+
+GenomeResult ResultCache::get_or_evaluate(const CacheKey& key, function<GenomeResult()> evaluate) {
+  auto& shard = this->shard_for(key);
+  unique_lock<mutex> guard(shard.lock);
+  auto found = shard.index.find(key.hash);
+  if (found != shard.index.end() && found->second->key == key) {
+    shard.entries.splice(shard.entries.begin(), shard.entries, found->second);
+    shard.hits++;
+    auto result = found->second->result;
+    guard.unlock();
+    return result.get(); // Waits if another thread is still evaluating it
+  }
+  shard.misses++;
+  if (found != shard.index.end()) {
+    // A different program with the same hash; the newer one replaces it
+    shard.entries.erase(found->second);
+    shard.index.erase(found);
+  }
+  promise<GenomeResult> evaluated;
+  shard.entries.push_front(Entry{key, evaluated.get_future().share()});
+  shard.index[key.hash] = shard.entries.begin();
+  while (shard.entries.size() > this->shard_capacity) {
+    shard.index.erase(shard.entries.back().key.hash);
+    shard.entries.pop_back();
+  }
+  guard.unlock();
+
+  try {
+    auto ret = evaluate();
+    evaluated.set_value(ret);
+    return ret;
+  } catch (...) {
+    evaluated.set_exception(current_exception());
+    this->forget(shard, key);
+    throw;
+  }
+}
+
+// Drops a failed evaluation so the next request retries it
+void ResultCache::forget(Shard& shard, const CacheKey& key) {
+  lock_guard<mutex> guard(shard.lock);
+  auto found = shard.index.find(key.hash);
+  if (found == shard.index.end() || !(found->second->key == key))
+    return;
+  shard.entries.erase(found->second);
+  shard.index.erase(found);
+}
+
+size_t ResultCache::size() {
+  size_t ret = 0;
+  for_each(this->shards.begin(), this->shards.end(), [&] (unique_ptr<Shard>& shard) {
+      lock_guard<mutex> guard(shard->lock);
+      ret += shard->entries.size();
+  });
+  return ret;
+}
+
+uint64_t ResultCache::hits() {
+  uint64_t ret = 0;
+  for_each(this->shards.begin(), this->shards.end(), [&] (unique_ptr<Shard>& shard) {
+      lock_guard<mutex> guard(shard->lock);
+      ret += shard->hits;
+  });
+  return ret;
+}
+
+uint64_t ResultCache::misses() {
+  uint64_t ret = 0;
+  for_each(this->shards.begin(), this->shards.end(), [&] (unique_ptr<Shard>& shard) {
+      lock_guard<mutex> guard(shard->lock);
+      ret += shard->misses;
+  });
+  return ret;
+}
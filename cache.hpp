@@ -0,0 +1,61 @@
+#pragma once
+
+#include "ast.hpp"
+#include "population.hpp"
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// Identifies an evaluation: the lifted program in canonical form and the
+// test set it is run on. Genomes that lift to the same nodes share a key
+// even if their bytes differ, e.g. in an incomplete trailing instruction,
+// unless the program reads its own genome with OP_GET_BYTE; then the
+// genome's bytes are part of the key too.
+struct CacheKey {
+  vector<uint8_t> program; // Each node's opcode, then just the inputs it decodes
+  uint64_t tests;
+  uint64_t hash;
+  CacheKey(const vector<InstructionNode>&, uint64_t tests, ByteSpan genome);
+  bool operator==(const CacheKey& other) const {
+    return hash == other.hash && tests == other.tests && program == other.program;
+  }
+};
+
+extern uint64_t hash_bytes(const uint8_t* data, size_t size, uint64_t seed = 14695981039346656037ULL);
+// Hash of a test set; the iteration cap is part of it since it changes results
+extern uint64_t hash_tests(const vector<vector<Data> >& inputs, int max_iterations);
+
+// Bounded LRU cache of GenomeResults, safe to share between threads. Keys
+// are spread over independently locked shards, each holding an equal part
+// of the capacity. A key being evaluated is entered before the evaluation
+// starts, so a concurrent request for the same key waits for that result
+// instead of evaluating it again.
+struct ResultCache {
+  explicit ResultCache(size_t capacity, int num_shards = 16);
+  GenomeResult get_or_evaluate(const CacheKey&, function<GenomeResult()> evaluate);
+  size_t size();
+  uint64_t hits();
+  uint64_t misses();
+private:
+  struct Entry {
+    CacheKey key;
+    shared_future<GenomeResult> result;
+  };
+  struct Shard {
+    mutex lock;
+    list<Entry> entries; // Most recently used first
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    uint64_t hits, misses;
+    Shard() : hits(0), misses(0) { }
+  };
+  size_t shard_capacity;
+  vector<unique_ptr<Shard> > shards;
+  Shard& shard_for(const CacheKey& key) { return *shards[key.hash % shards.size()]; }
+  void forget(Shard&, const CacheKey&);
+};
@@ -0,0 +1,100 @@
+#include "corpus.hpp"
+#include "ast.hpp"
+#include "vm.hpp"
+#include <stdexcept>
+#include <random>
+using namespace std;
+
+vector<int8_t> sample_genome() {
+  const int8_t program_length = 37;
+  return vector<int8_t>{
+    OP_LEQ,          1, 2,
+    OP_GET_REGISTER, 0,
+    OP_CONST,        program_length,
+    OP_SET_REGISTER, 0, 1,
+    OP_ADD,          1, 2,
+    OP_GET_REGISTER, 0,
+    OP_CONST,        1,
+    OP_SET_BYTE,     1, 2, 1,
+    OP_GET_BYTE,     0, 1,
+    OP_GET_REGISTER, 0,
+    OP_IF,     -10, 1, 2,
+    OP_BLOCK3, -4, -8, -1,
+    OP_CUT,
+    OP_TRIGGER, -3,
+  };
+}
+
+vector<int8_t> addition_genome() {
+  return vector<int8_t>{
+    OP_CONST, 6,
+    OP_CONST, 7,
+    OP_ADD, -1, -2,
+    OP_OUTPUT, -1,
+    OP_TRIGGER, -1,
+  };
+}
+
+vector<int8_t> endless_loop_genome() {
+  return vector<int8_t>{
+    OP_LEQ,          1, 2,
+    OP_GET_REGISTER, 0,
+    OP_CONST,        127,
+    OP_SET_REGISTER, 0, 1,
+    OP_ADD,          1, 2,
+    OP_GET_REGISTER, 0,
+    OP_CONST,        1,
+    OP_IF,     -7, 1, 2,
+    OP_BLOCK2, -5, -1,
+    OP_NOP,
+    OP_TRIGGER, -3,
+  };
+}
+
+vector<int8_t> livelock_genome() {
+  return vector<int8_t>{
+    OP_TRIGGER,      2,
+    OP_SUBTRACT,     2, 2,
+    OP_SUBTRACT,     -1, 1,
+    OP_SET_REGISTER, 0, -2,
+  };
+}
+
+vector<int8_t> endless_loops_genome(int copies) {
+  vector<int8_t> ret;
+  auto loop = endless_loop_genome();
+  for (int i = 0; i < copies; i++)
+    ret.insert(ret.end(), loop.begin(), loop.end());
+  return ret;
+}
+
+vector<int8_t> livelocks_genome(int copies) {
+  vector<int8_t> ret;
+  auto livelock = livelock_genome();
+  for (int i = 0; i < copies; i++)
+    ret.insert(ret.end(), livelock.begin(), livelock.end());
+  return ret;
+}
+
+vector<vector<int8_t> > random_genomes(unsigned seed, int count, int length) {
+  mt19937 rng(seed);
+  uniform_int_distribution<int> byte(0, 20);
+  vector<vector<int8_t> > ret(count, vector<int8_t>(length));
+  for (auto& genome : ret)
+    for (auto& b : genome)
+      b = byte(rng);
+  return ret;
+}
+
+vector<vector<int8_t> > live_random_genomes(unsigned seed, int count, int length, int steps) {
+  vector<vector<int8_t> > ret;
+  for (unsigned draw = 0; (int)ret.size() < count; draw++) {
+    auto genome = random_genomes(seed + draw, 1, length)[0];
+    try {
+      ExecutionContext context(lift_bytes_to_graph(genome));
+      if (context.step_until_done(steps) == STOP_ITERATION_LIMIT)
+        ret.push_back(genome);
+    } catch (const logic_error&) { }
+  }
+  return ret;
+}
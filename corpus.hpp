@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+// Genomes used by bench.exe and the tests; the fixed ones are also compiled
+// ahead of time by aot_gen.exe
+
+// Example Program: copies self to target, then cuts
+extern vector<int8_t> sample_genome();
+// Outputs 6 + 7
+extern vector<int8_t> addition_genome();
+// Meant to count register 0 upwards while it is <= 127, which an int8
+// register always is. Its OP_IF waits on a block that waits on the OP_IF,
+// though, so it stalls after a few steps with nodes still pending.
+extern vector<int8_t> endless_loop_genome();
+// The same loop repeated, each copy triggered on its own
+extern vector<int8_t> endless_loops_genome(int copies);
+// Keeps firing without ever finishing: the node it triggers waits on two
+// nodes that consume each other, so they are never active at once
+extern vector<int8_t> livelock_genome();
+// The livelock repeated, each copy triggered on its own
+extern vector<int8_t> livelocks_genome(int copies);
+// Uniformly random valid opcode bytes
+extern vector<vector<int8_t> > random_genomes(unsigned seed, int count, int length);
+// Random genomes that still fire nodes after the given number of steps,
+// drawn until there are `count` of them. Only about one 64-byte genome in
+// a thousand qualifies; most finish, settle or throw early.
+extern vector<vector<int8_t> > live_random_genomes(unsigned seed, int count, int length, int steps);
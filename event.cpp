@@ -0,0 +1,188 @@
+#include "event.hpp"
+#include <algorithm>
+#include <functional>
+using namespace std;
+
+EventContext::EventContext(shared_ptr<const Program> _program)
+  : context(_program), visits(0), next_key(0), current_key(0), stepping(false),
+    executed(false), last_step_settled(false), num_pending(0) {
+  this->reset();
+}
+
+void EventContext::reset(shared_ptr<const Program> _program) {
+  this->context.program = _program;
+  this->reset();
+}
+
+// Everything is reassigned in place, so resetting for the same program or
+// a shorter one does not allocate.
+void EventContext::reset() {
+  this->context.reset();
+  auto num_nodes = this->context.program->size();
+  this->states.assign(num_nodes, NS_IDLE);
+  this->dirty_flags.assign(num_nodes, 0);
+  this->keys.assign(num_nodes, 0);
+  this->visiting.clear();
+  this->dirty.clear();
+  this->retiring.clear();
+  this->next_key = 0;
+  this->stepping = false;
+  this->last_step_settled = false;
+  this->num_pending = 0;
+  this->visits = 0;
+  auto& triggers = this->context.program->triggers;
+  for_each(triggers.begin(), triggers.end(), [&] (AbsoluteAddress address) {
+      this->push(address);
+  });
+}
+
+// Newly triggered node. It is visited next step, ahead of every node that
+// was already pending.
+void EventContext::push(AbsoluteAddress address) {
+  auto& state = this->states[address];
+  if (state != NS_IDLE)
+    return;
+  state = NS_PENDING;
+  this->keys[address] = --this->next_key;
+  this->num_pending++;
+  this->mark_dirty(address);
+}
+
+// Schedules a pending node's next visit: later in this step if the step
+// has not reached it yet, otherwise next step.
+void EventContext::mark_dirty(AbsoluteAddress address) {
+  auto& flags = this->dirty_flags[address];
+  if (this->stepping && this->keys[address] > this->current_key) {
+    if (flags & DIRTY_NOW)
+      return;
+    flags |= DIRTY_NOW;
+    this->visiting.push_back(Entry(this->keys[address], address));
+    push_heap(this->visiting.begin(), this->visiting.end(), greater<Entry>());
+  } else if (!(flags & DIRTY_NEXT)) {
+    flags |= DIRTY_NEXT;
+    this->dirty.push_back(address);
+  }
+}
+
+void EventContext::input_changed(AbsoluteAddress address) {
+  auto& program = *this->context.program;
+  auto begin = program.consumers.begin() + program.consumers_begin[address];
+  auto end = program.consumers.begin() + program.consumers_begin[address + 1];
+  for_each(begin, end, [&] (AbsoluteAddress consumer) {
+      if (this->states[consumer] == NS_PENDING)
+        this->mark_dirty(consumer);
+  });
+}
+
+// The body of the polling scheduler's loop, plus notifying the consumers
+// of every active flag it changes.
+void EventContext::visit(AbsoluteAddress address) {
+  auto& program = *this->context.program;
+  auto& nodes = this->context.nodes;
+  auto& compiled = program.compiled[address];
+  auto extra_state = nodes.extra_state(address);
+  this->visits++;
+  auto waits_begin = compiled.waits_begin(extra_state);
+  auto waits_end = compiled.waits_end(extra_state);
+  if (!all_of(waits_begin, waits_end, [&] (AbsoluteAddress dependency) { return nodes.is_active(dependency); })) {
+    VM_INSTRUMENTED(this->context.stats.stalls[program.instructions[address]]++);
+    for_each(waits_begin, waits_end, [&] (AbsoluteAddress dependency) {
+        if (!nodes.is_active(dependency))
+          this->push(dependency);
+    });
+    return;
+  }
+  // Handlers only consume their own operands
+  auto num_operands = num_operands_for_instruction(program.instructions[address]);
+  this->executed = true;
+  bool was_active[MAX_OPERANDS];
+  for (int i = 0; i < num_operands; i++)
+    was_active[i] = nodes.is_active(program.operand(address, i));
+  auto done = this->context.debug
+    ? this->context.execute_node<true>(address)
+    : this->context.execute_node<false>(address);
+  for (int i = 0; i < num_operands; i++) {
+    auto operand = program.operand(address, i);
+    if (was_active[i] && !nodes.is_active(operand))
+      this->input_changed(operand);
+  }
+  if (!done) {
+    // OP_IF moved on to waiting for another input
+    this->mark_dirty(address);
+    return;
+  }
+  if (!nodes.is_active(address)) {
+    nodes.set_active(address);
+    this->input_changed(address);
+  }
+  this->states[address] = NS_RETIRING;
+  this->retiring.push_back(address);
+}
+
+void EventContext::step() {
+  VM_INSTRUMENTED(auto start = cycle_counter());
+  auto num_pending_before = this->num_pending;
+  this->executed = false;
+  for_each(this->dirty.begin(), this->dirty.end(), [&] (AbsoluteAddress address) {
+      auto& flags = this->dirty_flags[address];
+      flags &= ~DIRTY_NEXT;
+      if (this->states[address] != NS_PENDING || (flags & DIRTY_NOW))
+        return;
+      flags |= DIRTY_NOW;
+      this->visiting.push_back(Entry(this->keys[address], address));
+  });
+  this->dirty.clear();
+  make_heap(this->visiting.begin(), this->visiting.end(), greater<Entry>());
+  this->stepping = true;
+  while (!this->visiting.empty()) {
+    pop_heap(this->visiting.begin(), this->visiting.end(), greater<Entry>());
+    auto entry = this->visiting.back();
+    this->visiting.pop_back();
+    this->dirty_flags[entry.second] &= ~DIRTY_NOW;
+    this->current_key = entry.first;
+    this->visit(entry.second);
+  }
+  this->stepping = false;
+  VM_INSTRUMENTED(this->context.stats.max_pending = max<uint64_t>(this->context.stats.max_pending, this->num_pending));
+  // Retired nodes go idle, and an inactive idle node can be triggered again
+  for_each(this->retiring.begin(), this->retiring.end(), [&] (AbsoluteAddress address) {
+      this->states[address] = NS_IDLE;
+      this->num_pending--;
+      if (!this->context.nodes.is_active(address))
+        this->input_changed(address);
+  });
+  this->retiring.clear();
+  this->last_step_settled = !this->executed && this->num_pending == num_pending_before;
+#ifdef VM_INSTRUMENT
+  auto cycles = cycle_counter() - start;
+  this->context.stats.steps++;
+  this->context.stats.step_cycles += cycles;
+  this->context.stats.max_step_cycles = max(this->context.stats.max_step_cycles, cycles);
+#endif
+}
+
+StopReason EventContext::step_until_done(int max_iterations) {
+  while (!this->empty()) {
+    if (max_iterations-- <= 0)
+      return STOP_ITERATION_LIMIT;
+    this->step();
+    if (this->last_step_settled)
+      return STOP_FIXED_POINT;
+  }
+  return STOP_DONE;
+}
+
+bool EventContext::is_pending(AbsoluteAddress address) {
+  return this->states[this->context.program->resolve(address)] != NS_IDLE;
+}
+
+vector<AbsoluteAddress> EventContext::pending_order() const {
+  vector<AbsoluteAddress> order;
+  for (size_t i = 0; i < this->states.size(); i++)
+    if (this->states[i] != NS_IDLE)
+      order.push_back(i);
+  sort(order.begin(), order.end(), [&] (AbsoluteAddress a, AbsoluteAddress b) {
+      return this->keys[a] < this->keys[b];
+  });
+  return order;
+}
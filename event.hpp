@@ -0,0 +1,68 @@
+#pragma once
+
+#include "ast.hpp"
+#include "program.hpp"
+#include "vm.hpp"
+#include <memory>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+using namespace std;
+
+// An event-driven scheduler for the same dataflow semantics as
+// ExecutionContext::step. The polling scheduler revisits every pending node
+// each step, though a node that is still waiting and whose inactive inputs
+// are all already pending does nothing when visited. This one follows the
+// program's reverse edges (Program::consumers) from each node to the nodes
+// that wait on it, and only visits a pending node again once one of its inputs changes: its
+// active flag flips, or it goes idle while inactive so it could be
+// triggered again. A step then costs time in the nodes that fire or
+// trigger, not in everything that is pending. That pays off when most
+// pending nodes are waiting, as in larger random programs; in a tight
+// livelock nearly every pending node fires each step, and keeping the
+// visiting heap costs more than the polling loop it replaces.
+//
+// Pending nodes are ordered by a key that is handed out in decreasing
+// order as nodes are triggered, which is the order the polling scheduler
+// keeps them in, so both run the same nodes in the same order and produce
+// identical results, step for step.
+struct EventContext {
+  ExecutionContext context; // Program, node store, registers and data; its
+                            // own pending_instructions go unused
+  uint64_t visits; // Nodes examined since reset()
+
+  EventContext(shared_ptr<const Program>);
+  void reset();
+  void reset(shared_ptr<const Program>);
+  void step();
+  // Stops at fixed points as ExecutionContext's does; no cycle detection
+  StopReason step_until_done(int max_iterations);
+  bool settled() const { return last_step_settled; }
+  bool empty() const { return num_pending == 0; }
+  size_t size() const { return num_pending; }
+  bool is_pending(AbsoluteAddress);
+  // Pending nodes in the order the polling scheduler would hold them
+  vector<AbsoluteAddress> pending_order() const;
+
+private:
+  enum NodeState { NS_IDLE, NS_PENDING, NS_RETIRING };
+  enum DirtyFlag { DIRTY_NOW = 1, DIRTY_NEXT = 2 };
+  typedef pair<int64_t, AbsoluteAddress> Entry;
+  vector<uint8_t> states;
+  vector<uint8_t> dirty_flags;
+  vector<int64_t> keys;
+  vector<Entry> visiting;      // Min-heap of nodes still to visit this step
+  vector<AbsoluteAddress> dirty; // Nodes to visit next step
+  vector<AbsoluteAddress> retiring;
+  int64_t next_key;
+  int64_t current_key;
+  bool stepping;
+  bool executed;
+  bool last_step_settled;
+  size_t num_pending;
+
+  void push(AbsoluteAddress);
+  void mark_dirty(AbsoluteAddress);
+  void input_changed(AbsoluteAddress);
+  void visit(AbsoluteAddress);
+};
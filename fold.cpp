@@ -0,0 +1,357 @@
+#include "fold.hpp"
+#include "prune.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+bool can_fold(const Program& program) {
+  auto reachable = reachable_nodes(program);
+  vector<uint8_t> uses(program.size(), 0);
+  int num_outputs = 0;
+  for (size_t i = 0; i < program.size(); i++) {
+    if (!reachable[i])
+      continue;
+    switch (program.instructions[i]) {
+    case OP_BIND:
+    case OP_CUT:
+    case OP_GET_BYTE:
+    case OP_SET_BYTE:
+    case OP_SET_REGISTER:
+      return false;
+    case OP_OUTPUT:
+      if (++num_outputs > 1)
+        return false;
+      break;
+    default:
+      break;
+    }
+    auto num_operands = num_operands_for_instruction(program.instructions[i]);
+    for (int j = 0; j < num_operands; j++)
+      if (++uses[program.operands[j][i]] > 1)
+        return false;
+  }
+  return none_of(program.triggers.begin(), program.triggers.end(), [&] (AbsoluteAddress address) {
+      return uses[address] > 0;
+  });
+}
+
+// A node of the folded expression tree
+struct FoldedExpr {
+  Instruction instruction;
+  Data immediate;
+  int operands[3];
+};
+
+// Builds folded expressions for nodes of a program that passed can_fold.
+struct Folder {
+  const Program& program;
+  vector<FoldedExpr> exprs;
+  explicit Folder(const Program& _program) : program(_program) { }
+
+  int add(Instruction instruction, Data immediate, int o1 = -1, int o2 = -1, int o3 = -1) {
+    this->exprs.push_back(FoldedExpr{instruction, immediate, {o1, o2, o3}});
+    return this->exprs.size() - 1;
+  }
+  int constant(Data value) {
+    return this->add(OP_CONST, value);
+  }
+  bool is_constant(int expr, Data value) {
+    return this->exprs[expr].instruction == OP_CONST && this->exprs[expr].immediate == value;
+  }
+
+  // The value the node's output holds once it has run
+  int fold(AbsoluteAddress address) {
+    auto instruction = this->program.instructions[address];
+    auto operand = [&] (int i) { return this->fold(this->program.operand(address, i)); };
+    switch (instruction) {
+    case OP_CONST:
+      return this->constant(this->program.immediates[address]);
+    case OP_GET_REGISTER:
+      return this->add(OP_GET_REGISTER, this->program.immediates[address]);
+    case OP_ADD:
+    case OP_DIVIDE:
+    case OP_GEQ:
+    case OP_LEQ:
+    case OP_MULTIPLY:
+    case OP_SUBTRACT:
+      return this->fold_binop(instruction, operand(0), operand(1));
+    case OP_IF: {
+      auto cond = operand(0);
+      if (this->exprs[cond].instruction == OP_CONST)
+        return operand((this->exprs[cond].immediate % 2) ? 1 : 2);
+      auto i1 = operand(1);
+      auto i2 = operand(2);
+      return this->add(OP_IF, 0, cond, i1, i2);
+    }
+    default:
+      // BLOCKs, NOP, TRIGGER and OUTPUT never write their output
+      return this->constant(0);
+    }
+  }
+
+  int fold_binop(Instruction instruction, int i1, int i2) {
+    auto& e1 = this->exprs[i1];
+    auto& e2 = this->exprs[i2];
+    if (e1.instruction == OP_CONST && e2.instruction == OP_CONST)
+      return this->constant(evaluate_binop(instruction, e1.immediate, e2.immediate));
+    switch (instruction) {
+    case OP_ADD:
+      if (this->is_constant(i1, 0)) return i2;
+      if (this->is_constant(i2, 0)) return i1;
+      break;
+    case OP_SUBTRACT:
+      if (this->is_constant(i2, 0)) return i1;
+      break;
+    case OP_MULTIPLY:
+      if (this->is_constant(i1, 1)) return i2;
+      if (this->is_constant(i2, 1)) return i1;
+      break;
+    case OP_DIVIDE:
+      if (this->is_constant(i2, 1)) return i1;
+      break;
+    default:
+      break;
+    }
+    return this->add(instruction, 0, i1, i2);
+  }
+
+  // As the handlers in vm.cpp compute it
+  static Data evaluate_binop(Instruction instruction, Data i1, Data i2) {
+    switch (instruction) {
+    case OP_ADD:
+      return i1 + i2;
+    case OP_DIVIDE:
+      return i2 == 0 ? 0 : i1 / i2;
+    case OP_GEQ:
+      return i1 >= i2;
+    case OP_LEQ:
+      return i1 <= i2;
+    case OP_MULTIPLY:
+      return i1 * i2;
+    case OP_SUBTRACT:
+      return i1 - i2;
+    default:
+      throw logic_error("Not a binary operator: " + instruction_names.at(instruction));
+    }
+  }
+};
+
+// Appends a node to a program under construction; returns its index.
+static AbsoluteAddress append_node(Program& program, Instruction instruction, Data immediate,
+                            const vector<AbsoluteAddress>& operands) {
+  AbsoluteAddress address = program.nodes.size();
+  InstructionNode node;
+  node.address = address;
+  node.instruction = instruction;
+  if (instruction_type(instruction) == IT_DATA)
+    node.input.data = immediate;
+  program.nodes.push_back(node);
+  program.instructions.push_back(instruction);
+  program.handlers.push_back(handler_for(instruction));
+  program.immediates.push_back(immediate);
+  for (int i = 0; i < MAX_OPERANDS; i++)
+    program.operands[i].push_back(i < (int)operands.size() ? operands[i] : 0);
+  CompiledNode compiled;
+  compiled.num_dependencies = operands.size();
+  compiled.per_state = instruction == OP_IF;
+  copy(operands.begin(), operands.end(), compiled.dependencies);
+  program.compiled.push_back(compiled);
+  return address;
+}
+
+static AbsoluteAddress emit(Program& program, const vector<FoldedExpr>& exprs, int expr) {
+  auto& e = exprs[expr];
+  vector<AbsoluteAddress> operands;
+  for (int i = 0; i < 3 && e.operands[i] >= 0; i++)
+    operands.push_back(emit(program, exprs, e.operands[i]));
+  return append_node(program, e.instruction, e.immediate, operands);
+}
+
+static const AbsoluteAddress NO_OWNER = ~AbsoluteAddress(0);
+
+// Constant subtrees: OP_CONST leaves under operators that consume and wait
+// on every operand. The node owning a subtree node is the only node that
+// refers to it, as an operand or a dependency.
+struct ConstantSubtrees {
+  const Program& program;
+  vector<AbsoluteAddress> owner;
+  vector<int> height; // -1 where the node is not the root of a constant subtree
+  vector<int> size;
+  vector<Data> value;
+
+  explicit ConstantSubtrees(const Program& _program)
+    : program(_program), owner(_program.size(), NO_OWNER), height(_program.size(), -2),
+      size(_program.size(), 0), value(_program.size(), 0) {
+    vector<bool> referenced(program.size(), false);
+    auto refer = [&] (AbsoluteAddress from, AbsoluteAddress to) {
+      if (referenced[to] && this->owner[to] != from)
+        this->owner[to] = NO_OWNER;
+      else if (!referenced[to])
+        this->owner[to] = from;
+      referenced[to] = true;
+    };
+    for (size_t i = 0; i < program.size(); i++) {
+      auto num_operands = num_operands_for_instruction(program.instructions[i]);
+      for (int j = 0; j < num_operands; j++)
+        refer(i, program.operands[j][i]);
+      auto& compiled = program.compiled[i];
+      for (int j = 0; j < compiled.num_dependencies; j++)
+        refer(i, compiled.dependencies[j]);
+    }
+    for_each(program.triggers.begin(), program.triggers.end(), [&] (AbsoluteAddress address) {
+        referenced[address] = true;
+        this->owner[address] = NO_OWNER;
+    });
+    for (size_t i = 0; i < program.size(); i++)
+      this->measure(i);
+  }
+
+  static bool is_pure_binop(Instruction instruction) {
+    switch (instruction) {
+    case OP_ADD:
+    case OP_DIVIDE:
+    case OP_GEQ:
+    case OP_LEQ:
+    case OP_MULTIPLY:
+    case OP_SUBTRACT:
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Fills in height, size and value; -3 marks a node being measured, so a
+  // cycle through it is not constant.
+  int measure(AbsoluteAddress address) {
+    if (this->height[address] != -2)
+      return this->height[address] == -3 ? -1 : this->height[address];
+    auto instruction = this->program.instructions[address];
+    if (instruction == OP_CONST) {
+      this->size[address] = 1;
+      this->value[address] = this->program.immediates[address];
+      return this->height[address] = 0;
+    }
+    this->height[address] = -1;
+    if (!is_pure_binop(instruction))
+      return -1;
+    auto i1 = this->program.operand(address, 0);
+    auto i2 = this->program.operand(address, 1);
+    if (this->owner[i1] != address || this->owner[i2] != address)
+      return -1;
+    this->height[address] = -3;
+    auto h1 = this->measure(i1);
+    auto h2 = this->measure(i2);
+    if (h1 < 0 || h2 < 0)
+      return this->height[address] = -1;
+    this->size[address] = 1 + this->size[i1] + (i1 == i2 ? 0 : this->size[i2]);
+    this->value[address] = Folder::evaluate_binop(instruction, this->value[i1], this->value[i2]);
+    return this->height[address] = 1 + max(h1, h2);
+  }
+
+  // Roots of maximal subtrees that fold_constants would shrink
+  bool foldable_root(AbsoluteAddress address) const {
+    auto up = this->owner[address];
+    if (up != NO_OWNER && this->height[up] >= 0)
+      return false;
+    return this->height[address] >= 0 && replacement_size(this->height[address]) < this->size[address];
+  }
+  static int replacement_size(int height) {
+    return height + 2;
+  }
+};
+
+// Rewrites each constant subtree root as ADD(n1, CONST value) over a chain
+// n_k = ADD(n_k+1, n_k+1) ending in n_height = CONST 0. The chain is as tall
+// as the subtree, so the root becomes active in the same step it did before
+// and everything else runs exactly as it did; the old subtree is pruned.
+static Program fold_constants(const Program& program) {
+  ConstantSubtrees subtrees(program);
+  Program ret = program;
+  ret.trace.reset(); // Recorded for the old nodes
+  bool folded = false;
+  for (size_t root = 0; root < program.size(); root++) {
+    if (!subtrees.foldable_root(root))
+      continue;
+    folded = true;
+    auto chain = append_node(ret, OP_CONST, 0, vector<AbsoluteAddress>());
+    for (int depth = subtrees.height[root] - 1; depth > 0; depth--)
+      chain = append_node(ret, OP_ADD, 0, vector<AbsoluteAddress>{chain, chain});
+    auto value = append_node(ret, OP_CONST, subtrees.value[root], vector<AbsoluteAddress>());
+    InstructionNode node;
+    node.address = root;
+    node.instruction = OP_ADD;
+    ret.nodes[root] = node;
+    ret.instructions[root] = OP_ADD;
+    ret.handlers[root] = handler_for(OP_ADD);
+    ret.immediates[root] = 0;
+    ret.operands[0][root] = chain;
+    ret.operands[1][root] = value;
+    auto& compiled = ret.compiled[root];
+    compiled.num_dependencies = 2;
+    compiled.dependencies[0] = chain;
+    compiled.dependencies[1] = value;
+  }
+  return folded ? prune_program(ret) : ret;
+}
+
+Program fold_program(const Program& program) {
+  if (!can_fold(program))
+    return fold_constants(program);
+  Program ret;
+  auto output = find(program.instructions.begin(), program.instructions.end(), OP_OUTPUT);
+  auto reachable = reachable_nodes(program);
+  while (output != program.instructions.end() && !reachable[output - program.instructions.begin()])
+    output = find(output + 1, program.instructions.end(), OP_OUTPUT);
+  if (output == program.instructions.end()) {
+    link_consumers(ret);
+    return ret; // Nothing observable happens
+  }
+
+  // Walk up from the output to its trigger, noting every OP_IF branch it
+  // sits under; the output only runs if each of those branches is taken.
+  vector<AbsoluteAddress> parent(program.size(), 0);
+  vector<int> operand_no(program.size(), -1);
+  for (size_t i = 0; i < program.size(); i++) {
+    if (!reachable[i])
+      continue;
+    auto num_operands = num_operands_for_instruction(program.instructions[i]);
+    for (int j = 0; j < num_operands; j++) {
+      parent[program.operands[j][i]] = i;
+      operand_no[program.operands[j][i]] = j;
+    }
+  }
+  AbsoluteAddress output_address = output - program.instructions.begin();
+  Folder folder(program);
+  struct Guard { int cond; int branch; };
+  vector<Guard> guards;
+  for (auto address = output_address; operand_no[address] >= 0; address = parent[address]) {
+    auto up = parent[address];
+    if (program.instructions[up] != OP_IF || operand_no[address] == 0)
+      continue;
+    auto cond = folder.fold(program.operand(up, 0));
+    auto& e = folder.exprs[cond];
+    if (e.instruction == OP_CONST) {
+      if (((e.immediate % 2) ? 1 : 2) != operand_no[address]) {
+        link_consumers(ret);
+        return ret; // The output is never reached
+      }
+      continue;
+    }
+    guards.push_back(Guard{cond, operand_no[address]});
+  }
+
+  auto value = folder.fold(program.operand(output_address, 0));
+  auto root = append_node(ret, OP_OUTPUT, 0, vector<AbsoluteAddress>{emit(ret, folder.exprs, value)});
+  // Innermost guard first
+  for_each(guards.begin(), guards.end(), [&] (const Guard& guard) {
+      auto cond = emit(ret, folder.exprs, guard.cond);
+      auto skip = append_node(ret, OP_NOP, 0, vector<AbsoluteAddress>());
+      auto taken = guard.branch == 1 ? root : skip;
+      auto not_taken = guard.branch == 1 ? skip : root;
+      root = append_node(ret, OP_IF, 0, vector<AbsoluteAddress>{cond, taken, not_taken});
+  });
+  ret.triggers.push_back(append_node(ret, OP_TRIGGER, 0, vector<AbsoluteAddress>{root}));
+  link_consumers(ret);
+  return ret;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "program.hpp"
+using namespace std;
+
+// Whether fold_program may rewrite the program: every node reachable from
+// a trigger feeds at most one operand of one other reachable node, no
+// trigger feeds another node, there is at most one OP_OUTPUT, and nothing
+// writes registers or bytes, binds or cuts. Each node then runs at most
+// once and the only observable effect is the one output, so the program
+// reduces to the expression that output prints and the OP_IF conditions
+// that decide whether it is reached.
+extern bool can_fold(const Program&);
+
+// An equivalent, usually much smaller program. Programs that pass
+// can_fold reduce to the one expression they output: constant subtrees are
+// folded with the interpreter's int8_t arithmetic (division by zero gives
+// 0), OP_IFs with constant conditions are replaced by the branch they
+// take, pass-through nodes (BLOCKs, NOP, TRIGGER) fold to their output of
+// 0, and x + 0, x - 0, x * 1 and x / 1 reduce to x. Registers are not
+// assumed to start at 0, so OP_GET_REGISTER is left in place. Run to
+// completion, the result has the same output_data and registers as the
+// original, in no more steps.
+//
+// Every other program keeps its shape and timing, and only its constant
+// subtrees shrink: trees of arithmetic on OP_CONSTs, each node used by
+// nothing but its parent, become a chain of the same height that yields
+// the same value in the same step, about half the size or less. Run step
+// for step, the result fires the same outputs, registers and bytes as the
+// original; only a cycle check may see the repeated state sooner.
+//
+// The lifted nodes of rewritten nodes exist for display only and have no
+// relative inputs.
+extern Program fold_program(const Program&);
@@ -0,0 +1,602 @@
+#include "island.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace std;
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Island messages copy integers and doubles as they are laid out in memory"
+#endif
+
+typedef chrono::steady_clock Clock;
+
+static const uint64_t ISLAND_PROTOCOL_VERSION = 1;
+// Far above any real population; guards against reading garbage as a length
+static const uint32_t MAX_MESSAGE_SIZE = 1 << 30;
+
+enum MessageType { MSG_HELLO = 1, MSG_START, MSG_MIGRANTS, MSG_REPORT };
+
+static IslandOptions island_breeding_seed(IslandOptions options, size_t index) {
+  options.breeding.seed += index * 0x9E3779B97F4A7C15ULL;
+  return options;
+}
+
+static vector<Genome> founders_for(const vector<Genome>& founders, size_t num_islands, size_t island) {
+  vector<Genome> ret;
+  for (size_t i = island; i < founders.size(); i += num_islands)
+    ret.push_back(founders[i]);
+  return ret;
+}
+
+static void check_islands(const vector<Genome>& founders, size_t num_islands) {
+  if (num_islands == 0 || founders.size() < num_islands)
+    throw logic_error("Every island needs a founder");
+}
+
+Island::Island(size_t _index, const IslandOptions& _options, const IslandProblem& _problem,
+               const vector<Genome>& founders)
+  : index(_index), evaluations(0), options(island_breeding_seed(_options, _index)),
+    problem(_problem), pipeline(options.breeding) {
+  for_each(founders.begin(), founders.end(), [&] (const Genome& genome) {
+      auto result = evaluate_genome(genome, this->problem.inputs, this->problem.max_iterations,
+                                    this->pipeline.contexts);
+      this->members.push_back(Individual(genome, this->problem.fitness(result)));
+  });
+  this->evaluations += founders.size();
+  this->sort_members();
+}
+
+void Island::sort_members() {
+  stable_sort(this->members.begin(), this->members.end(), [] (const Individual& a, const Individual& b) {
+      return a.fitness > b.fitness;
+  });
+}
+
+void Island::evolve(int generations) {
+  for (int g = 0; g < generations; g++) {
+    vector<Genome> parents;
+    vector<double> fitness;
+    for_each(this->members.begin(), this->members.end(), [&] (const Individual& member) {
+        parents.push_back(member.genome);
+        fitness.push_back(member.fitness);
+    });
+    auto children = this->pipeline.run(parents, fitness, this->options.island_size,
+                                       this->problem.inputs, this->problem.max_iterations,
+                                       this->problem.fitness);
+    this->evaluations += children.size();
+    for_each(children.begin(), children.end(), [&] (Offspring& child) {
+        this->members.push_back(Individual());
+        this->members.back().genome.swap(child.genome);
+        this->members.back().fitness = child.fitness;
+    });
+    this->sort_members();
+    if (this->members.size() > this->options.island_size)
+      this->members.resize(this->options.island_size);
+  }
+}
+
+vector<Individual> Island::emigrants() const {
+  auto count = min(this->options.migrants, this->members.size());
+  return vector<Individual>(this->members.begin(), this->members.begin() + count);
+}
+
+void Island::immigrate(const vector<Individual>& immigrants) {
+  auto keep = this->members.size() > immigrants.size() ? this->members.size() - immigrants.size() : 0;
+  this->members.resize(keep);
+  this->members.insert(this->members.end(), immigrants.begin(), immigrants.end());
+  this->sort_members();
+}
+
+const Individual& IslandResult::best() const {
+  const Individual* ret = nullptr;
+  for_each(this->islands.begin(), this->islands.end(), [&] (const vector<Individual>& island) {
+      if (!island.empty() && (!ret || island.front().fitness > ret->fitness))
+        ret = &island.front();
+  });
+  if (!ret)
+    throw logic_error("No islands");
+  return *ret;
+}
+
+IslandResult evolve_islands(const vector<Genome>& founders, size_t num_islands,
+                            const IslandOptions& options, const IslandProblem& problem) {
+  check_islands(founders, num_islands);
+  auto start = Clock::now();
+  vector<unique_ptr<Island> > islands;
+  for (size_t i = 0; i < num_islands; i++)
+    islands.push_back(unique_ptr<Island>(new Island(i, options, problem, founders_for(founders, num_islands, i))));
+  for (int epoch = 0; epoch < options.epochs; epoch++) {
+    vector<vector<Individual> > migrants;
+    for (size_t i = 0; i < num_islands; i++) {
+      islands[i]->evolve(options.generations_per_epoch);
+      migrants.push_back(islands[i]->emigrants());
+    }
+    if (epoch + 1 == options.epochs)
+      break;
+    for (size_t i = 0; i < num_islands; i++)
+      islands[(i + 1) % num_islands]->immigrate(migrants[i]);
+  }
+  IslandResult ret;
+  for_each(islands.begin(), islands.end(), [&] (const unique_ptr<Island>& island) {
+      ret.islands.push_back(island->population());
+      ret.evaluations += island->evaluations;
+  });
+  ret.seconds = chrono::duration<double>(Clock::now() - start).count();
+  return ret;
+}
+
+// Message encoding
+
+static void put_varint(vector<uint8_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(uint8_t(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(value);
+}
+
+template <typename T>
+static void put_raw(vector<uint8_t>& out, T value) {
+  auto bytes = reinterpret_cast<const uint8_t*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+static void put_population(vector<uint8_t>& out, const vector<Individual>& population) {
+  put_varint(out, population.size());
+  for_each(population.begin(), population.end(), [&] (const Individual& member) {
+      put_raw(out, member.fitness);
+      put_varint(out, member.genome.size());
+      out.insert(out.end(), member.genome.begin(), member.genome.end());
+  });
+}
+
+// Reads a message payload front to back, throwing on anything out of bounds
+struct MessageReader {
+  const vector<uint8_t>& in;
+  size_t at;
+  explicit MessageReader(const vector<uint8_t>& _in) : in(_in), at(0) { }
+  void need(size_t bytes) {
+    if (this->in.size() - this->at < bytes)
+      throw runtime_error("Truncated island message");
+  }
+  uint64_t varint() {
+    uint64_t ret = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      this->need(1);
+      auto b = this->in[this->at++];
+      ret |= uint64_t(b & 0x7F) << shift;
+      if (!(b & 0x80))
+        return ret;
+    }
+    throw runtime_error("Malformed varint in island message");
+  }
+  template <typename T>
+  T raw() {
+    T ret;
+    this->need(sizeof(ret));
+    memcpy(&ret, &this->in[this->at], sizeof(ret));
+    this->at += sizeof(ret);
+    return ret;
+  }
+  vector<Individual> population() {
+    auto count = this->varint();
+    // Every member takes at least 9 bytes, which bounds a corrupt count
+    if (count > (this->in.size() - this->at) / 9)
+      throw runtime_error("Island population count out of range");
+    vector<Individual> ret(count);
+    for_each(ret.begin(), ret.end(), [&] (Individual& member) {
+        member.fitness = this->raw<double>();
+        auto length = this->varint();
+        this->need(length);
+        auto begin = this->in.begin() + this->at;
+        member.genome.assign(begin, begin + length);
+        this->at += length;
+    });
+    return ret;
+  }
+  void finish() {
+    if (this->at != this->in.size())
+      throw runtime_error("Trailing bytes in island message");
+  }
+};
+
+// Sockets
+
+struct Socket {
+  int fd;
+  explicit Socket(int _fd) : fd(_fd) { }
+  ~Socket() {
+    if (this->fd >= 0)
+      close(this->fd);
+  }
+private:
+  Socket(const Socket&);
+  Socket& operator=(const Socket&);
+};
+
+static void send_all(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    auto sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      throw runtime_error(string("Island connection lost: ") + strerror(errno));
+    data += sent;
+    size -= sent;
+  }
+}
+
+static void receive_all(int fd, uint8_t* data, size_t size) {
+  while (size > 0) {
+    auto received = recv(fd, data, size, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received == 0)
+      throw runtime_error("Island connection closed");
+    if (received < 0)
+      throw runtime_error(string("Island connection lost: ") + strerror(errno));
+    data += received;
+    size -= received;
+  }
+}
+
+static void send_message(int fd, MessageType type, const vector<uint8_t>& payload) {
+  vector<uint8_t> out;
+  put_raw(out, uint32_t(payload.size() + 1));
+  out.push_back(type);
+  out.insert(out.end(), payload.begin(), payload.end());
+  send_all(fd, out.data(), out.size());
+}
+
+static vector<uint8_t> receive_message(int fd, MessageType type) {
+  uint32_t length;
+  receive_all(fd, reinterpret_cast<uint8_t*>(&length), sizeof(length));
+  if (length == 0 || length > MAX_MESSAGE_SIZE)
+    throw runtime_error("Island message length out of range");
+  uint8_t received_type;
+  receive_all(fd, &received_type, 1);
+  if (received_type != type)
+    throw runtime_error("Unexpected island message type " + to_string(received_type));
+  vector<uint8_t> ret(length - 1);
+  if (!ret.empty())
+    receive_all(fd, ret.data(), ret.size());
+  return ret;
+}
+
+static void send_population(int fd, MessageType type, const vector<Individual>& population) {
+  vector<uint8_t> payload;
+  put_population(payload, population);
+  send_message(fd, type, payload);
+}
+
+static vector<Individual> receive_population(int fd, MessageType type) {
+  auto payload = receive_message(fd, type);
+  MessageReader reader(payload);
+  auto ret = reader.population();
+  reader.finish();
+  return ret;
+}
+
+struct Endpoint {
+  bool is_unix;
+  string path;       // For Unix sockets
+  string host, port; // For TCP
+};
+
+static Endpoint parse_address(const string& address) {
+  Endpoint ret;
+  ret.is_unix = address.compare(0, 5, "unix:") == 0;
+  if (ret.is_unix) {
+    ret.path = address.substr(5);
+    if (ret.path.empty() || ret.path.size() >= sizeof(sockaddr_un().sun_path))
+      throw runtime_error("Bad Unix socket path in " + address);
+    return ret;
+  }
+  auto colon = address.rfind(':');
+  if (colon == string::npos || colon == 0 || colon + 1 == address.size())
+    throw runtime_error("Island address is neither unix:PATH nor HOST:PORT: " + address);
+  ret.host = address.substr(0, colon);
+  ret.port = address.substr(colon + 1);
+  return ret;
+}
+
+static sockaddr_un unix_address(const string& path) {
+  sockaddr_un ret;
+  memset(&ret, 0, sizeof(ret));
+  ret.sun_family = AF_UNIX;
+  strncpy(ret.sun_path, path.c_str(), sizeof(ret.sun_path) - 1);
+  return ret;
+}
+
+// Calls `use` on each address the host and port resolve to until it
+// returns a socket
+template <typename Use>
+static int with_tcp_addresses(const Endpoint& endpoint, int flags, Use use) {
+  addrinfo hints, *found;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+  auto status = getaddrinfo(endpoint.host.c_str(), endpoint.port.c_str(), &hints, &found);
+  if (status != 0)
+    throw runtime_error("Cannot resolve " + endpoint.host + ": " + gai_strerror(status));
+  int ret = -1;
+  for (auto at = found; at && ret < 0; at = at->ai_next) {
+    int fd = socket(at->ai_family, at->ai_socktype, at->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (use(fd, at->ai_addr, at->ai_addrlen))
+      ret = fd;
+    else
+      close(fd);
+  }
+  freeaddrinfo(found);
+  return ret;
+}
+
+static int connect_to(const string& address) {
+  auto endpoint = parse_address(address);
+  int fd;
+  if (endpoint.is_unix) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    auto target = unix_address(endpoint.path);
+    if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&target), sizeof(target)) != 0) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    fd = with_tcp_addresses(endpoint, 0, [] (int fd, const sockaddr* target, socklen_t length) {
+        return connect(fd, target, length) == 0;
+    });
+  }
+  if (fd < 0)
+    throw runtime_error("Cannot connect to " + address);
+  if (!endpoint.is_unix) {
+    // Messages are written whole, so there is nothing to gain from batching
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  return fd;
+}
+
+// Workers
+
+void run_island_worker(const string& address, const IslandProblem& problem, const PipelineOptions& threads) {
+  Socket connection(connect_to(address));
+  int fd = connection.fd;
+  vector<uint8_t> hello;
+  put_varint(hello, ISLAND_PROTOCOL_VERSION);
+  send_message(fd, MSG_HELLO, hello);
+
+  auto start = receive_message(fd, MSG_START);
+  MessageReader reader(start);
+  IslandOptions options;
+  options.breeding = threads;
+  auto index = reader.varint();
+  reader.varint(); // Number of islands; the coordinator does the routing
+  options.breeding.seed = reader.raw<uint64_t>();
+  options.epochs = reader.varint();
+  options.generations_per_epoch = reader.varint();
+  options.island_size = reader.varint();
+  options.migrants = reader.varint();
+  options.breeding.tournament_size = reader.varint();
+  options.breeding.crossover_rate = reader.raw<double>();
+  options.breeding.max_mutations = reader.varint();
+  options.breeding.max_length = reader.varint();
+  auto founders = reader.population();
+  reader.finish();
+  if (founders.empty())
+    throw runtime_error("Island started without founders");
+  vector<Genome> genomes;
+  for_each(founders.begin(), founders.end(), [&] (Individual& founder) {
+      genomes.push_back(move(founder.genome));
+  });
+
+  Island island(index, options, problem, genomes);
+  for (int epoch = 0; epoch < options.epochs; epoch++) {
+    island.evolve(options.generations_per_epoch);
+    if (epoch + 1 == options.epochs)
+      break;
+    send_population(fd, MSG_MIGRANTS, island.emigrants());
+    island.immigrate(receive_population(fd, MSG_MIGRANTS));
+  }
+  vector<uint8_t> report;
+  put_varint(report, island.evaluations);
+  put_population(report, island.population());
+  send_message(fd, MSG_REPORT, report);
+}
+
+// Coordinator
+
+IslandCoordinator::IslandCoordinator(const string& address, const IslandOptions& _options)
+  : options(_options), listener(-1), bound_address(address) {
+  auto endpoint = parse_address(address);
+  if (endpoint.is_unix) {
+    this->listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    auto local = unix_address(endpoint.path);
+    unlink(endpoint.path.c_str());
+    if (this->listener >= 0 && bind(this->listener, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+      close(this->listener);
+      this->listener = -1;
+    }
+    if (this->listener >= 0)
+      this->unix_path = endpoint.path;
+  } else {
+    this->listener = with_tcp_addresses(endpoint, AI_PASSIVE, [] (int fd, const sockaddr* local, socklen_t length) {
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        return bind(fd, local, length) == 0;
+    });
+  }
+  if (this->listener < 0)
+    throw runtime_error("Cannot bind " + address);
+  if (listen(this->listener, SOMAXCONN) != 0) {
+    close(this->listener);
+    throw runtime_error("Cannot listen on " + address);
+  }
+  if (!endpoint.is_unix) {
+    sockaddr_storage local;
+    socklen_t length = sizeof(local);
+    getsockname(this->listener, reinterpret_cast<sockaddr*>(&local), &length);
+    auto port = local.ss_family == AF_INET6
+      ? ntohs(reinterpret_cast<sockaddr_in6*>(&local)->sin6_port)
+      : ntohs(reinterpret_cast<sockaddr_in*>(&local)->sin_port);
+    this->bound_address = endpoint.host + ":" + to_string(port);
+  }
+}
+
+IslandCoordinator::~IslandCoordinator() {
+  close(this->listener);
+  if (!this->unix_path.empty())
+    unlink(this->unix_path.c_str());
+}
+
+IslandResult IslandCoordinator::run(const vector<Genome>& founders, size_t num_islands,
+                                    const function<void()>& waiting) {
+  check_islands(founders, num_islands);
+  auto& options = this->options;
+  auto start = Clock::now();
+  vector<unique_ptr<Socket> > workers;
+  while (workers.size() < num_islands) {
+    pollfd listening = {this->listener, POLLIN, 0};
+    int ready = poll(&listening, 1, ACCEPT_POLL_MS);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready < 0)
+      throw runtime_error(string("Cannot wait for island workers: ") + strerror(errno));
+    if (ready == 0) {
+      if (waiting)
+        waiting();
+      continue;
+    }
+    int fd = accept(this->listener, nullptr, nullptr);
+    if (fd < 0 && errno == EINTR)
+      continue;
+    if (fd < 0)
+      throw runtime_error(string("Cannot accept island workers: ") + strerror(errno));
+    workers.push_back(unique_ptr<Socket>(new Socket(fd)));
+    auto hello = receive_message(fd, MSG_HELLO);
+    MessageReader reader(hello);
+    if (reader.varint() != ISLAND_PROTOCOL_VERSION)
+      throw runtime_error("Island worker speaks another protocol version");
+  }
+
+  for (size_t i = 0; i < num_islands; i++) {
+    vector<Individual> island_founders;
+    auto genomes = founders_for(founders, num_islands, i);
+    for_each(genomes.begin(), genomes.end(), [&] (const Genome& genome) {
+        island_founders.push_back(Individual(genome, 0));
+    });
+    vector<uint8_t> payload;
+    put_varint(payload, i);
+    put_varint(payload, num_islands);
+    put_raw(payload, options.breeding.seed);
+    put_varint(payload, options.epochs);
+    put_varint(payload, options.generations_per_epoch);
+    put_varint(payload, options.island_size);
+    put_varint(payload, options.migrants);
+    put_varint(payload, options.breeding.tournament_size);
+    put_raw(payload, options.breeding.crossover_rate);
+    put_varint(payload, options.breeding.max_mutations);
+    put_varint(payload, options.breeding.max_length);
+    put_population(payload, island_founders);
+    send_message(workers[i]->fd, MSG_START, payload);
+  }
+
+  // Each island's migrants go on to the next one round the ring
+  for (int epoch = 0; epoch + 1 < options.epochs; epoch++) {
+    vector<vector<Individual> > migrants;
+    for (size_t i = 0; i < num_islands; i++)
+      migrants.push_back(receive_population(workers[i]->fd, MSG_MIGRANTS));
+    for (size_t i = 0; i < num_islands; i++)
+      send_population(workers[(i + 1) % num_islands]->fd, MSG_MIGRANTS, migrants[i]);
+  }
+
+  IslandResult ret;
+  for (size_t i = 0; i < num_islands; i++) {
+    auto payload = receive_message(workers[i]->fd, MSG_REPORT);
+    MessageReader reader(payload);
+    ret.evaluations += reader.varint();
+    ret.islands.push_back(reader.population());
+    reader.finish();
+  }
+  ret.seconds = chrono::duration<double>(Clock::now() - start).count();
+  return ret;
+}
+
+IslandResult run_local_islands(const string& address, const vector<Genome>& founders,
+                               size_t num_islands, const IslandOptions& options,
+                               const IslandProblem& problem) {
+  check_islands(founders, num_islands);
+  unique_ptr<IslandCoordinator> coordinator(new IslandCoordinator(address, options));
+  vector<pid_t> children; // -1 once reaped
+  bool ok = true;
+  // Reaps every child that has exited, waiting for them unless flags has
+  // WNOHANG; returns how many it reaped. A child that cannot be waited for
+  // counts as failed.
+  auto reap = [&] (int flags) {
+    size_t reaped = 0;
+    for_each(children.begin(), children.end(), [&] (pid_t& child) {
+        if (child < 0)
+          return;
+        int status = 0;
+        pid_t result;
+        while ((result = waitpid(child, &status, flags)) < 0 && errno == EINTR) { }
+        if (result == 0)
+          return; // Still running
+        ok = ok && result == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        child = -1;
+        reaped++;
+    });
+    return reaped;
+  };
+  // No worker finishes before every island is connected and started
+  auto check_workers = [&] () {
+    if (reap(WNOHANG) > 0)
+      throw runtime_error("An island worker exited before connecting");
+  };
+
+  IslandResult ret;
+  try {
+    for (size_t i = 0; i < num_islands; i++) {
+      auto child = fork();
+      if (child < 0)
+        throw runtime_error(string("Cannot fork island worker: ") + strerror(errno));
+      if (child == 0) {
+        // _exit skips the parent's destructors and atexit handlers, which
+        // would remove the socket and write its profile
+        close(coordinator->listener);
+        int status = 0;
+        try {
+          run_island_worker(coordinator->address(), problem, options.breeding);
+        } catch (...) {
+          status = 1;
+        }
+        _exit(status);
+      }
+      children.push_back(child);
+    }
+    ret = coordinator->run(founders, num_islands, check_workers);
+  } catch (...) {
+    // Closing the listener and connections lets the workers fail and exit
+    coordinator.reset();
+    reap(0);
+    throw;
+  }
+  coordinator.reset();
+  reap(0);
+  if (!ok)
+    throw runtime_error("An island worker failed");
+  return ret;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "ast.hpp"
+#include "pipeline.hpp"
+#include "population.hpp"
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Island-model evolution spread over worker processes. Each worker owns one
+// island, a sub-population it breeds and evaluates on its own; every few
+// generations the islands send their best genomes to the next island in a
+// ring. Workers only talk to the coordinator, and only to swap migrants, so
+// throughput grows with the number of workers for as long as evaluating a
+// generation takes longer than a round trip.
+//
+// Coordinator and workers talk over one stream socket per worker, a Unix
+// domain socket or TCP, in messages framed as
+//
+//   uint32_t length      Of the type and payload
+//   uint8_t  type
+//   payload
+//
+//   HELLO     worker to coordinator   varint version
+//   START     coordinator to worker   varint island, varint num_islands,
+//                                     uint64_t seed, varint epochs,
+//                                     varint generations_per_epoch,
+//                                     varint island_size, varint migrants,
+//                                     varint tournament_size,
+//                                     double crossover_rate,
+//                                     varint max_mutations, varint max_length,
+//                                     population founders
+//   MIGRANTS  either way              population
+//   REPORT    worker to coordinator   varint evaluations, population
+//
+// where a population is a varint count followed, per genome, by its double
+// fitness, a varint length and its bytes. Integers are little-endian and
+// doubles IEEE 754; varints are unsigned LEB128. Malformed messages and
+// lost connections throw runtime_error.
+
+struct IslandOptions {
+  PipelineOptions breeding; // Each island mixes its index into the seed;
+                            // thread counts are up to each worker
+  size_t island_size;       // Genomes per island, and children per generation
+  int epochs;               // Islands migrate between epochs
+  int generations_per_epoch;
+  size_t migrants;          // Best genomes each island sends on per migration
+  IslandOptions() : island_size(64), epochs(4), generations_per_epoch(5), migrants(2) { }
+};
+
+// What the islands evolve against. It is not sent over the wire: every
+// worker needs its own copy, and a fitness function that agrees with the
+// others'.
+struct IslandProblem {
+  vector<vector<Data> > inputs;
+  int max_iterations;
+  Fitness fitness;
+  IslandProblem() : max_iterations(1000) { }
+};
+
+struct Individual {
+  Genome genome;
+  double fitness;
+  Individual() : fitness(0) { }
+  Individual(const Genome& _genome, double _fitness) : genome(_genome), fitness(_fitness) { }
+};
+
+// One sub-population, kept sorted best first. Each generation breeds
+// island_size children from it and keeps the best island_size of parents
+// and children together. Immigrants replace the worst members; their
+// fitness is taken as sent, since every island scores the same way.
+struct Island {
+  size_t index;
+  uint64_t evaluations; // Genomes evaluated here, founders included
+
+  Island(size_t index, const IslandOptions&, const IslandProblem&, const vector<Genome>& founders);
+  void evolve(int generations);
+  vector<Individual> emigrants() const; // Copies of the best few
+  void immigrate(const vector<Individual>&);
+  const vector<Individual>& population() const { return members; }
+private:
+  IslandOptions options;
+  const IslandProblem& problem;
+  GenerationPipeline pipeline;
+  vector<Individual> members;
+  void sort_members();
+};
+
+struct IslandResult {
+  vector<vector<Individual> > islands; // Final populations, best first
+  uint64_t evaluations;                // Over all islands
+  double seconds;
+  IslandResult() : evaluations(0), seconds(0) { }
+  const Individual& best() const;
+};
+
+// Founders are dealt out round-robin, so island i starts with founders i,
+// i + num_islands, and so on; there must be at least one per island.
+//
+// Runs every island in this process, one after another. A distributed run
+// with the same options and founders ends with the same populations.
+extern IslandResult evolve_islands(const vector<Genome>& founders, size_t num_islands,
+                                   const IslandOptions&, const IslandProblem&);
+
+const int ACCEPT_POLL_MS = 100;
+
+// Addresses are "unix:PATH" or "HOST:PORT"; port 0 picks a free one.
+struct IslandCoordinator {
+  IslandOptions options;
+
+  IslandCoordinator(const string& address, const IslandOptions&);
+  ~IslandCoordinator();
+  // Where workers should connect, with the port filled in
+  string address() const { return bound_address; }
+  // Waits for num_islands workers, numbering them in the order they
+  // connect, and runs them to the end. While no worker is connecting,
+  // `waiting` is called every ACCEPT_POLL_MS; whatever it throws ends the
+  // run, so a caller can give up on workers that will never come.
+  IslandResult run(const vector<Genome>& founders, size_t num_islands,
+                   const function<void()>& waiting = function<void()>());
+private:
+  int listener;
+  string bound_address;
+  string unix_path; // Removed again on destruction
+  IslandCoordinator(const IslandCoordinator&);
+  IslandCoordinator& operator=(const IslandCoordinator&);
+  friend IslandResult run_local_islands(const string&, const vector<Genome>&, size_t,
+                                        const IslandOptions&, const IslandProblem&);
+};
+
+// Connects to a coordinator and evolves whichever island it is handed.
+// Only the thread counts of `threads` are used.
+extern void run_island_worker(const string& address, const IslandProblem&,
+                              const PipelineOptions& threads = PipelineOptions());
+
+// Coordinates a run over `address` with num_islands workers forked from
+// this process, which inherit the problem.
+extern IslandResult run_local_islands(const string& address, const vector<Genome>& founders,
+                                      size_t num_islands, const IslandOptions&, const IslandProblem&);
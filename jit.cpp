@@ -0,0 +1,381 @@
+#include "jit.hpp"
+#include "cache.hpp"
+#include <algorithm>
+#include <initializer_list>
+#include <stdexcept>
+#include <string.h>
+#include <unordered_map>
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#endif
+using namespace std;
+
+// Where jit_compile stops recording and leaves the rest to the interpreter
+const size_t MAX_TRACE_STEPS = 1024;
+const size_t MAX_TRACE_EXECUTIONS = 1 << 16;
+const size_t MAX_TRACE_PENDING = 1 << 20; // Over all recorded states
+
+static uint64_t hash_state(const uint64_t* active, size_t num_words,
+                           const AbsoluteAddress* pending, size_t num_pending,
+                           const vector<uint8_t>& branches) {
+  auto hash = hash_bytes(reinterpret_cast<const uint8_t*>(active), num_words * sizeof(uint64_t));
+  hash = hash_bytes(reinterpret_cast<const uint8_t*>(pending), num_pending * sizeof(AbsoluteAddress), hash);
+  return hash_bytes(branches.data(), branches.size(), hash);
+}
+
+// The extra_state of every OP_IF, which decides what each one waits on
+static void get_branch_states(const StepTrace& trace, const NodeStore& nodes, vector<uint8_t>& out) {
+  out.clear();
+  for_each(trace.branch_nodes.begin(), trace.branch_nodes.end(), [&] (AbsoluteAddress address) {
+      out.push_back(nodes.extra_state(address));
+  });
+}
+
+static bool same_state(const StepTrace& trace, size_t state, const uint64_t* active,
+                       const AbsoluteAddress* pending, size_t num_pending,
+                       const vector<uint8_t>& branches) {
+  auto words = trace.active.begin() + state * trace.num_active_words;
+  auto begin = trace.pending.begin() + trace.pending_begin[state];
+  auto end = trace.pending.begin() + trace.pending_begin[state + 1];
+  auto states = trace.branch_states.begin() + state * branches.size();
+  return equal(words, words + trace.num_active_words, active)
+    && size_t(end - begin) == num_pending && equal(begin, end, pending)
+    && equal(branches.begin(), branches.end(), states);
+}
+
+// The traced state the context is in, or SIZE_MAX
+static size_t find_state(const StepTrace& trace, const ExecutionContext& context) {
+  auto active = context.nodes.active();
+  auto& pending = context.pending_instructions;
+  size_t num_pending = pending.end() - pending.begin();
+  vector<uint8_t> branches;
+  get_branch_states(trace, context.nodes, branches);
+  auto hash = hash_state(active, trace.num_active_words, pending.begin(), num_pending, branches);
+  auto match = lower_bound(trace.index.begin(), trace.index.end(), make_pair(hash, size_t(0)));
+  for (; match != trace.index.end() && match->first == hash; ++match)
+    if (same_state(trace, match->second, active, pending.begin(), num_pending, branches))
+      return match->second;
+  return SIZE_MAX;
+}
+
+// Whether every OP_IF that took its condition in the step went the way it
+// did when the step was recorded
+static bool took_traced_branches(const StepTrace& trace, size_t step, const NodeStore& nodes) {
+  auto begin = trace.guards.begin() + trace.guards_begin[step];
+  auto end = trace.guards.begin() + trace.guards_begin[step + 1];
+  return all_of(begin, end, [&] (const pair<AbsoluteAddress, uint8_t>& guard) {
+      return nodes.extra_state(guard.first) == guard.second;
+  });
+}
+
+static void install_state(ExecutionContext& context, const StepTrace& trace, size_t state) {
+  auto words = trace.active.begin() + state * trace.num_active_words;
+  copy(words, words + trace.num_active_words, context.nodes.active());
+  auto& pending = context.pending_instructions;
+  pending.reset(context.program->size());
+  // Pushes go to the front, so the last of the order goes in first
+  for (auto i = trace.pending_begin[state + 1]; i > trace.pending_begin[state]; i--)
+    pending.push(trace.pending[i - 1]);
+}
+
+bool run_step_trace(ExecutionContext& context, int& max_iterations, StopReason& reason) {
+  auto trace = context.program->trace.get();
+  if (!trace || context.debug)
+    return false;
+  auto state = find_state(*trace, context);
+  auto num_steps = trace->steps.size();
+  bool loops = trace->cycle_start < num_steps;
+  if (state == SIZE_MAX || (!loops && state == num_steps))
+    return false;
+  long budget = max(max_iterations, 0);
+  long count = loops ? budget : min<long>(budget, num_steps - state);
+  auto outputs = &context.nodes.output(0);
+  auto registers = context.registers.data();
+  long ran = 0;
+  while (ran < count) {
+#ifdef VM_INSTRUMENT
+    for (auto e = trace->executed_begin[state]; e < trace->executed_begin[state + 1]; e++)
+      context.stats.executions[context.program->instructions[trace->executed[e]]]++;
+#endif
+    trace->steps[state](outputs, registers, &context);
+    ran++;
+    // A branch only changes what later steps wait on, so this step's
+    // scheduler state still holds; the interpreter takes over from there
+    bool on_trace = took_traced_branches(*trace, state, context.nodes);
+    if (++state == num_steps && loops)
+      state = trace->cycle_start;
+    if (!on_trace)
+      break;
+  }
+  install_state(context, *trace, state);
+  context.last_step_settled = trace->settled[state];
+  VM_INSTRUMENTED(context.stats.steps += ran);
+  if (!loops && state == num_steps && trace->end != STOP_ITERATION_LIMIT) {
+    reason = trace->end;
+    return true;
+  }
+  max_iterations -= ran;
+  if (max_iterations <= 0) {
+    reason = STOP_ITERATION_LIMIT;
+    return true;
+  }
+  return false;
+}
+
+#if defined(__x86_64__)
+
+bool jit_available() {
+  return true;
+}
+
+// Where record_execution appends, per thread
+static thread_local vector<AbsoluteAddress>* recording = nullptr;
+
+static bool record_execution(ExecutionContext& context, AbsoluteAddress address) {
+  recording->push_back(address);
+  return handler_for(context.program->instructions[address])(context, address);
+}
+
+// Steps the program on a scratch context, noting which nodes each step
+// runs, which way its OP_IFs go and the scheduler's state after it.
+// Returns false if there is nothing to trace, or the traced steps run BIND
+// or CUT.
+static bool record_trace(const Program& program, StepTrace& trace) {
+  for (size_t i = 0; i < program.size(); i++)
+    if (program.instructions[i] == OP_IF)
+      trace.branch_nodes.push_back(i);
+  auto recorder = make_shared<Program>(program);
+  recorder->trace.reset();
+  fill(recorder->handlers.begin(), recorder->handlers.end(), record_execution);
+  ExecutionContext scratch(recorder);
+  if (scratch.pending_instructions.empty())
+    return false;
+
+  trace.num_active_words = scratch.nodes.num_active_words();
+  trace.pending_begin.push_back(0);
+  trace.executed_begin.push_back(0);
+  trace.guards_begin.push_back(0);
+  unordered_multimap<uint64_t, size_t> seen;
+  vector<uint8_t> branches;
+  auto save_state = [&] () {
+    auto active = scratch.nodes.active();
+    auto& pending = scratch.pending_instructions;
+    get_branch_states(trace, scratch.nodes, branches);
+    trace.active.insert(trace.active.end(), active, active + trace.num_active_words);
+    trace.pending.insert(trace.pending.end(), pending.begin(), pending.end());
+    trace.pending_begin.push_back(trace.pending.size());
+    trace.branch_states.insert(trace.branch_states.end(), branches.begin(), branches.end());
+    trace.settled.push_back(scratch.settled());
+    return hash_state(active, trace.num_active_words, pending.begin(), pending.end() - pending.begin(), branches);
+  };
+  seen.insert(make_pair(save_state(), 0));
+  trace.cycle_start = SIZE_MAX;
+  recording = &trace.executed;
+  for (size_t state = 0; ; state++) {
+    if (scratch.pending_instructions.empty()) {
+      trace.end = STOP_DONE;
+      break;
+    }
+    if (state == MAX_TRACE_STEPS || trace.executed.size() > MAX_TRACE_EXECUTIONS
+        || trace.pending.size() > MAX_TRACE_PENDING) {
+      trace.end = STOP_ITERATION_LIMIT;
+      break;
+    }
+    try {
+      scratch.step();
+    } catch (const logic_error&) {
+      recording = nullptr;
+      return false;
+    }
+    // An OP_IF left in state 1 or 2 took its condition this step
+    for (auto e = trace.executed_begin.back(); e < trace.executed.size(); e++) {
+      auto address = trace.executed[e];
+      auto branch = scratch.nodes.extra_state(address);
+      if (program.instructions[address] == OP_IF && branch != 0)
+        trace.guards.push_back(make_pair(address, branch));
+    }
+    trace.guards_begin.push_back(trace.guards.size());
+    trace.executed_begin.push_back(trace.executed.size());
+    auto hash = save_state();
+    if (scratch.settled()) {
+      trace.end = STOP_FIXED_POINT;
+      break;
+    }
+    auto& pending = scratch.pending_instructions;
+    auto earlier = seen.equal_range(hash);
+    auto match = find_if(earlier.first, earlier.second, [&] (const pair<const uint64_t, size_t>& entry) {
+        return same_state(trace, entry.second, scratch.nodes.active(), pending.begin(), pending.end() - pending.begin(),
+                          branches);
+    });
+    if (match != earlier.second) {
+      trace.cycle_start = match->second;
+      break;
+    }
+    seen.insert(make_pair(hash, state + 1));
+  }
+  recording = nullptr;
+  if (trace.cycle_start == SIZE_MAX)
+    trace.cycle_start = trace.executed_begin.size() - 1;
+  trace.index.assign(seen.begin(), seen.end());
+  sort(trace.index.begin(), trace.index.end());
+  return true;
+}
+
+// Emits the few instructions the steps need. Inside a step rdi holds the
+// outputs and rsi the registers; all three arguments are kept on the stack
+// for handler calls.
+struct Assembler {
+  vector<uint8_t> code;
+
+  void bytes(initializer_list<uint8_t> bs) {
+    code.insert(code.end(), bs);
+  }
+  void u32(uint32_t value) {
+    for (int i = 0; i < 4; i++)
+      code.push_back(value >> (8 * i));
+  }
+  void u64(uint64_t value) {
+    for (int i = 0; i < 8; i++)
+      code.push_back(value >> (8 * i));
+  }
+  // push rdi; push rsi; push rdx, which leaves the stack 16-byte aligned
+  // for calls
+  void prologue() { bytes({0x57, 0x56, 0x52}); }
+  // add rsp, 24; ret
+  void epilogue() { bytes({0x48, 0x83, 0xC4, 0x18, 0xC3}); }
+  // movsx eax/ecx, byte [rdi + address]
+  void load_output_eax(AbsoluteAddress address) { bytes({0x0F, 0xBE, 0x87}); u32(address); }
+  void load_output_ecx(AbsoluteAddress address) { bytes({0x0F, 0xBE, 0x8F}); u32(address); }
+  // mov byte [rdi + address], al
+  void store_output_al(AbsoluteAddress address) { bytes({0x88, 0x87}); u32(address); }
+  // handler(context, address), then reload the arguments it clobbered.
+  // Handlers must not throw: the generated code has no unwind information.
+  void call_handler(NodeHandler handler, AbsoluteAddress address) {
+    bytes({0x48, 0x8B, 0x3C, 0x24});       // mov rdi, [rsp]
+    bytes({0xBE});                         // mov esi, address
+    u32(address);
+    bytes({0x48, 0xB8});                   // mov rax, handler
+    u64(reinterpret_cast<uint64_t>(handler));
+    bytes({0xFF, 0xD0});                   // call rax
+    bytes({0x48, 0x8B, 0x7C, 0x24, 0x10}); // mov rdi, [rsp + 16]
+    bytes({0x48, 0x8B, 0x74, 0x24, 0x08}); // mov rsi, [rsp + 8]
+  }
+};
+
+// Mirrors the handlers in vm.cpp, minus the active flags, which the trace
+// already knows.
+static void emit_node(Assembler& as, const Program& program, AbsoluteAddress address) {
+  auto instruction = program.instructions[address];
+  auto operand = [&] (int i) { return program.operand(address, i); };
+  auto register_index = uint8_t(program.immediates[address]) % MAX_REGISTERS;
+  switch (instruction) {
+  case OP_BLOCK1:
+  case OP_BLOCK2:
+  case OP_BLOCK3:
+  case OP_BLOCK4:
+  case OP_NOP:
+  case OP_TRIGGER:
+    return;
+  case OP_CONST:
+    // mov byte [rdi + address], imm8
+    as.bytes({0xC6, 0x87});
+    as.u32(address);
+    as.bytes({uint8_t(program.immediates[address])});
+    return;
+  case OP_GET_REGISTER:
+    // movzx eax, byte [rsi + index]
+    as.bytes({0x0F, 0xB6, 0x86});
+    as.u32(register_index);
+    as.store_output_al(address);
+    return;
+  case OP_SET_REGISTER:
+    as.load_output_eax(operand(0));
+    // mov byte [rsi + index], al
+    as.bytes({0x88, 0x86});
+    as.u32(register_index);
+    as.store_output_al(address);
+    return;
+  case OP_ADD:
+  case OP_DIVIDE:
+  case OP_GEQ:
+  case OP_LEQ:
+  case OP_MULTIPLY:
+  case OP_SUBTRACT:
+    as.load_output_eax(operand(0));
+    as.load_output_ecx(operand(1));
+    switch (instruction) {
+    case OP_ADD:      as.bytes({0x01, 0xC8}); break;                     // add eax, ecx
+    case OP_SUBTRACT: as.bytes({0x29, 0xC8}); break;                     // sub eax, ecx
+    case OP_MULTIPLY: as.bytes({0x0F, 0xAF, 0xC1}); break;               // imul eax, ecx
+    case OP_GEQ:      as.bytes({0x39, 0xC8, 0x0F, 0x9D, 0xC0}); break;   // cmp eax, ecx; setge al
+    case OP_LEQ:      as.bytes({0x39, 0xC8, 0x0F, 0x9E, 0xC0}); break;   // cmp eax, ecx; setle al
+    case OP_DIVIDE:
+      // test ecx, ecx; jz zero; cdq; idiv ecx; jmp done; zero: xor eax, eax
+      as.bytes({0x85, 0xC9, 0x74, 0x05, 0x99, 0xF7, 0xF9, 0xEB, 0x02, 0x31, 0xC0});
+      break;
+    default:
+      break;
+    }
+    as.store_output_al(address);
+    return;
+  case OP_GET_BYTE:
+  case OP_IF:
+  case OP_OUTPUT:
+  case OP_SET_BYTE:
+    as.call_handler(handler_for(instruction), address);
+    return;
+  default:
+    throw logic_error("No native code for " + instruction_names.at(instruction));
+  }
+}
+
+Program jit_compile(const Program& program) {
+  Program ret = program;
+  ret.trace.reset();
+  auto trace = make_shared<StepTrace>();
+  if (!record_trace(program, *trace))
+    return ret;
+
+  Assembler as;
+  auto num_steps = trace->executed_begin.size() - 1;
+  vector<size_t> starts;
+  for (size_t step = 0; step < num_steps; step++) {
+    starts.push_back(as.code.size());
+    as.prologue();
+    for (auto e = trace->executed_begin[step]; e < trace->executed_begin[step + 1]; e++)
+      emit_node(as, program, trace->executed[e]);
+    as.epilogue();
+    while (as.code.size() % 16)
+      as.bytes({0xCC}); // int3 between steps
+  }
+
+  auto size = as.code.size();
+  void* buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffer == MAP_FAILED)
+    return ret; // Stay on the interpreter
+  memcpy(buffer, as.code.data(), size);
+  if (mprotect(buffer, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(buffer, size);
+    return ret;
+  }
+  trace->code = shared_ptr<const void>(buffer, [size] (const void* code) {
+      munmap(const_cast<void*>(code), size);
+  });
+  transform(starts.begin(), starts.end(), back_inserter(trace->steps), [&] (size_t start) {
+      return reinterpret_cast<NativeStep>(static_cast<uint8_t*>(buffer) + start);
+  });
+  ret.trace = trace;
+  return ret;
+}
+
+#else
+
+bool jit_available() {
+  return false;
+}
+
+Program jit_compile(const Program& program) {
+  return program;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "program.hpp"
+#include "vm.hpp"
+#include <memory>
+#include <vector>
+using namespace std;
+
+// Native code for the steps of a run, on x86-64.
+//
+// Which nodes a step runs depends only on which nodes ran before it and on
+// which way each OP_IF went, never on other values, so without OP_IF the
+// schedule of a run is the same for every input. jit_compile records it
+// once by running the interpreter on a scratch context until the run ends,
+// settles, comes back to a state it was in before or the trace gets too
+// long, and emits every step as straight-line machine code with operand
+// indices, immediates and register numbers baked in: no worklist, no
+// readiness checks and no dispatch. OP_IF, OP_OUTPUT and the byte
+// instructions call their interpreter handlers. A run that comes back to
+// an earlier state loops over the steps since then for as long as it is
+// allowed to.
+//
+// A traced state includes every OP_IF's extra_state. The trace follows the
+// branches the scratch run took; after a step in which an OP_IF takes the
+// other branch, the run leaves the trace and the interpreter carries on.
+// Taking a condition does not change which nodes the step itself runs, so
+// the scheduler state after that step is still the traced one.
+//
+// Programs that run BIND or CUT within the traced steps get no trace. On
+// other architectures the program is returned unchanged.
+extern bool jit_available();
+
+// One traced step: node outputs, registers, context
+typedef void (*NativeStep)(Data*, Data*, ExecutionContext*);
+
+struct StepTrace {
+  vector<NativeStep> steps; // steps[i] takes the run from state i to i + 1
+  size_t cycle_start;       // State steps.size() is state cycle_start; or
+                            // steps.size() when the trace does not loop
+  StopReason end;           // Without a loop: STOP_DONE, STOP_FIXED_POINT or,
+                            // for a trace cut short, STOP_ITERATION_LIMIT
+  // The scheduler's state before each step and after the last, handed back
+  // to the interpreter when a traced run stops
+  size_t num_active_words;
+  vector<uint64_t> active;         // num_active_words per state
+  vector<size_t> pending_begin;    // Into pending, per state and one past the end
+  vector<AbsoluteAddress> pending; // In visiting order
+  vector<bool> settled;
+  vector<size_t> executed_begin;   // Into executed, per step and one past the end
+  vector<AbsoluteAddress> executed;
+  vector<AbsoluteAddress> branch_nodes; // Every OP_IF, in program order
+  vector<uint8_t> branch_states;        // Their extra_states, per state
+  vector<size_t> guards_begin;          // Into guards, per step and one past the end
+  vector<pair<AbsoluteAddress, uint8_t> > guards; // OP_IFs that took their
+                                                  // condition, and the state
+                                                  // they went into
+  vector<pair<uint64_t, size_t> > index; // Hash of each distinct state, sorted
+  shared_ptr<const void> code;
+};
+
+// A copy of the program carrying a StepTrace, where it can have one. The
+// code buffer is owned by the returned Program and its copies.
+extern Program jit_compile(const Program&);
+
+// Runs steps from the trace when the context's active flags and pending
+// list match a traced state, as they do after reset(), then installs the
+// flags and pending list the interpreter would have reached. Node outputs,
+// registers, bytes and output_data are the context's own throughout.
+// Returns true with the reason when the run is over, or false after
+// taking the steps it ran off max_iterations. Statistics count steps and
+// executions, not stalls or cycles.
+extern bool run_step_trace(ExecutionContext&, int& max_iterations, StopReason&);
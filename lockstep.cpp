@@ -0,0 +1,407 @@
+#include "lockstep.hpp"
+#include "batch.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+using namespace std;
+
+// Lane arithmetic. Every result is truncated to a byte exactly as the
+// scalar handlers truncate their int results.
+static Lanes splat(Data value) {
+  Lanes ret;
+  fill(ret.lane, ret.lane + LANES, value);
+  return ret;
+}
+
+#if defined(__GNUC__) && !defined(LOCKSTEP_SCALAR)
+typedef int8_t SignedVector __attribute__((vector_size(LANES)));
+typedef uint8_t UnsignedVector __attribute__((vector_size(LANES)));
+
+// Wrapping arithmetic is done unsigned to keep it well-defined
+#define LANEWISE(name, type, expression)                        \
+  static Lanes name(const Lanes& _a, const Lanes& _b) {         \
+    type a, b;                                                  \
+    memcpy(&a, _a.lane, LANES);                                 \
+    memcpy(&b, _b.lane, LANES);                                 \
+    type result = (type)(expression);                           \
+    Lanes ret;                                                  \
+    memcpy(ret.lane, &result, LANES);                           \
+    return ret;                                                 \
+  }
+LANEWISE(lanes_add, UnsignedVector, a + b)
+LANEWISE(lanes_subtract, UnsignedVector, a - b)
+LANEWISE(lanes_multiply, UnsignedVector, a * b)
+LANEWISE(lanes_geq, SignedVector, -(a >= b))
+LANEWISE(lanes_leq, SignedVector, -(a <= b))
+#undef LANEWISE
+
+static Lanes lanes_select(const Lanes& _mask, const Lanes& _a, const Lanes& _b) {
+  UnsignedVector mask, a, b;
+  memcpy(&mask, _mask.lane, LANES);
+  memcpy(&a, _a.lane, LANES);
+  memcpy(&b, _b.lane, LANES);
+  UnsignedVector result = (a & mask) | (b & ~mask);
+  Lanes ret;
+  memcpy(ret.lane, &result, LANES);
+  return ret;
+}
+#else
+#define LANEWISE(name, expression)                              \
+  static Lanes name(const Lanes& a, const Lanes& b) {           \
+    Lanes ret;                                                  \
+    for (int i = 0; i < LANES; i++)                             \
+      ret[i] = static_cast<Data>(expression);                   \
+    return ret;                                                 \
+  }
+LANEWISE(lanes_add, a[i] + b[i])
+LANEWISE(lanes_subtract, a[i] - b[i])
+LANEWISE(lanes_multiply, a[i] * b[i])
+LANEWISE(lanes_geq, a[i] >= b[i])
+LANEWISE(lanes_leq, a[i] <= b[i])
+#undef LANEWISE
+
+static Lanes lanes_select(const Lanes& mask, const Lanes& a, const Lanes& b) {
+  Lanes ret;
+  for (int i = 0; i < LANES; i++)
+    ret[i] = mask[i] ? a[i] : b[i];
+  return ret;
+}
+#endif
+
+// No vector unit divides bytes, so division is per lane in both builds.
+static Lanes lanes_divide(const Lanes& a, const Lanes& b) {
+  Lanes ret = splat(0);
+  for (int i = 0; i < LANES; i++)
+    if (b[i] != 0)
+      ret[i] = static_cast<Data>(a[i] / b[i]);
+  return ret;
+}
+
+static LaneMask all_lanes(int num_lanes) {
+  return num_lanes == 64 ? ~LaneMask(0) : (LaneMask(1) << num_lanes) - 1;
+}
+
+void LaneGroup::set_mask(LaneMask _mask) {
+  this->mask = _mask;
+  this->select = splat(0);
+  for (int i = 0; i < LANES; i++)
+    if ((_mask >> i) & 1)
+      this->select[i] = -1;
+}
+
+LockstepContext::LockstepContext(shared_ptr<const Program> _program, int _num_lanes)
+  : num_lanes(_num_lanes), self(nullptr, 0), program(_program) {
+  if (_num_lanes < 1 || _num_lanes > LANES)
+    throw logic_error("Bad # of lanes: " + to_string(_num_lanes));
+  auto num_nodes = _program->size();
+  this->input_data.resize(_num_lanes);
+  this->output_data.resize(_num_lanes);
+  this->registers.assign(MAX_REGISTERS, splat(0));
+  this->outputs.assign(num_nodes, splat(0));
+  this->targets.resize(_num_lanes);
+
+  LaneGroup group;
+  group.set_mask(all_lanes(_num_lanes));
+  group.active.assign((num_nodes + 63) / 64, 0);
+  group.extra_state.assign(num_nodes, 0);
+  group.pending.reset(num_nodes);
+  group.settled = false;
+  auto& triggers = _program->triggers;
+  for_each(triggers.begin(), triggers.end(), [&] (AbsoluteAddress address) {
+      group.pending.push(address);
+  });
+  this->groups.push_back(group);
+}
+
+bool LockstepContext::done() const {
+  return all_of(this->groups.begin(), this->groups.end(), [] (const LaneGroup& group) {
+      return group.pending.empty();
+  });
+}
+
+void LockstepContext::step() {
+  for_each(this->groups.begin(), this->groups.end(), [&] (LaneGroup& group) {
+      if (!group.pending.empty() && !group.settled)
+        this->step_group(group);
+  });
+  this->split_divergent_groups();
+}
+
+void LockstepContext::load_genome(ByteSpan genome) {
+  this->self = genome;
+  this->self_pages.reset();
+  this->targets.assign(this->num_lanes, PagedMemory());
+}
+
+StopReason LockstepContext::step_until_done(int max_iterations) {
+  while (!this->done()) {
+    if (max_iterations-- <= 0)
+      return STOP_ITERATION_LIMIT;
+    this->step();
+    auto settled = all_of(this->groups.begin(), this->groups.end(), [] (const LaneGroup& group) {
+        return group.settled || group.pending.empty();
+    });
+    if (settled && !this->done())
+      return STOP_FIXED_POINT;
+  }
+  return STOP_DONE;
+}
+
+// Mirrors ExecutionContext::step for the lanes of one group.
+void LockstepContext::step_group(LaneGroup& group) {
+  auto& pending = group.pending;
+  auto num_pending = pending.size();
+  bool executed = false;
+  pending.begin_step();
+  for_each(pending.step_begin(), pending.step_end(), [&] (AbsoluteAddress address) {
+      if (this->should_execute(group, address)) {
+        executed = true;
+        if (this->execute_node(group, address)) {
+          group.set_active(address);
+          pending.retire(address);
+          return;
+        }
+      } else {
+        this->ensure_dependencies_are_triggered(group, address);
+      }
+      pending.keep(address);
+  });
+  pending.end_step();
+  group.settled = !executed && pending.size() == num_pending;
+}
+
+// Gives every lane that took the other branch of a divergent OP_IF its own
+// copy of the group, with that OP_IF in the state its condition chose.
+void LockstepContext::split_divergent_groups() {
+  auto num_groups = this->groups.size();
+  for (size_t i = 0; i < num_groups; i++) {
+    auto divergent = this->groups[i].divergent;
+    if (divergent.empty())
+      continue;
+    this->groups[i].divergent.clear();
+    vector<size_t> family{ i };
+    for_each(divergent.begin(), divergent.end(), [&] (const pair<AbsoluteAddress, LaneMask>& branch) {
+        auto address = branch.first;
+        auto odd = branch.second;
+        auto num_members = family.size();
+        for (size_t j = 0; j < num_members; j++) {
+          auto& group = this->groups[family[j]];
+          auto taken = group.mask & odd;
+          if (taken == group.mask) {
+            group.extra_state[address] = 1;
+          } else if (taken == 0) {
+            group.extra_state[address] = 2;
+          } else {
+            LaneGroup other = group;
+            other.set_mask(group.mask & ~odd);
+            other.extra_state[address] = 2;
+            group.set_mask(taken);
+            group.extra_state[address] = 1;
+            this->groups.push_back(other);
+            family.push_back(this->groups.size() - 1);
+          }
+        }
+    });
+  }
+}
+
+bool LockstepContext::should_execute(const LaneGroup& group, AbsoluteAddress address) {
+  auto& compiled = this->program->compiled[address];
+  auto extra_state = group.extra_state[address];
+  return all_of(compiled.waits_begin(extra_state), compiled.waits_end(extra_state), [&] (AbsoluteAddress dependency) {
+      return group.is_active(dependency);
+  });
+}
+
+void LockstepContext::ensure_dependencies_are_triggered(LaneGroup& group, AbsoluteAddress address) {
+  auto& compiled = this->program->compiled[address];
+  auto extra_state = group.extra_state[address];
+  for_each(compiled.waits_begin(extra_state), compiled.waits_end(extra_state), [&] (AbsoluteAddress dependency) {
+      if (group.is_active(dependency))
+        return;
+      group.pending.push(dependency);
+  });
+}
+
+Lanes LockstepContext::consume_operand(LaneGroup& group, AbsoluteAddress address, int operand) {
+  auto source = this->program->operand(address, operand);
+  group.clear_active(source);
+  return this->outputs[source];
+}
+
+void LockstepContext::write_output(const LaneGroup& group, AbsoluteAddress address, const Lanes& value) {
+  auto& output = this->outputs[address];
+  output = lanes_select(group.select, value, output);
+}
+
+void LockstepContext::write_register(const LaneGroup& group, Data index, const Lanes& value) {
+  auto& reg = this->registers[static_cast<uint8_t>(index) % this->registers.size()];
+  reg = lanes_select(group.select, value, reg);
+}
+
+bool LockstepContext::execute_node(LaneGroup& group, AbsoluteAddress address) {
+  auto& program = *this->program;
+  auto binop = [&] (Lanes (*op)(const Lanes&, const Lanes&)) {
+    auto i1 = this->consume_operand(group, address, 0);
+    auto i2 = this->consume_operand(group, address, 1);
+    this->write_output(group, address, op(i1, i2));
+  };
+  switch (program.instructions[address]) {
+  case OP_ADD:
+    binop(lanes_add); break;
+  case OP_SUBTRACT:
+    binop(lanes_subtract); break;
+  case OP_MULTIPLY:
+    binop(lanes_multiply); break;
+  case OP_DIVIDE:
+    binop(lanes_divide); break;
+  case OP_GEQ:
+    binop(lanes_geq); break;
+  case OP_LEQ:
+    binop(lanes_leq); break;
+  case OP_BLOCK1:
+  case OP_BLOCK2:
+  case OP_BLOCK3:
+  case OP_BLOCK4:
+  case OP_NOP:
+  case OP_TRIGGER:
+    break;
+  case OP_CONST:
+    this->write_output(group, address, splat(program.immediates[address])); break;
+  case OP_GET_REGISTER: {
+    auto index = static_cast<uint8_t>(program.immediates[address]) % this->registers.size();
+    this->write_output(group, address, this->registers[index]);
+    break;
+  }
+  case OP_SET_REGISTER: {
+    auto value = this->consume_operand(group, address, 0);
+    this->write_register(group, program.immediates[address], value);
+    this->write_output(group, address, value);
+    break;
+  }
+  case OP_IF:
+    return this->handle_OP_IF(group, address);
+  case OP_OUTPUT:
+    this->handle_OP_OUTPUT(group, address); break;
+  case OP_GET_BYTE:
+    this->handle_OP_GET_BYTE(group, address); break;
+  case OP_SET_BYTE:
+    this->handle_OP_SET_BYTE(group, address); break;
+  case OP_BIND:
+  case OP_CUT:
+    throw logic_error("Unimplemented instruction");
+  default:
+    throw logic_error("Unhandled instruction" + show_instruction_node(program.nodes[address]));
+  }
+  return true;
+}
+
+bool LockstepContext::handle_OP_IF(LaneGroup& group, AbsoluteAddress address) {
+  auto& extra_state = group.extra_state[address];
+  Lanes cond, d;
+  LaneMask odd = 0;
+  switch (extra_state) {
+  case 0:
+    cond = this->consume_operand(group, address, 0);
+    for (int i = 0; i < this->num_lanes; i++)
+      if (cond[i] % 2)
+        odd |= LaneMask(1) << i;
+    odd &= group.mask;
+    if (odd != 0 && odd != group.mask)
+      group.divergent.push_back(make_pair(address, odd));
+    extra_state = odd ? 1 : 2;
+    return false;
+  case 1:
+  case 2:
+    d = this->consume_operand(group, address, extra_state);
+    extra_state = 0;
+    this->write_output(group, address, d);
+    return true;
+  }
+  throw logic_error("OP_IF in invalid state");
+}
+
+void LockstepContext::handle_OP_OUTPUT(LaneGroup& group, AbsoluteAddress address) {
+  auto data = this->consume_operand(group, address, 0);
+  for (int i = 0; i < this->num_lanes; i++)
+    if ((group.mask >> i) & 1)
+      this->output_data[i].push_back(data[i]);
+}
+
+void LockstepContext::handle_OP_GET_BYTE(LaneGroup& group, AbsoluteAddress address) {
+  auto index = this->consume_operand(group, address, 0);
+  auto ring = translate_ring(this->program->immediates[address]);
+  Lanes data = splat(0);
+  for (int i = 0; i < this->num_lanes; i++) {
+    if (!((group.mask >> i) & 1))
+      continue;
+    auto position = static_cast<uint8_t>(index[i]);
+    if (ring == RING_TARGET)
+      data[i] = this->targets[i].get(position);
+    else if (position < this->self.size)
+      data[i] = this->self.data[position];
+  }
+  this->write_output(group, address, data);
+}
+
+void LockstepContext::handle_OP_SET_BYTE(LaneGroup& group, AbsoluteAddress address) {
+  auto index = this->consume_operand(group, address, 0);
+  auto value = this->consume_operand(group, address, 1);
+  if (translate_ring(this->program->immediates[address]) == RING_TARGET) {
+    if (!this->self_pages && this->self.size > 0) {
+      this->self_pages = make_shared<const PagedMemory>(this->self);
+      for_each(this->targets.begin(), this->targets.end(), [&] (PagedMemory& target) {
+          target.set_base(this->self_pages);
+      });
+    }
+    for (int i = 0; i < this->num_lanes; i++)
+      if ((group.mask >> i) & 1)
+        this->targets[i].set(static_cast<uint8_t>(index[i]), value[i]);
+  }
+  this->write_output(group, address, value);
+}
+
+// Appends the runs of every input to outputs, and their targets to
+// targets if given.
+static void run_lockstep(shared_ptr<const Program> program, ByteSpan genome,
+                         const vector<vector<Data> >& inputs, int max_iterations,
+                         vector<vector<Data> >& outputs, vector<PagedMemory>* targets) {
+  outputs.reserve(outputs.size() + inputs.size());
+  if (targets)
+    targets->reserve(targets->size() + inputs.size());
+  for (size_t first = 0; first < inputs.size(); first += LANES) {
+    int count = min<size_t>(LANES, inputs.size() - first);
+    LockstepContext context(program, count);
+    context.load_genome(genome);
+    copy(inputs.begin() + first, inputs.begin() + first + count, context.input_data.begin());
+    context.step_until_done(max_iterations);
+    outputs.insert(outputs.end(), context.output_data.begin(), context.output_data.end());
+    if (targets)
+      targets->insert(targets->end(), context.targets.begin(), context.targets.end());
+  }
+}
+
+vector<vector<Data> > evaluate_lockstep(shared_ptr<const Program> program,
+                                        const vector<vector<Data> >& inputs,
+                                        int max_iterations) {
+  vector<vector<Data> > ret;
+  run_lockstep(program, ByteSpan(nullptr, 0), inputs, max_iterations, ret, nullptr);
+  return ret;
+}
+
+bool lockstep_supports(const Program& program) {
+  return none_of(program.instructions.begin(), program.instructions.end(), [] (Instruction instruction) {
+      return instruction == OP_BIND || instruction == OP_CUT;
+  });
+}
+
+vector<vector<Data> > evaluate_batch_lockstep(ExecutionContext& context,
+                                              const vector<vector<Data> >& inputs,
+                                              int max_iterations,
+                                              vector<PagedMemory>* targets) {
+  if (inputs.size() < 2 || !lockstep_supports(*context.program))
+    return evaluate_batch(context, inputs, max_iterations, targets);
+  vector<vector<Data> > ret;
+  run_lockstep(context.program, context.self, inputs, max_iterations, ret, targets);
+  return ret;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "memory.hpp"
+#include "program.hpp"
+#include "vm.hpp"
+#include "worklist.hpp"
+#include <memory>
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+// Lockstep interpreter: runs up to LANES test cases of one program at once,
+// with every node output and register holding one byte per test case.
+//
+// Lanes only diverge at OP_IF, whose condition picks which input it waits
+// on next. Lanes that agree share a LaneGroup with a single worklist and
+// set of active bits, so each lane is scheduled exactly as a scalar
+// ExecutionContext would schedule it. When an OP_IF condition disagrees
+// within a group, the group is split in two at the end of the step.
+//
+// Every lane reads the same genome as ring 0 and writes its own target, so
+// the byte instructions run lane by lane.
+//
+// A group whose step runs nothing is settled and is not stepped again; once
+// every group with work is settled the run is at a fixed point.
+//
+// Arithmetic uses GCC vector extensions; define LOCKSTEP_SCALAR to build
+// the plain per-lane loops instead. Both give the same bytes as
+// ExecutionContext.
+
+const int LANES = 32;
+typedef uint64_t LaneMask;
+
+// One byte per lane. Kept as a plain array so it can live in a vector;
+// lockstep.cpp loads it into vector registers to operate on it.
+struct Lanes {
+  Data lane[LANES];
+  Data& operator[](int i) { return lane[i]; }
+  const Data& operator[](int i) const { return lane[i]; }
+};
+
+struct LaneGroup {
+  LaneMask mask;
+  Lanes select; // -1 in member lanes, 0 elsewhere
+  vector<uint64_t> active;
+  vector<uint8_t> extra_state;
+  Worklist pending;
+  bool settled; // The last step ran nothing, so every later one would too
+  // OP_IF nodes whose condition was odd in only some lanes this step
+  vector<pair<AbsoluteAddress, LaneMask> > divergent;
+
+  void set_mask(LaneMask);
+  bool is_active(AbsoluteAddress address) const {
+    return (active[address >> 6] >> (address & 63)) & 1;
+  }
+  void set_active(AbsoluteAddress address) {
+    active[address >> 6] |= uint64_t(1) << (address & 63);
+  }
+  void clear_active(AbsoluteAddress address) {
+    active[address >> 6] &= ~(uint64_t(1) << (address & 63));
+  }
+};
+
+struct LockstepContext {
+  int num_lanes;
+  vector<vector<Data> > input_data;
+  vector<vector<Data> > output_data;
+  vector<Lanes> registers;
+  vector<Lanes> outputs;
+  ByteSpan self;                            // Ring 0 for every lane; see load_genome
+  shared_ptr<const PagedMemory> self_pages; // Built on the first target write
+  vector<PagedMemory> targets;              // Ring 1, per lane
+  vector<LaneGroup> groups;
+  shared_ptr<const Program> program;
+
+  bool done() const;
+  void step();
+  StopReason step_until_done(int max_iterations);
+  // As ExecutionContext::load_genome, for every lane
+  void load_genome(ByteSpan);
+  LockstepContext(shared_ptr<const Program>, int num_lanes);
+private:
+  void step_group(LaneGroup&);
+  void split_divergent_groups();
+  bool should_execute(const LaneGroup&, AbsoluteAddress);
+  void ensure_dependencies_are_triggered(LaneGroup&, AbsoluteAddress);
+  bool execute_node(LaneGroup&, AbsoluteAddress); // Returns whether should delist node
+  Lanes consume_operand(LaneGroup&, AbsoluteAddress, int);
+  void write_output(const LaneGroup&, AbsoluteAddress, const Lanes&);
+  void write_register(const LaneGroup&, Data, const Lanes&);
+  bool handle_OP_IF(LaneGroup&, AbsoluteAddress);
+  void handle_OP_OUTPUT(LaneGroup&, AbsoluteAddress);
+  void handle_OP_GET_BYTE(LaneGroup&, AbsoluteAddress);
+  void handle_OP_SET_BYTE(LaneGroup&, AbsoluteAddress);
+};
+
+// Like evaluate_batch, but runs the inputs LANES at a time.
+extern vector<vector<Data> > evaluate_lockstep(shared_ptr<const Program>,
+                                               const vector<vector<Data> >& inputs,
+                                               int max_iterations);
+
+// Whether lockstep runs the program as ExecutionContext would. OP_BIND and
+// OP_CUT throw in both, but only the scalar context says which input.
+extern bool lockstep_supports(const Program&);
+
+// As evaluate_batch on a context, but runs the inputs LANES at a time on
+// the context's genome when there are several and lockstep_supports the
+// program. Lockstep runs add nothing to the context's stats.
+extern vector<vector<Data> > evaluate_batch_lockstep(ExecutionContext&,
+                                                     const vector<vector<Data> >& inputs,
+                                                     int max_iterations,
+                                                     vector<PagedMemory>* targets = nullptr);
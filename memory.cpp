@@ -0,0 +1,73 @@
+#include "memory.hpp"
+#include <algorithm>
+using namespace std;
+
+PagedMemory::PagedMemory(ByteSpan bytes) : length(0) {
+  for (size_t i = 0; i < bytes.size; i++)
+    this->set(i, bytes.data[i]);
+}
+
+PagedMemory::PagedMemory(shared_ptr<const PagedMemory> _base) : base(_base), length(0) { }
+
+bool PagedMemory::is_written(size_t position) const {
+  auto index = position / PAGE_SIZE, offset = position % PAGE_SIZE;
+  return index < this->slots.size() && (this->slots[index].written >> offset & 1);
+}
+
+int8_t PagedMemory::get(size_t position) const {
+  if (!this->is_written(position))
+    return 0;
+  return (*this->slots[position / PAGE_SIZE].page)[position % PAGE_SIZE];
+}
+
+void PagedMemory::set(size_t position, int8_t value) {
+  auto index = position / PAGE_SIZE, offset = position % PAGE_SIZE;
+  if (index >= this->slots.size())
+    this->slots.resize(index + 1);
+  auto& slot = this->slots[index];
+  if (!slot.page && this->base && index < this->base->slots.size()) {
+    auto& borrowed = this->base->slots[index].page;
+    if (borrowed && (*borrowed)[offset] == value)
+      slot.page = borrowed;
+  }
+  if (!slot.page) {
+    slot.page = make_shared<Page>();
+    slot.page->fill(0);
+  }
+  // Shared pages are never written, not even with the byte they hold
+  if ((*slot.page)[offset] != value) {
+    if (slot.page.use_count() > 1)
+      slot.page = make_shared<Page>(*slot.page);
+    (*slot.page)[offset] = value;
+  }
+  slot.written |= uint32_t(1) << offset;
+  this->length = max(this->length, position + 1);
+}
+
+void PagedMemory::set_base(shared_ptr<const PagedMemory> _base) {
+  this->base = _base;
+}
+
+void PagedMemory::clear() {
+  this->slots.clear();
+  this->length = 0;
+}
+
+vector<int8_t> PagedMemory::bytes() const {
+  vector<int8_t> ret(this->length);
+  for (size_t i = 0; i < this->length; i++)
+    ret[i] = this->get(i);
+  return ret;
+}
+
+size_t PagedMemory::borrowed_pages() const {
+  return this->base ? this->shared_pages(*this->base) : 0;
+}
+
+size_t PagedMemory::shared_pages(const PagedMemory& other) const {
+  size_t ret = 0;
+  for (size_t i = 0; i < min(this->slots.size(), other.slots.size()); i++)
+    if (this->slots[i].page && this->slots[i].page == other.slots[i].page)
+      ret++;
+  return ret;
+}
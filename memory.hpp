@@ -0,0 +1,61 @@
+#pragma once
+
+#include "ast.hpp"
+#include <array>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+// The byte memories OP_GET_BYTE and OP_SET_BYTE address by ring. Ring 0 is
+// the running genome itself, which is read-only; ring 1 is the target a
+// replicator copies into. Rings wrap around like register indices.
+enum MemoryRing { RING_SELF, RING_TARGET, NUM_RINGS };
+
+// Byte indices are unsigned, so each ring spans this many bytes
+const size_t RING_SIZE = 256;
+
+inline MemoryRing translate_ring(Ring ring) {
+  return MemoryRing(static_cast<uint8_t>(ring) % NUM_RINGS);
+}
+
+const size_t PAGE_SIZE = 32;
+
+// Byte memory made of fixed-size pages held by shared pointer. Copying a
+// PagedMemory shares all of its pages; a page is copied only when a write
+// would change a byte of it while someone else still holds it. Bytes that
+// were never written read as 0.
+//
+// A memory can be given a base, such as the genome a replicator runs as:
+// the first write to one of its pages borrows the base's page when the
+// byte written matches it. A faithful copy of the base therefore ends up
+// holding the base's own pages, and only the pages where it differs are
+// allocated.
+struct PagedMemory {
+  PagedMemory() : length(0) { }
+  explicit PagedMemory(ByteSpan);
+  explicit PagedMemory(shared_ptr<const PagedMemory> base);
+  size_t size() const { return length; } // One past the last byte written
+  size_t num_pages() const { return slots.size(); }
+  bool is_written(size_t position) const;
+  int8_t get(size_t position) const;
+  void set(size_t position, int8_t value);
+  void clear(); // Forgets every write; keeps the base
+  void set_base(shared_ptr<const PagedMemory>); // For writes from now on
+  vector<int8_t> bytes() const;
+  // How many of this memory's pages are the very pages `other` holds
+  size_t shared_pages(const PagedMemory& other) const;
+  // The same, against the base; 0 without one
+  size_t borrowed_pages() const;
+
+private:
+  typedef array<int8_t, PAGE_SIZE> Page;
+  struct Slot {
+    shared_ptr<Page> page; // Null until the first write to the page
+    uint32_t written;      // One bit per byte of the page
+    Slot() : written(0) { }
+  };
+  vector<Slot> slots;
+  shared_ptr<const PagedMemory> base;
+  size_t length;
+};
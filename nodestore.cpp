@@ -0,0 +1,15 @@
+#include "nodestore.hpp"
+#include <algorithm>
+using namespace std;
+
+void NodeStore::reset(size_t _num_nodes) {
+  this->num_nodes = _num_nodes;
+  auto active_bytes = this->num_active_words() * sizeof(uint64_t);
+  this->arena.reset(arena_bytes(active_bytes) + 2 * arena_bytes(_num_nodes));
+  this->active_at = this->arena.carve(active_bytes);
+  this->outputs_at = this->arena.carve(_num_nodes);
+  this->extra_state_at = this->arena.carve(_num_nodes);
+  fill_n(this->active(), this->num_active_words(), 0);
+  fill_n(&this->output(0), _num_nodes, 0);
+  fill_n(&this->extra_state(0), _num_nodes, 0);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "arena.hpp"
+#include "ast.hpp"
+#include <stdint.h>
+using namespace std;
+
+// Mutable per-node state of a running program, stored as one contiguous
+// array per field. Active flags are packed 64 to a word so readiness checks
+// touch a handful of cache lines even for programs with thousands of nodes.
+// All three arrays are carved from a single arena.
+struct NodeStore {
+  NodeStore() : num_nodes(0), active_at(0), outputs_at(0), extra_state_at(0) { }
+  void reset(size_t num_nodes);
+  size_t size() const { return num_nodes; }
+  size_t num_active_words() const { return (num_nodes + 63) / 64; }
+  const Arena& storage() const { return arena; }
+
+  uint64_t* active() { return arena.at<uint64_t>(active_at); }
+  const uint64_t* active() const { return arena.at<uint64_t>(active_at); }
+  Data& output(AbsoluteAddress address) { return arena.at<Data>(outputs_at)[address]; }
+  Data output(AbsoluteAddress address) const { return arena.at<Data>(outputs_at)[address]; }
+  uint8_t& extra_state(AbsoluteAddress address) { return arena.at<uint8_t>(extra_state_at)[address]; }
+  uint8_t extra_state(AbsoluteAddress address) const { return arena.at<uint8_t>(extra_state_at)[address]; }
+  const Data* outputs() const { return arena.at<Data>(outputs_at); }
+  const uint8_t* extra_states() const { return arena.at<uint8_t>(extra_state_at); }
+
+  bool is_active(AbsoluteAddress address) const {
+    return (active()[address >> 6] >> (address & 63)) & 1;
+  }
+  void set_active(AbsoluteAddress address) {
+    active()[address >> 6] |= uint64_t(1) << (address & 63);
+  }
+  void clear_active(AbsoluteAddress address) {
+    active()[address >> 6] &= ~(uint64_t(1) << (address & 63));
+  }
+private:
+  Arena arena;
+  size_t num_nodes;
+  size_t active_at, outputs_at, extra_state_at;
+};
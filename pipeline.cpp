@@ -0,0 +1,261 @@
+#include "pipeline.hpp"
+#include "queue.hpp"
+#include "relift.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <thread>
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+const size_t NO_PARENT = ~size_t(0);
+
+// What each stage hands to the next. A child that is its parent with
+// point mutations, and nothing else, keeps the parent's index and the
+// edits so it can be re-lifted from the parent's nodes.
+struct BredChild {
+  size_t index;
+  Genome genome;
+  size_t parent; // NO_PARENT after crossover or truncation
+  vector<ByteEdit> edits;
+};
+
+struct LiftedChild {
+  size_t index;
+  Genome genome;
+  shared_ptr<const Program> program; // Null if lifting failed
+  string error;
+};
+
+static double seconds_since(Clock::time_point start) {
+  return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Waits for room in the queue; returns false if the run failed meanwhile.
+template <typename T>
+static bool push_waiting(BoundedQueue<T>& queue, T& item, StageStats& stats, const atomic<bool>& failed) {
+  while (!queue.try_push(item)) {
+    if (failed)
+      return false;
+    stats.full_waits++;
+    this_thread::yield();
+  }
+  return true;
+}
+
+// Waits for the next item; returns false once every producer has finished
+// and the queue is drained, or if the run failed.
+template <typename T>
+static bool pop_waiting(BoundedQueue<T>& queue, T& item, StageStats& stats,
+                        const atomic<int>& producers_left, const atomic<bool>& failed) {
+  while (!queue.try_pop(item)) {
+    if (failed)
+      return false;
+    if (producers_left == 0)
+      return queue.try_pop(item);
+    stats.empty_waits++;
+    this_thread::yield();
+  }
+  return true;
+}
+
+static size_t tournament(mt19937_64& rng, const vector<double>& fitness, int size) {
+  uniform_int_distribution<size_t> pick(0, fitness.size() - 1);
+  auto best = pick(rng);
+  for (int i = 1; i < size; i++) {
+    auto other = pick(rng);
+    if (fitness[other] > fitness[best])
+      best = other;
+  }
+  return best;
+}
+
+static void breed_child(const vector<Genome>& parents, const vector<double>& fitness,
+                        const PipelineOptions& options, mt19937_64& rng, BredChild& out) {
+  auto first_index = tournament(rng, fitness, options.tournament_size);
+  auto& first = parents[first_index];
+  auto& child = out.genome;
+  out.parent = NO_PARENT;
+  out.edits.clear();
+  if (uniform_real_distribution<double>(0, 1)(rng) < options.crossover_rate) {
+    // The head of one parent and the tail of another
+    auto& second = parents[tournament(rng, fitness, options.tournament_size)];
+    auto head = uniform_int_distribution<size_t>(0, first.size())(rng);
+    auto tail = uniform_int_distribution<size_t>(0, second.size())(rng);
+    child.assign(first.begin(), first.begin() + head);
+    child.insert(child.end(), second.begin() + tail, second.end());
+  } else {
+    child = first;
+    if (child.size() <= options.max_length)
+      out.parent = first_index;
+  }
+  if (child.size() > options.max_length)
+    child.resize(options.max_length);
+  if (child.empty())
+    return;
+  auto& edits = out.edits;
+  uniform_int_distribution<size_t> position(0, child.size() - 1);
+  uniform_int_distribution<int> value(-128, 127);
+  for (int i = uniform_int_distribution<int>(1, max(1, options.max_mutations))(rng); i > 0; i--)
+    edits.push_back(ByteEdit{position(rng), int8_t(value(rng))});
+  apply_edits(child, edits);
+}
+
+void PipelineStats::print(ostream& out) const {
+  auto print_stage = [&] (const char* name, const StageStats& stage) {
+    out << name << ": " << stage.items << " items"
+        << ", " << (this->seconds > 0 ? stage.items / this->seconds : 0) << " per second"
+        << ", busy " << stage.busy_seconds << "s"
+        << ", output full " << stage.full_waits
+        << ", input empty " << stage.empty_waits << endl;
+  };
+  out << "Seconds: " << this->seconds << endl;
+  print_stage("Breed", this->breed);
+  print_stage("Lift", this->lift);
+  print_stage("Evaluate", this->evaluate);
+}
+
+GenerationPipeline::GenerationPipeline(const PipelineOptions& _options)
+  : options(_options), contexts(_options.evaluators), generation(0) {
+  if (options.breeders < 1 || options.lifters < 1 || options.evaluators < 1)
+    throw logic_error("Every pipeline stage needs a thread");
+}
+
+vector<Offspring> GenerationPipeline::run(const vector<Genome>& parents, const vector<double>& parent_fitness,
+                                          size_t num_children, const vector<vector<Data> >& inputs,
+                                          int max_iterations, Fitness fitness) {
+  if (parents.empty() || parents.size() != parent_fitness.size())
+    throw logic_error("Every parent needs a fitness");
+  auto& options = this->options;
+  vector<Offspring> ret(num_children);
+  BoundedQueue<BredChild> bred(options.queue_capacity);
+  BoundedQueue<LiftedChild> lifted(options.queue_capacity);
+  atomic<size_t> next_child(0);
+  atomic<int> breeders_left(options.breeders), lifters_left(options.lifters);
+  atomic<bool> failed(false);
+  // Each parent is lifted once, by the first lifter that needs it
+  vector<LiftedGenome> parent_lifts(parents.size());
+  vector<once_flag> parent_lifted(parents.size());
+  exception_ptr error;
+  mutex lock;
+  this->stats = PipelineStats();
+  auto start = Clock::now();
+
+  auto fail = [&] () {
+    lock_guard<mutex> guard(lock);
+    if (!error)
+      error = current_exception();
+    failed = true;
+  };
+  auto merge = [&] (StageStats& total, const StageStats& part) {
+    lock_guard<mutex> guard(lock);
+    total.items += part.items;
+    total.busy_seconds += part.busy_seconds;
+    total.full_waits += part.full_waits;
+    total.empty_waits += part.empty_waits;
+  };
+
+  auto breed = [&] () {
+    StageStats local;
+    try {
+      for (;;) {
+        size_t index = next_child++;
+        if (index >= num_children || failed)
+          break;
+        auto item_start = Clock::now();
+        seed_seq seed{uint32_t(options.seed), uint32_t(options.seed >> 32),
+                      uint32_t(this->generation), uint32_t(index)};
+        mt19937_64 rng(seed);
+        BredChild child;
+        child.index = index;
+        breed_child(parents, parent_fitness, options, rng, child);
+        ret[index].genome = child.genome;
+        local.busy_seconds += seconds_since(item_start);
+        local.items++;
+        if (!push_waiting(bred, child, local, failed))
+          break;
+      }
+    } catch (...) {
+      fail();
+    }
+    merge(this->stats.breed, local);
+    breeders_left--;
+  };
+
+  auto lift = [&] () {
+    StageStats local;
+    try {
+      BredChild child;
+      while (pop_waiting(bred, child, local, breeders_left, failed)) {
+        auto item_start = Clock::now();
+        LiftedChild out;
+        out.index = child.index;
+        out.genome = move(child.genome);
+        try {
+          if (child.parent == NO_PARENT) {
+            out.program = prepare_program(lift_bytes_to_graph(out.genome));
+          } else {
+            auto& parent = parent_lifts[child.parent];
+            call_once(parent_lifted[child.parent], [&] () {
+                parent = lift_genome(parents[child.parent]);
+            });
+            out.program = prepare_program(relift(parent, out.genome, child.edits).nodes);
+          }
+        } catch (const logic_error& e) {
+          out.error = e.what();
+        }
+        local.busy_seconds += seconds_since(item_start);
+        local.items++;
+        if (!push_waiting(lifted, out, local, failed))
+          break;
+      }
+    } catch (...) {
+      fail();
+    }
+    merge(this->stats.lift, local);
+    lifters_left--;
+  };
+
+  auto evaluate = [&] () {
+    StageStats local;
+    try {
+      LiftedChild child;
+      while (pop_waiting(lifted, child, local, lifters_left, failed)) {
+        auto item_start = Clock::now();
+        auto& offspring = ret[child.index];
+        if (child.program) {
+          offspring.result = evaluate_program(child.program, child.genome, inputs, max_iterations, this->contexts);
+        } else {
+          offspring.result.error = child.error;
+        }
+        offspring.fitness = fitness(offspring.result);
+        local.busy_seconds += seconds_since(item_start);
+        local.items++;
+      }
+    } catch (...) {
+      fail();
+    }
+    merge(this->stats.evaluate, local);
+  };
+
+  vector<thread> threads;
+  for (int i = 0; i < options.breeders; i++)
+    threads.push_back(thread(breed));
+  for (int i = 0; i < options.lifters; i++)
+    threads.push_back(thread(lift));
+  for (int i = 0; i < options.evaluators; i++)
+    threads.push_back(thread(evaluate));
+  for_each(threads.begin(), threads.end(), [] (thread& worker) {
+      worker.join();
+  });
+  this->stats.seconds = seconds_since(start);
+  this->generation++;
+  if (error)
+    rethrow_exception(error);
+  return ret;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ast.hpp"
+#include "pool.hpp"
+#include "population.hpp"
+#include <functional>
+#include <iostream>
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+// Scores a child's result; higher is better
+typedef function<double(const GenomeResult&)> Fitness;
+
+struct PipelineOptions {
+  int breeders, lifters, evaluators; // Threads per stage
+  size_t queue_capacity;             // Between each pair of stages
+  int tournament_size;
+  double crossover_rate; // Chance a child splices two parents
+  int max_mutations;     // Each child gets 1..max_mutations point mutations
+  size_t max_length;     // Children are cut to this many bytes
+  uint64_t seed;
+  PipelineOptions()
+    : breeders(1), lifters(1), evaluators(2), queue_capacity(64), tournament_size(3),
+      crossover_rate(0.5), max_mutations(4), max_length(4096), seed(1) { }
+};
+
+// What one stage did during a run. A stage that often finds its output
+// queue full is outpacing the stage after it; one that often finds its
+// input queue empty is waiting on the stage before it.
+struct StageStats {
+  uint64_t items;       // Items the stage finished
+  double busy_seconds;  // Spent on items, summed over the stage's threads
+  uint64_t full_waits;  // Times a thread found its output queue full
+  uint64_t empty_waits; // Times a thread found its input queue empty
+  StageStats() : items(0), busy_seconds(0), full_waits(0), empty_waits(0) { }
+};
+
+struct PipelineStats {
+  StageStats breed, lift, evaluate;
+  double seconds; // Wall time of the run
+  PipelineStats() : seconds(0) { }
+  void print(ostream&) const;
+};
+
+struct Offspring {
+  Genome genome;
+  GenomeResult result;
+  double fitness;
+  Offspring() : fitness(0) { }
+};
+
+// Makes and scores a generation with three stages running at once on their
+// own threads: breeding picks parents by tournament and applies crossover
+// and point mutation, lifting turns each child into a prepared program
+// (re-lifting a mutation-only child from its parent's nodes), and
+// evaluation runs it on every test input. Stages hand children on through
+// bounded lock-free queues, so a slow stage holds the ones before it back
+// instead of letting work pile up.
+//
+// Each child is bred from its own random stream, seeded by the pipeline's
+// seed, the generation number and the child's index, so a run's children do
+// not depend on how the threads were scheduled.
+struct GenerationPipeline {
+  PipelineOptions options;
+  ContextPool contexts;
+  PipelineStats stats; // Of the last run
+  uint64_t generation; // Runs so far
+
+  explicit GenerationPipeline(const PipelineOptions& = PipelineOptions());
+  // Breeds num_children from the parents, weighted by parent_fitness, and
+  // evaluates them. Children are returned in the order they were bred.
+  vector<Offspring> run(const vector<Genome>& parents, const vector<double>& parent_fitness,
+                        size_t num_children, const vector<vector<Data> >& inputs,
+                        int max_iterations, Fitness);
+};
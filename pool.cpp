@@ -0,0 +1,32 @@
+#include "pool.hpp"
+using namespace std;
+
+ContextPool::ContextPool(size_t reserve) {
+  this->idle.reserve(reserve);
+}
+
+unique_ptr<ExecutionContext> ContextPool::acquire(shared_ptr<const Program> program) {
+  unique_ptr<ExecutionContext> ret;
+  {
+    lock_guard<mutex> guard(this->lock);
+    if (!this->idle.empty()) {
+      ret = move(this->idle.back());
+      this->idle.pop_back();
+    }
+  }
+  if (ret)
+    ret->reset(program);
+  else
+    ret.reset(new ExecutionContext(program));
+  return ret;
+}
+
+void ContextPool::release(unique_ptr<ExecutionContext> context) {
+  lock_guard<mutex> guard(this->lock);
+  this->idle.push_back(move(context));
+}
+
+size_t ContextPool::size() {
+  lock_guard<mutex> guard(this->lock);
+  return this->idle.size();
+}
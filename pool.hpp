@@ -0,0 +1,41 @@
+#pragma once
+
+#include "program.hpp"
+#include "vm.hpp"
+#include <memory>
+#include <mutex>
+#include <vector>
+using namespace std;
+
+// Keeps finished ExecutionContexts around so the next evaluation can reuse
+// one instead of building a context from scratch. What is reused is the
+// context and its buffers: the node store and worklist arenas, which only
+// grow when a longer program arrives, and the capacity of the input, output
+// and register vectors. Each genome still allocates its own lifted nodes,
+// Program and shared_ptr to it, the target memory pages it writes, and
+// whatever copies of output_data the caller keeps. Safe to share between
+// threads.
+struct ContextPool {
+  explicit ContextPool(size_t reserve = 0);
+  // A context reset to the given program, reused if one is available
+  unique_ptr<ExecutionContext> acquire(shared_ptr<const Program>);
+  void release(unique_ptr<ExecutionContext>);
+  size_t size();
+private:
+  mutex lock;
+  vector<unique_ptr<ExecutionContext> > idle;
+};
+
+// Returns its context to the pool when it goes out of scope.
+struct PooledContext {
+  PooledContext(ContextPool& _pool, shared_ptr<const Program> program)
+    : pool(_pool), context(_pool.acquire(program)) { }
+  ~PooledContext() { pool.release(move(context)); }
+  ExecutionContext& operator*() { return *context; }
+  ExecutionContext* operator->() { return context.get(); }
+private:
+  ContextPool& pool;
+  unique_ptr<ExecutionContext> context;
+  PooledContext(const PooledContext&);
+  PooledContext& operator=(const PooledContext&);
+};
@@ -0,0 +1,94 @@
+#include "popfile.hpp"
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+using namespace std;
+
+static const char POPULATION_MAGIC[8] = { 'G', 'V', 'M', 'P', 'O', 'P', '0', '1' };
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Population files are read in place and assume a little-endian host"
+#endif
+
+void write_population_file(const string& path, const vector<vector<int8_t> >& genomes) {
+  ofstream out(path.c_str(), ios::binary | ios::trunc);
+  if (!out)
+    throw runtime_error("Cannot open " + path + " for writing");
+  uint64_t num_genomes = genomes.size();
+  vector<uint64_t> offsets(1, 0);
+  for (size_t i = 0; i < genomes.size(); i++)
+    offsets.push_back(offsets.back() + genomes[i].size());
+  out.write(POPULATION_MAGIC, sizeof(POPULATION_MAGIC));
+  out.write(reinterpret_cast<const char*>(&num_genomes), sizeof(num_genomes));
+  out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+  for (size_t i = 0; i < genomes.size(); i++)
+    out.write(reinterpret_cast<const char*>(genomes[i].data()), genomes[i].size());
+  if (!out)
+    throw runtime_error("Failed writing " + path);
+}
+
+PopulationFile::PopulationFile(const string& path)
+  : mapping(nullptr), mapping_size(0), num_genomes(0), offsets(nullptr), bytes(nullptr) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("Cannot open " + path);
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    throw runtime_error("Cannot stat " + path);
+  }
+  this->mapping_size = info.st_size;
+  auto header_size = sizeof(POPULATION_MAGIC) + sizeof(uint64_t);
+  if (this->mapping_size < header_size) {
+    close(fd);
+    throw runtime_error("Truncated population file " + path);
+  }
+  void* mapped = mmap(nullptr, this->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    throw runtime_error("Cannot map " + path);
+  this->mapping = static_cast<const char*>(mapped);
+
+  auto fail = [&] (const string& reason) {
+    munmap(const_cast<char*>(this->mapping), this->mapping_size);
+    throw runtime_error(reason + ": " + path);
+  };
+  if (memcmp(this->mapping, POPULATION_MAGIC, sizeof(POPULATION_MAGIC)) != 0)
+    fail("Not a population file");
+  uint64_t count;
+  memcpy(&count, this->mapping + sizeof(POPULATION_MAGIC), sizeof(count));
+  auto table_size = (count + 1) * sizeof(uint64_t);
+  if (count >= this->mapping_size || header_size + table_size > this->mapping_size)
+    fail("Truncated offset table");
+  this->num_genomes = count;
+  this->offsets = reinterpret_cast<const uint64_t*>(this->mapping + header_size);
+  this->bytes = reinterpret_cast<const int8_t*>(this->mapping + header_size + table_size);
+  auto bytes_size = this->mapping_size - header_size - table_size;
+  if (this->offsets[0] != 0 || this->offsets[count] > bytes_size)
+    fail("Bad offset table");
+  for (uint64_t i = 0; i < count; i++)
+    if (this->offsets[i] > this->offsets[i + 1])
+      fail("Bad offset table");
+}
+
+PopulationFile::~PopulationFile() {
+  munmap(const_cast<char*>(this->mapping), this->mapping_size);
+}
+
+ByteSpan PopulationFile::genome(size_t i) const {
+  if (i >= this->num_genomes)
+    throw out_of_range("No genome " + to_string(i));
+  return ByteSpan(this->bytes + this->offsets[i], this->offsets[i + 1] - this->offsets[i]);
+}
+
+vector<ByteSpan> PopulationFile::genomes() const {
+  vector<ByteSpan> ret;
+  ret.reserve(this->num_genomes);
+  for (size_t i = 0; i < this->num_genomes; i++)
+    ret.push_back(this->genome(i));
+  return ret;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "ast.hpp"
+#include <stdint.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Binary population file:
+//
+//   char     magic[8]          "GVMPOP01"
+//   uint64_t num_genomes
+//   uint64_t offsets[num_genomes + 1]
+//   int8_t   bytes[offsets[num_genomes]]
+//
+// Integers are little-endian. Genome i is bytes[offsets[i], offsets[i+1]),
+// so offsets[0] is 0 and the table never decreases.
+
+extern void write_population_file(const string& path, const vector<vector<int8_t> >& genomes);
+
+// A population file mapped read-only into memory. Genomes are returned as
+// views into the mapping, so opening a file costs one mmap and a check of
+// its offset table no matter how large it is.
+struct PopulationFile {
+  explicit PopulationFile(const string& path);
+  ~PopulationFile();
+  size_t size() const { return num_genomes; }
+  ByteSpan genome(size_t i) const;
+  vector<ByteSpan> genomes() const;
+private:
+  const char* mapping;
+  size_t mapping_size;
+  size_t num_genomes;
+  const uint64_t* offsets;
+  const int8_t* bytes;
+  PopulationFile(const PopulationFile&);
+  PopulationFile& operator=(const PopulationFile&);
+};
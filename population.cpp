@@ -0,0 +1,104 @@
+#include "population.hpp"
+#include "batch.hpp"
+#include "cache.hpp"
+#include "fold.hpp"
+#include "program.hpp"
+#include "prune.hpp"
+#include <stdexcept>
+using namespace std;
+
+GenomeResult evaluate_genome(ByteSpan genome, const vector<vector<Data> >& inputs,
+                             int max_iterations) {
+  ContextPool contexts;
+  return evaluate_genome(genome, inputs, max_iterations, contexts);
+}
+
+shared_ptr<const Program> prepare_program(const vector<InstructionNode>& nodes) {
+  return make_shared<const Program>(fold_program(prune_program(compile_program(nodes))));
+}
+
+GenomeResult evaluate_program(shared_ptr<const Program> program, ByteSpan genome,
+                              const vector<vector<Data> >& inputs,
+                              int max_iterations, ContextPool& contexts) {
+  GenomeResult ret;
+  try {
+    PooledContext context(contexts, program);
+    context->load_genome(genome);
+    context->stats.reset();
+    ret.outputs = evaluate_batch(*context, inputs, max_iterations, &ret.targets);
+    ret.stats = context->stats;
+    ret.ok = true;
+  } catch (const logic_error& e) {
+    ret.error = e.what();
+  }
+  return ret;
+}
+
+static GenomeResult evaluate_lifted(ByteSpan genome, const vector<InstructionNode>& nodes,
+                                    const vector<vector<Data> >& inputs,
+                                    int max_iterations, ContextPool& contexts) {
+  shared_ptr<const Program> program;
+  try {
+    program = prepare_program(nodes);
+  } catch (const logic_error& e) {
+    GenomeResult ret;
+    ret.error = e.what();
+    return ret;
+  }
+  return evaluate_program(program, genome, inputs, max_iterations, contexts);
+}
+
+// Lifts the genome into nodes, or returns false with the error in result.
+static bool lift_genome_nodes(ByteSpan genome, vector<InstructionNode>& nodes, GenomeResult& result) {
+  try {
+    nodes = lift_bytes_to_graph(genome);
+    return true;
+  } catch (const logic_error& e) {
+    result.error = e.what();
+    return false;
+  }
+}
+
+GenomeResult evaluate_genome(ByteSpan genome, const vector<vector<Data> >& inputs,
+                             int max_iterations, ContextPool& contexts) {
+  GenomeResult ret;
+  vector<InstructionNode> nodes;
+  if (!lift_genome_nodes(genome, nodes, ret))
+    return ret;
+  return evaluate_lifted(genome, nodes, inputs, max_iterations, contexts);
+}
+
+GenomeResult evaluate_genome(ByteSpan genome, const vector<vector<Data> >& inputs,
+                             int max_iterations, ContextPool& contexts, ResultCache& cache) {
+  GenomeResult ret;
+  vector<InstructionNode> nodes;
+  if (!lift_genome_nodes(genome, nodes, ret))
+    return ret;
+  CacheKey key(nodes, hash_tests(inputs, max_iterations), genome);
+  return cache.get_or_evaluate(key, [&] () {
+      return evaluate_lifted(genome, nodes, inputs, max_iterations, contexts);
+  });
+}
+
+PopulationEvaluator::PopulationEvaluator(int num_threads)
+  : pool(num_threads), contexts(pool.size()) { }
+
+vector<GenomeResult> PopulationEvaluator::evaluate(const vector<Genome>& genomes,
+                                                   const vector<vector<Data> >& inputs,
+                                                   int max_iterations) {
+  vector<ByteSpan> spans(genomes.begin(), genomes.end());
+  return this->evaluate(spans, inputs, max_iterations);
+}
+
+vector<GenomeResult> PopulationEvaluator::evaluate(const vector<ByteSpan>& genomes,
+                                                   const vector<vector<Data> >& inputs,
+                                                   int max_iterations) {
+  vector<GenomeResult> ret(genomes.size());
+  this->pool.run(genomes.size(), [&] (size_t i) {
+      if (this->cache)
+        ret[i] = evaluate_genome(genomes[i], inputs, max_iterations, this->contexts, *this->cache);
+      else
+        ret[i] = evaluate_genome(genomes[i], inputs, max_iterations, this->contexts);
+  });
+  return ret;
+}
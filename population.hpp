@@ -0,0 +1,62 @@
+#pragma once
+
+#include "ast.hpp"
+#include "memory.hpp"
+#include "pool.hpp"
+#include "stats.hpp"
+#include "threadpool.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+using namespace std;
+
+typedef vector<int8_t> Genome;
+
+struct ResultCache;
+
+// Outputs of one genome on every test input, or the reason it could not be
+// run (an undecodable byte or an unimplemented instruction).
+struct GenomeResult {
+  bool ok;
+  string error;
+  vector<vector<Data> > outputs;
+  // What each run wrote to the target ring, the offspring of a replicator.
+  // Pages it copied unchanged are the genome's own.
+  vector<PagedMemory> targets;
+  ExecutionStats stats; // Over all inputs; zero unless built with VM_INSTRUMENT
+  GenomeResult() : ok(false) { }
+};
+
+// Lifts and runs a whole population on a work-stealing pool, one job per
+// genome. Genomes that hit their iteration cap take far longer than ones
+// that finish early, so idle workers steal from busy ones.
+struct PopulationEvaluator {
+  WorkStealingPool pool;
+  ContextPool contexts;
+  shared_ptr<ResultCache> cache; // Optional; may be shared between evaluators
+  explicit PopulationEvaluator(int num_threads = 0);
+  vector<GenomeResult> evaluate(const vector<Genome>& genomes,
+                                const vector<vector<Data> >& inputs,
+                                int max_iterations);
+  // For genomes that live elsewhere, such as in a PopulationFile
+  vector<GenomeResult> evaluate(const vector<ByteSpan>& genomes,
+                                const vector<vector<Data> >& inputs,
+                                int max_iterations);
+};
+
+// The program evaluation runs for lifted nodes: compiled, pruned and folded
+extern shared_ptr<const Program> prepare_program(const vector<InstructionNode>&);
+
+// Runs an already prepared program, lifted from the given genome, on every
+// input
+extern GenomeResult evaluate_program(shared_ptr<const Program>, ByteSpan genome,
+                                     const vector<vector<Data> >& inputs,
+                                     int max_iterations, ContextPool&);
+
+extern GenomeResult evaluate_genome(ByteSpan, const vector<vector<Data> >& inputs,
+                                    int max_iterations);
+extern GenomeResult evaluate_genome(ByteSpan, const vector<vector<Data> >& inputs,
+                                    int max_iterations, ContextPool&);
+// Looks the lifted program up in the cache before running it
+extern GenomeResult evaluate_genome(ByteSpan, const vector<vector<Data> >& inputs,
+                                    int max_iterations, ContextPool&, ResultCache&);
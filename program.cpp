@@ -0,0 +1,141 @@
+#include "program.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+using namespace std;
+
+AbsoluteAddress Program::resolve(AbsoluteAddress address) const {
+  return address % this->nodes.size();
+}
+
+// The node's relative inputs in declaration order; returns how many there are.
+static int relative_operands(const InstructionNode& node, RelativeAddress* out) {
+  switch (instruction_type(node.instruction)) {
+  case IT_NOINPUT:
+  case IT_DATA:
+    return 0;
+  case IT_UNOP:
+    out[0] = node.input.unop.i;
+    return 1;
+  case IT_BINOP:
+    out[0] = node.input.binop.i1;
+    out[1] = node.input.binop.i2;
+    return 2;
+  case IT_TRIOP:
+    out[0] = node.input.triop.i1;
+    out[1] = node.input.triop.i2;
+    out[2] = node.input.triop.i3;
+    return 3;
+  case IT_QUADOP:
+    out[0] = node.input.quadop.i1;
+    out[1] = node.input.quadop.i2;
+    out[2] = node.input.quadop.i3;
+    out[3] = node.input.quadop.i4;
+    return 4;
+  case IT_RING_UNOP:
+    out[0] = node.input.ring_unop.i1;
+    return 1;
+  case IT_RING_BINOP:
+    out[0] = node.input.ring_binop.i1;
+    out[1] = node.input.ring_binop.i2;
+    return 2;
+  default:
+    throw logic_error("Unknown instruction type");
+  }
+}
+
+int num_operands_for_instruction(Instruction instruction) {
+  switch (instruction_type(instruction)) {
+  case IT_NOINPUT:
+  case IT_DATA:
+    return 0;
+  case IT_UNOP:
+  case IT_RING_UNOP:
+    return 1;
+  case IT_BINOP:
+  case IT_RING_BINOP:
+    return 2;
+  case IT_TRIOP:
+    return 3;
+  case IT_QUADOP:
+    return 4;
+  default:
+    throw logic_error("Unknown instruction type");
+  }
+}
+
+static Data immediate(const InstructionNode& node) {
+  switch (instruction_type(node.instruction)) {
+  case IT_DATA:
+    return node.input.data;
+  case IT_RING_UNOP:
+    return node.input.ring_unop.r;
+  case IT_RING_BINOP:
+    return node.input.ring_binop.r;
+  default:
+    return 0;
+  }
+}
+
+Program compile_program(const vector<InstructionNode>& nodes) {
+  Program ret;
+  ret.nodes = nodes;
+  ret.compiled.resize(nodes.size());
+  ret.instructions.resize(nodes.size());
+  ret.handlers.resize(nodes.size());
+  ret.immediates.resize(nodes.size());
+  for (int i = 0; i < MAX_OPERANDS; i++)
+    ret.operands[i].assign(nodes.size(), 0);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    auto& node = nodes[i];
+    ret.instructions[i] = node.instruction;
+    ret.handlers[i] = handler_for(node.instruction);
+    ret.immediates[i] = immediate(node);
+    if (node.instruction == OP_TRIGGER)
+      ret.triggers.push_back(ret.resolve(node.address));
+    RelativeAddress relative[MAX_OPERANDS];
+    auto num_operands = relative_operands(node, relative);
+    for (int j = 0; j < num_operands; j++)
+      ret.operands[j][i] = ret.resolve(translate_relative(node, relative[j]));
+
+    auto& compiled = ret.compiled[i];
+    if (node.instruction == OP_IF) {
+      compiled.per_state = true;
+      compiled.num_dependencies = 3;
+      for (int j = 0; j < 3; j++)
+        compiled.dependencies[j] = ret.operands[j][i];
+      continue;
+    }
+    auto ds = dependencies(node);
+    if (ds.size() > MAX_DEPENDENCIES)
+      throw logic_error("Too many dependencies: " + show_instruction_node(node));
+    compiled.num_dependencies = ds.size();
+    transform(ds.begin(), ds.end(), compiled.dependencies, [&] (AbsoluteAddress address) {
+        return ret.resolve(address);
+    });
+  }
+  link_consumers(ret);
+  return ret;
+}
+
+// Count each node's consumers, turn the counts into row ends, then fill
+// the rows back to front so each end moves down to its row's start.
+void link_consumers(Program& program) {
+  auto& compiled = program.compiled;
+  auto& begin = program.consumers_begin;
+  begin.assign(program.size() + 1, 0);
+  for_each(compiled.begin(), compiled.end(), [&] (const CompiledNode& node) {
+      for_each(node.dependencies, node.dependencies + node.num_dependencies, [&] (AbsoluteAddress dependency) {
+          begin[dependency]++;
+      });
+  });
+  partial_sum(begin.begin(), begin.end(), begin.begin());
+  program.consumers.resize(begin.back());
+  for (size_t i = program.size(); i-- > 0; ) {
+    auto& node = compiled[i];
+    for_each(node.dependencies, node.dependencies + node.num_dependencies, [&] (AbsoluteAddress dependency) {
+        program.consumers[--begin[dependency]] = i;
+    });
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ast.hpp"
+#include <memory>
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+const int MAX_DEPENDENCIES = 4;
+const int MAX_OPERANDS = 4;
+
+// What a node waits on, resolved once at load time to indices into the
+// program. OP_IF waits on a different input in each of its three states, so
+// its entry holds one dependency per state instead of a fixed list.
+struct CompiledNode {
+  uint8_t num_dependencies;
+  bool per_state;
+  AbsoluteAddress dependencies[MAX_DEPENDENCIES];
+  CompiledNode() : num_dependencies(0), per_state(false) { }
+  // The dependencies a node in the given extra_state is waiting on
+  const AbsoluteAddress* waits_begin(int extra_state) const {
+    return per_state ? dependencies + extra_state : dependencies;
+  }
+  const AbsoluteAddress* waits_end(int extra_state) const {
+    return per_state ? dependencies + extra_state + 1 : dependencies + num_dependencies;
+  }
+};
+
+struct ExecutionContext;
+// Executes one node; returns whether it should be delisted.
+typedef bool (*NodeHandler)(ExecutionContext&, AbsoluteAddress);
+
+// Native code for a program's steps; see jit.hpp.
+struct StepTrace;
+
+// The immutable half of a running program. The lifted nodes are kept for
+// display; execution only reads the per-field arrays below. Operands are
+// the node's relative inputs resolved to indices, in declaration order,
+// and the immediate is its data or ring byte. Each node's handler is
+// looked up once, with vm.hpp's handler_for, so the interpreter dispatches
+// through a pointer instead of switching on the opcode.
+struct Program {
+  vector<InstructionNode> nodes;
+  vector<CompiledNode> compiled;
+  vector<Instruction> instructions;
+  vector<NodeHandler> handlers;
+  vector<Data> immediates;
+  vector<AbsoluteAddress> operands[MAX_OPERANDS];
+  vector<AbsoluteAddress> triggers;
+  // Reverse edges, in compressed rows: the nodes waiting on node i, in any
+  // of their states, are consumers[consumers_begin[i]..consumers_begin[i + 1])
+  vector<uint32_t> consumers_begin;
+  vector<AbsoluteAddress> consumers;
+  shared_ptr<const StepTrace> trace; // Set by jit_compile
+  size_t size() const { return nodes.size(); }
+  AbsoluteAddress resolve(AbsoluteAddress) const;
+  AbsoluteAddress operand(AbsoluteAddress address, int i) const {
+    return operands[i][address];
+  }
+};
+
+extern Program compile_program(const vector<InstructionNode>&);
+// Rebuilds Program::consumers from the compiled dependencies; whatever
+// builds or rewrites a Program calls it last.
+extern void link_consumers(Program&);
+// How many of Program::operands an instruction uses
+extern int num_operands_for_instruction(Instruction);
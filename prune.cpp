@@ -0,0 +1,81 @@
+#include "prune.hpp"
+#include "vm.hpp"
+#include <algorithm>
+using namespace std;
+
+vector<bool> reachable_nodes(const Program& program) {
+  vector<bool> ret(program.size(), false);
+  vector<AbsoluteAddress> stack(program.triggers.begin(), program.triggers.end());
+  while (!stack.empty()) {
+    auto address = stack.back();
+    stack.pop_back();
+    if (ret[address])
+      continue;
+    ret[address] = true;
+    auto& compiled = program.compiled[address];
+    for_each(compiled.dependencies, compiled.dependencies + compiled.num_dependencies, [&] (AbsoluteAddress dependency) {
+        if (!ret[dependency])
+          stack.push_back(dependency);
+    });
+  }
+  return ret;
+}
+
+Program prune_program(const Program& program) {
+  auto reachable = reachable_nodes(program);
+  auto num_kept = count(reachable.begin(), reachable.end(), true);
+  AbsoluteAddress sentinel = num_kept;
+  vector<AbsoluteAddress> remap(program.size(), sentinel);
+  for (size_t i = 0, next = 0; i < program.size(); i++)
+    if (reachable[i])
+      remap[i] = next++;
+
+  bool needs_sentinel = false;
+  for (size_t i = 0; i < program.size(); i++) {
+    if (!reachable[i])
+      continue;
+    auto num_operands = num_operands_for_instruction(program.instructions[i]);
+    for (int j = 0; j < num_operands; j++)
+      needs_sentinel |= !reachable[program.operands[j][i]];
+  }
+
+  Program ret;
+  auto size = num_kept + needs_sentinel;
+  ret.nodes.reserve(size);
+  ret.compiled.reserve(size);
+  ret.instructions.reserve(size);
+  ret.handlers.reserve(size);
+  ret.immediates.reserve(size);
+  for (int j = 0; j < MAX_OPERANDS; j++)
+    ret.operands[j].reserve(size);
+  for (size_t i = 0; i < program.size(); i++) {
+    if (!reachable[i])
+      continue;
+    ret.nodes.push_back(program.nodes[i]);
+    auto compiled = program.compiled[i];
+    for (int j = 0; j < compiled.num_dependencies; j++)
+      compiled.dependencies[j] = remap[compiled.dependencies[j]];
+    ret.compiled.push_back(compiled);
+    ret.instructions.push_back(program.instructions[i]);
+    ret.handlers.push_back(handler_for(program.instructions[i]));
+    ret.immediates.push_back(program.immediates[i]);
+    for (int j = 0; j < MAX_OPERANDS; j++)
+      ret.operands[j].push_back(remap[program.operands[j][i]]);
+  }
+  if (needs_sentinel) {
+    InstructionNode nop;
+    nop.instruction = OP_NOP;
+    ret.nodes.push_back(nop);
+    ret.compiled.push_back(CompiledNode());
+    ret.instructions.push_back(OP_NOP);
+    ret.handlers.push_back(handler_for(OP_NOP));
+    ret.immediates.push_back(0);
+    for (int j = 0; j < MAX_OPERANDS; j++)
+      ret.operands[j].push_back(sentinel);
+  }
+  transform(program.triggers.begin(), program.triggers.end(), back_inserter(ret.triggers), [&] (AbsoluteAddress address) {
+      return remap[address];
+  });
+  link_consumers(ret);
+  return ret;
+}
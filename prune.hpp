@@ -0,0 +1,24 @@
+#pragma once
+
+#include "program.hpp"
+#include <vector>
+using namespace std;
+
+// Nodes only ever enter the worklist as triggers or as dependencies of a
+// pending node, so anything outside the dependency closure of the triggers
+// never runs. OP_IF counts as depending on all three of its inputs.
+extern vector<bool> reachable_nodes(const Program&);
+
+// A copy of the program holding only its reachable nodes, in their
+// original order, with every resolved index remapped. A node that is never
+// scheduled is never active and its output stays 0, so operands that are
+// not dependencies (GET_BYTE's index, say) and point at a dropped node are
+// redirected to one inert OP_NOP appended at the end. Running the pruned
+// program gives the same results as running the original.
+//
+// A StepTrace does not survive pruning, since it is recorded against the
+// old indices, and every kept node goes back to its interpreter handler.
+//
+// The lifted nodes are carried over unchanged for display, so their
+// addresses and relative inputs still refer to the unpruned genome.
+extern Program prune_program(const Program&);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+using namespace std;
+
+// Bounded multi-producer, multi-consumer queue without locks (Dmitry
+// Vyukov's design). Every slot carries a sequence number that says whether
+// it is free for the producer at a given position or holds a value for the
+// consumer at it, so producers and consumers each claim a position with one
+// compare-and-swap and never touch the same slot at once. Neither call
+// blocks: a full or empty queue just returns false, and the caller decides
+// whether to spin, yield or do something else.
+template <typename T>
+struct BoundedQueue {
+  // Room for at least `capacity` values; rounded up to a power of two
+  explicit BoundedQueue(size_t capacity) : enqueue_at(0), dequeue_at(0) {
+    size_t size = 2;
+    while (size < capacity)
+      size *= 2;
+    this->mask = size - 1;
+    this->slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; i++)
+      this->slots[i].sequence.store(i, memory_order_relaxed);
+  }
+  size_t capacity() const { return mask + 1; }
+
+  // Moves from `value` only if it succeeds
+  bool try_push(T& value) {
+    Slot* slot;
+    auto position = this->enqueue_at.load(memory_order_relaxed);
+    for (;;) {
+      slot = &this->slots[position & this->mask];
+      auto sequence = slot->sequence.load(memory_order_acquire);
+      auto difference = intptr_t(sequence) - intptr_t(position);
+      if (difference == 0) {
+        if (this->enqueue_at.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+          break;
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = this->enqueue_at.load(memory_order_relaxed);
+      }
+    }
+    slot->value = move(value);
+    slot->sequence.store(position + 1, memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T& value) {
+    Slot* slot;
+    auto position = this->dequeue_at.load(memory_order_relaxed);
+    for (;;) {
+      slot = &this->slots[position & this->mask];
+      auto sequence = slot->sequence.load(memory_order_acquire);
+      auto difference = intptr_t(sequence) - intptr_t(position + 1);
+      if (difference == 0) {
+        if (this->dequeue_at.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+          break;
+      } else if (difference < 0) {
+        return false;
+      } else {
+        position = this->dequeue_at.load(memory_order_relaxed);
+      }
+    }
+    value = move(slot->value);
+    slot->sequence.store(position + this->mask + 1, memory_order_release);
+    return true;
+  }
+
+private:
+  struct Slot {
+    atomic<size_t> sequence;
+    T value;
+  };
+  // The two ends are written by different threads; keep them on separate
+  // cache lines
+  unique_ptr<Slot[]> slots;
+  size_t mask;
+  char pad0[64];
+  atomic<size_t> enqueue_at;
+  char pad1[64];
+  atomic<size_t> dequeue_at;
+  char pad2[64];
+
+  BoundedQueue(const BoundedQueue&);
+  BoundedQueue& operator=(const BoundedQueue&);
+};
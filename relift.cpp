@@ -0,0 +1,107 @@
+#include "relift.hpp"
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+// Decodes the instruction whose opcode is at `position`, the same way
+// lift_bytes_to_graph does. Returns the offset of the next instruction, or
+// 0 if the bytes run out before this one is complete.
+static size_t decode_instruction(ByteSpan bytes, size_t position, InstructionNode& node) {
+  node = InstructionNode();
+  node.instruction = instruction_from_bytes(bytes.data[position]);
+  auto type = instruction_type(node.instruction);
+  auto num_inputs = num_inputs_for_instruction_type(type);
+  if (position + num_inputs >= bytes.size)
+    return 0;
+  for (int input_no = num_inputs; input_no > 0; input_no--)
+    consume_input(node, type, input_no, bytes.data[++position]);
+  return position + 1;
+}
+
+// Decodes from `position` onwards, appending to `lifted`. Stops at the end
+// of the bytes, or at the first boundary past `resync_after` for which
+// `resync` returns true; returns that boundary, or 0 if it never synced.
+template <typename Resync>
+static size_t decode_from(ByteSpan bytes, size_t position, LiftedGenome& lifted,
+                          size_t resync_after, Resync resync) {
+  InstructionNode node;
+  while (position < bytes.size) {
+    auto next = decode_instruction(bytes, position, node);
+    if (next == 0)
+      break;
+    node.address = lifted.nodes.size();
+    lifted.nodes.push_back(node);
+    lifted.offsets.push_back(position);
+    position = next;
+    if (position > resync_after && resync(position))
+      return position;
+  }
+  lifted.tail = position;
+  return 0;
+}
+
+LiftedGenome lift_genome(ByteSpan bytes) {
+  LiftedGenome ret;
+  ret.num_bytes = bytes.size;
+  decode_from(bytes, 0, ret, bytes.size, [] (size_t) { return false; });
+  return ret;
+}
+
+LiftedGenome relift(const LiftedGenome& previous, ByteSpan bytes, const vector<ByteEdit>& edits) {
+  if (bytes.size != previous.num_bytes)
+    throw logic_error("Edited genome changed length");
+  if (edits.empty())
+    return previous;
+  size_t first = bytes.size, last = 0;
+  for_each(edits.begin(), edits.end(), [&] (const ByteEdit& edit) {
+      if (edit.position >= bytes.size)
+        throw logic_error("Edit past end of genome: " + to_string(edit.position));
+      first = min(first, edit.position);
+      last = max(last, edit.position);
+  });
+
+  // The instruction containing the first edit starts at the same offset
+  // in both genomes, since every byte before it is unchanged.
+  auto& offsets = previous.offsets;
+  size_t keep = first >= previous.tail
+    ? offsets.size()
+    : upper_bound(offsets.begin(), offsets.end(), first) - offsets.begin() - 1;
+  size_t start = keep < offsets.size() ? offsets[keep] : previous.tail;
+
+  LiftedGenome ret;
+  ret.num_bytes = bytes.size;
+  ret.nodes.reserve(previous.nodes.size());
+  ret.offsets.reserve(previous.offsets.size());
+  ret.nodes.assign(previous.nodes.begin(), previous.nodes.begin() + keep);
+  ret.offsets.assign(offsets.begin(), offsets.begin() + keep);
+
+  size_t reuse_from = offsets.size();
+  auto resynced = decode_from(bytes, start, ret, last, [&] (size_t position) {
+      if (position == previous.tail)
+        return true;
+      auto it = lower_bound(offsets.begin(), offsets.end(), position);
+      if (it == offsets.end() || *it != position)
+        return false;
+      reuse_from = it - offsets.begin();
+      return true;
+  });
+  if (resynced == 0)
+    return ret;
+
+  // Past the edits and back on an old boundary: the rest decodes exactly
+  // as before, only at shifted addresses.
+  for (size_t i = reuse_from; i < previous.nodes.size(); i++) {
+    auto node = previous.nodes[i];
+    node.address = ret.nodes.size();
+    ret.nodes.push_back(node);
+    ret.offsets.push_back(offsets[i]);
+  }
+  ret.tail = previous.tail;
+  return ret;
+}
+
+void apply_edits(vector<int8_t>& bytes, const vector<ByteEdit>& edits) {
+  for_each(edits.begin(), edits.end(), [&] (const ByteEdit& edit) {
+      bytes.at(edit.position) = edit.value;
+  });
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "ast.hpp"
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+// A lifted genome that remembers where each node's opcode byte was, so a
+// mutated copy can be re-lifted without decoding the whole genome again.
+struct LiftedGenome {
+  vector<InstructionNode> nodes;
+  vector<uint32_t> offsets; // Byte offset of each node's opcode
+  size_t tail;              // Offset just past the last complete instruction
+  size_t num_bytes;
+  LiftedGenome() : tail(0), num_bytes(0) { }
+};
+
+// A single-byte substitution, as made by point mutation
+struct ByteEdit {
+  size_t position;
+  int8_t value;
+};
+
+// Same nodes as lift_bytes_to_graph, plus their byte offsets
+extern LiftedGenome lift_genome(ByteSpan);
+
+// Lifts `bytes`, which differ from the genome `previous` was lifted from
+// only at the edited positions. Decoding restarts at the instruction that
+// contains the first edit and stops once it is past the last edit and
+// lands on an old instruction boundary; every node before and after that
+// window is copied from `previous`.
+extern LiftedGenome relift(const LiftedGenome& previous, ByteSpan bytes,
+                           const vector<ByteEdit>& edits);
+
+extern void apply_edits(vector<int8_t>& bytes, const vector<ByteEdit>& edits);
@@ -0,0 +1,172 @@
+#include "resumable.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+// Reading the clock costs about as much as a short step
+const long STEPS_PER_CLOCK_CHECK = 32;
+
+long run_within(ExecutionContext& context, const Budget& budget) {
+  auto deadline = Clock::now() + budget.time;
+  long steps = 0;
+  while (!context.pending_instructions.empty()) {
+    if (budget.steps && steps >= budget.steps)
+      break;
+    if (budget.time.count() && steps && steps % STEPS_PER_CLOCK_CHECK == 0 && Clock::now() >= deadline)
+      break;
+    context.step();
+    steps++;
+    if (context.settled())
+      break;
+  }
+  return steps;
+}
+
+ResumableEvaluation::ResumableEvaluation(ByteSpan genome, shared_ptr<const vector<vector<Data> > > _inputs,
+                                         int _max_iterations, ContextPool& _contexts)
+  : inputs(_inputs), max_iterations(_max_iterations), contexts(_contexts),
+    next_input(0), input_steps(0), total_steps(0), finished(false) {
+  try {
+    this->context = this->contexts.acquire(prepare_program(lift_bytes_to_graph(genome)));
+    this->context->load_genome(genome);
+    this->context->stats.reset();
+  } catch (const logic_error& e) {
+    this->partial.error = e.what();
+    this->finished = true;
+    return;
+  }
+  this->start_input();
+}
+
+ResumableEvaluation::~ResumableEvaluation() {
+  if (this->context)
+    this->contexts.release(move(this->context));
+}
+
+void ResumableEvaluation::start_input() {
+  if (this->next_input == this->inputs->size()) {
+    this->partial.ok = true;
+    this->finish();
+    return;
+  }
+  auto& input = (*this->inputs)[this->next_input++];
+  this->context->reset();
+  this->context->input_data.assign(input.begin(), input.end());
+  this->input_steps = 0;
+}
+
+void ResumableEvaluation::finish() {
+  this->partial.stats = this->context->stats;
+  this->contexts.release(move(this->context));
+  this->finished = true;
+}
+
+void ResumableEvaluation::resume(const Budget& budget) {
+  auto deadline = Clock::now() + budget.time;
+  long steps = 0;
+  while (!this->finished) {
+    if (this->context->pending_instructions.empty() || this->context->settled() ||
+        this->input_steps >= this->max_iterations) {
+      this->partial.outputs.push_back(this->context->output_data);
+      this->partial.targets.push_back(this->context->target);
+      this->start_input();
+      continue;
+    }
+    if (budget.steps && steps >= budget.steps)
+      return;
+    Budget rest(this->max_iterations - this->input_steps);
+    if (budget.steps)
+      rest.steps = min(rest.steps, budget.steps - steps);
+    if (budget.time.count()) {
+      auto left = deadline - Clock::now();
+      if (left <= Clock::duration(0))
+        return;
+      rest.time = chrono::duration_cast<chrono::nanoseconds>(left);
+    }
+    long taken;
+    try {
+      taken = run_within(*this->context, rest);
+    } catch (const logic_error& e) {
+      this->partial.error = e.what();
+      this->finish();
+      return;
+    }
+    steps += taken;
+    this->input_steps += taken;
+    this->total_steps += taken;
+  }
+}
+
+GenomeResult ResumableEvaluation::result() {
+  if (!this->finished) {
+    this->partial.error = "Deadline exceeded";
+    this->finish();
+  }
+  return this->partial;
+}
+
+TimeSlicedEvaluator::TimeSlicedEvaluator(int num_threads, Budget _slice)
+  : pool(num_threads), slice(_slice) { }
+
+vector<GenomeResult> TimeSlicedEvaluator::evaluate(const vector<Genome>& genomes,
+                                                   const vector<vector<Data> >& inputs,
+                                                   int max_iterations,
+                                                   Clock::time_point deadline) {
+  vector<unique_ptr<ResumableEvaluation> > runs(genomes.size());
+  auto shared_inputs = make_shared<const vector<vector<Data> > >(inputs);
+  deque<size_t> queue;
+  for (size_t i = 0; i < genomes.size(); i++)
+    queue.push_back(i);
+  mutex lock;
+  condition_variable changed;
+  size_t in_flight = 0;
+
+  // One job per worker; each takes the run at the front of the queue,
+  // gives it a slice and puts it back at the end if it is not done.
+  this->pool.run(this->pool.size(), [&] (size_t) {
+      unique_lock<mutex> guard(lock);
+      while (true) {
+        changed.wait(guard, [&] { return !queue.empty() || in_flight == 0; });
+        if (queue.empty())
+          return;
+        auto i = queue.front();
+        queue.pop_front();
+        in_flight++;
+        guard.unlock();
+
+        auto remaining = deadline - Clock::now();
+        if (remaining > Clock::duration(0)) {
+          auto& run = runs[i];
+          if (!run)
+            run.reset(new ResumableEvaluation(genomes[i], shared_inputs, max_iterations, this->contexts));
+          auto budget = this->slice;
+          if (!budget.time.count() || budget.time > remaining)
+            budget.time = chrono::duration_cast<chrono::nanoseconds>(remaining);
+          if (!run->done())
+            run->resume(budget);
+        }
+        bool requeue = runs[i] && !runs[i]->done() && Clock::now() < deadline;
+
+        guard.lock();
+        in_flight--;
+        if (requeue)
+          queue.push_back(i);
+        changed.notify_all();
+      }
+  });
+
+  vector<GenomeResult> ret(genomes.size());
+  for (size_t i = 0; i < genomes.size(); i++) {
+    if (runs[i]) {
+      ret[i] = runs[i]->result();
+    } else {
+      ret[i].error = "Deadline exceeded";
+    }
+  }
+  return ret;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ast.hpp"
+#include "pool.hpp"
+#include "population.hpp"
+#include "threadpool.hpp"
+#include "vm.hpp"
+#include <chrono>
+#include <memory>
+#include <vector>
+using namespace std;
+
+// How long one slice of a run may go on for. An ExecutionContext holds all
+// of its state between steps, so stopping after any step and stepping
+// again later carries on exactly where it left off.
+struct Budget {
+  long steps;               // 0 for no limit
+  chrono::nanoseconds time; // 0 for no limit; checked every few steps
+  explicit Budget(long _steps = 0, chrono::nanoseconds _time = chrono::nanoseconds(0))
+    : steps(_steps), time(_time) { }
+};
+
+// Steps the context until nothing is pending, it settles at a fixed point or
+// the budget is spent, and
+// returns the number of steps taken. Call again to resume.
+extern long run_within(ExecutionContext&, const Budget&);
+
+// A genome's evaluation on every test input, suspended between slices.
+// Each input gets at most max_iterations steps, as with step_until_done,
+// however many slices that takes. The inputs are shared, so they outlive
+// the caller's copy and many evaluations can hold one set.
+struct ResumableEvaluation {
+  ResumableEvaluation(ByteSpan genome, shared_ptr<const vector<vector<Data> > > inputs,
+                      int max_iterations, ContextPool&);
+  ~ResumableEvaluation();
+  bool done() const { return finished; }
+  long steps() const { return total_steps; }
+  void resume(const Budget&);
+  // The result so far. An unfinished evaluation is killed: it reports the
+  // outputs of the inputs it completed and the error "Deadline exceeded".
+  GenomeResult result();
+private:
+  shared_ptr<const vector<vector<Data> > > inputs;
+  int max_iterations;
+  ContextPool& contexts;
+  unique_ptr<ExecutionContext> context;
+  GenomeResult partial;
+  size_t next_input;
+  long input_steps, total_steps;
+  bool finished;
+  void start_input();
+  void finish();
+};
+
+// Evaluates a population by running every genome in short slices on a
+// fixed pool, round robin, so a few runaway genomes cannot hold up the
+// rest. Whatever is still running at the deadline is killed.
+struct TimeSlicedEvaluator {
+  WorkStealingPool pool;
+  ContextPool contexts;
+  Budget slice;
+  explicit TimeSlicedEvaluator(int num_threads = 0, Budget _slice = Budget(1000));
+  vector<GenomeResult> evaluate(const vector<Genome>& genomes,
+                                const vector<vector<Data> >& inputs,
+                                int max_iterations,
+                                chrono::steady_clock::time_point deadline);
+};
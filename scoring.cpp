@@ -0,0 +1,98 @@
+#include "scoring.hpp"
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+double Scoring::max_score() const {
+  double ret = 0;
+  for_each(this->expected.begin(), this->expected.end(), [&] (const vector<Data>& outputs) {
+      ret += outputs.size();
+  });
+  return ret;
+}
+
+ScoreResult score_context(ExecutionContext& context, const vector<vector<Data> >& inputs,
+                          int max_iterations, const Scoring& scoring) {
+  ScoreResult ret;
+  const vector<Data> none;
+  // Credit no output has been checked against yet, over all inputs
+  double undecided = scoring.max_score();
+  auto credit = [&] (Data produced, Data expected) {
+    if (!scoring.credit)
+      return produced == expected ? 1.0 : 0.0;
+    return min(1.0, max(0.0, scoring.credit(produced, expected)));
+  };
+  auto hopeless = [&] () { return ret.score + undecided <= scoring.threshold; };
+
+  // Runs one input; returns false if it was abandoned
+  auto run_input = [&] (const vector<Data>& input, const vector<Data>& expected) {
+    context.reset();
+    context.input_data.assign(input.begin(), input.end());
+    auto& outputs = context.output_data;
+    size_t checked = 0;
+    bool keep_going = true;
+    for (int i = 0; i < max_iterations && !context.pending_instructions.empty(); i++) {
+      context.step();
+      ret.steps++;
+      if (context.settled())
+        break;
+      if (outputs.size() == checked)
+        continue;
+      for (; checked < outputs.size(); checked++) {
+        if (checked >= expected.size())
+          continue;
+        ret.score += credit(outputs[checked], expected[checked]);
+        undecided -= 1;
+      }
+      if (hopeless()) {
+        keep_going = false;
+        break;
+      }
+    }
+    // Expected outputs that never appeared earn nothing
+    if (checked < expected.size())
+      undecided -= expected.size() - checked;
+    ret.outputs.push_back(outputs);
+    return keep_going;
+  };
+
+  try {
+    for (size_t i = 0; i < inputs.size(); i++) {
+      bool finished = run_input(inputs[i], i < scoring.expected.size() ? scoring.expected[i] : none);
+      if (!finished || (i + 1 < inputs.size() && hopeless())) {
+        ret.stopped_early = true;
+        break;
+      }
+    }
+    ret.ok = true;
+  } catch (const logic_error& e) {
+    ret.error = e.what();
+  }
+  ret.best_possible = ret.score + undecided;
+  return ret;
+}
+
+ScoreResult score_genome(ByteSpan genome, const vector<vector<Data> >& inputs,
+                         int max_iterations, const Scoring& scoring, ContextPool& contexts) {
+  ScoreResult ret;
+  shared_ptr<const Program> program;
+  try {
+    program = prepare_program(lift_bytes_to_graph(genome));
+  } catch (const logic_error& e) {
+    ret.error = e.what();
+    return ret;
+  }
+  PooledContext context(contexts, program);
+  context->load_genome(genome);
+  return score_context(*context, inputs, max_iterations, scoring);
+}
+
+vector<ScoreResult> score_population(PopulationEvaluator& evaluator, const vector<Genome>& genomes,
+                                     const vector<vector<Data> >& inputs,
+                                     int max_iterations, const Scoring& scoring) {
+  vector<ScoreResult> ret(genomes.size());
+  evaluator.pool.run(genomes.size(), [&] (size_t i) {
+      ret[i] = score_genome(genomes[i], inputs, max_iterations, scoring, evaluator.contexts);
+  });
+  return ret;
+}
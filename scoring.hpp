@@ -0,0 +1,49 @@
+#pragma once
+
+#include "ast.hpp"
+#include "pool.hpp"
+#include "population.hpp"
+#include "vm.hpp"
+#include <functional>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Partial credit for producing one output where another was expected
+typedef function<double(Data produced, Data expected)> OutputCredit;
+
+// What a genome is scored against. Each expected output earns between 0
+// and 1: 1 for an exact match, or whatever `credit` gives, clamped to that
+// range. Outputs past the expected ones earn nothing and cost nothing, so
+// a genome's score can reach the number of expected outputs at most.
+struct Scoring {
+  vector<vector<Data> > expected; // Per test input
+  OutputCredit credit;            // Exact match only if empty
+  double threshold;               // Stop once the score cannot exceed this
+  Scoring() : threshold(-1) { }
+  double max_score() const;
+};
+
+struct ScoreResult {
+  bool ok;
+  string error;
+  double score;         // Credit earned
+  double best_possible; // Score it could still have reached when it stopped
+  bool stopped_early;   // Stopped as soon as best_possible <= threshold
+  uint64_t steps;       // Over all inputs
+  vector<vector<Data> > outputs; // Of the inputs that were run
+  ScoreResult() : ok(false), score(0), best_possible(0), stopped_early(false), steps(0) { }
+};
+
+// Runs the context's program on each input in turn and checks every output
+// against the expected one as soon as it appears. A run that can no longer
+// beat the threshold, because of wrong outputs so far, is abandoned there,
+// and so are the inputs after it. A run that settles at a fixed point ends.
+extern ScoreResult score_context(ExecutionContext&, const vector<vector<Data> >& inputs,
+                                 int max_iterations, const Scoring&);
+extern ScoreResult score_genome(ByteSpan, const vector<vector<Data> >& inputs,
+                                int max_iterations, const Scoring&, ContextPool&);
+// Scores a whole population on the evaluator's pool
+extern vector<ScoreResult> score_population(PopulationEvaluator&, const vector<Genome>&,
+                                            const vector<vector<Data> >& inputs,
+                                            int max_iterations, const Scoring&);
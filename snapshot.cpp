@@ -0,0 +1,230 @@
+#include "snapshot.hpp"
+#include "cache.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+using namespace std;
+
+static const char SNAPSHOT_MAGIC[8] = { 'G', 'V', 'M', 'S', 'N', 'P', '0', '2' };
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Snapshots store the program hash as it is laid out in memory"
+#endif
+
+uint64_t program_hash(const Program& program) {
+  auto hash_vector = [] (uint64_t seed, const void* data, size_t bytes) {
+    return hash_bytes(static_cast<const uint8_t*>(data), bytes, seed);
+  };
+  uint64_t size = program.size();
+  auto hash = hash_vector(14695981039346656037ULL, &size, sizeof(size));
+  hash = hash_vector(hash, program.instructions.data(), program.instructions.size() * sizeof(Instruction));
+  hash = hash_vector(hash, program.immediates.data(), program.immediates.size());
+  for (int i = 0; i < MAX_OPERANDS; i++)
+    hash = hash_vector(hash, program.operands[i].data(), program.operands[i].size() * sizeof(AbsoluteAddress));
+  return hash;
+}
+
+static void put_varint(vector<uint8_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(uint8_t(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(value);
+}
+
+static uint64_t zigzag(int64_t value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+static void put_bytes(vector<uint8_t>& out, const vector<Data>& data) {
+  put_varint(out, data.size());
+  out.insert(out.end(), data.begin(), data.end());
+}
+
+// Reads a snapshot front to back, throwing on anything out of bounds
+struct SnapshotReader {
+  const vector<uint8_t>& in;
+  size_t at;
+  explicit SnapshotReader(const vector<uint8_t>& _in) : in(_in), at(0) { }
+  void need(size_t bytes) {
+    if (this->in.size() - this->at < bytes)
+      throw runtime_error("Truncated snapshot");
+  }
+  uint8_t byte() {
+    this->need(1);
+    return this->in[this->at++];
+  }
+  uint64_t varint() {
+    uint64_t ret = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      auto b = this->byte();
+      ret |= uint64_t(b & 0x7F) << shift;
+      if (!(b & 0x80))
+        return ret;
+    }
+    throw runtime_error("Malformed varint in snapshot");
+  }
+  // A count or address that has to be below the limit
+  size_t bounded(uint64_t limit, const char* what) {
+    auto ret = this->varint();
+    if (ret >= limit)
+      throw runtime_error(string("Snapshot ") + what + " out of range");
+    return ret;
+  }
+  vector<Data> bytes() {
+    auto count = this->bounded(this->in.size() + 1, "length");
+    this->need(count);
+    vector<Data> ret(this->in.begin() + this->at, this->in.begin() + this->at + count);
+    this->at += count;
+    return ret;
+  }
+};
+
+vector<uint8_t> save_snapshot(const ExecutionContext& context) {
+  auto& program = *context.program;
+  auto& nodes = context.nodes;
+  auto size = program.size();
+  vector<uint8_t> out(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC + sizeof(SNAPSHOT_MAGIC));
+  auto hash = program_hash(program);
+  out.insert(out.end(), reinterpret_cast<uint8_t*>(&hash), reinterpret_cast<uint8_t*>(&hash) + sizeof(hash));
+  put_varint(out, size);
+  put_bytes(out, context.registers);
+
+  // Each sparse list is a count followed by the gaps between addresses
+  auto put_sparse = [&] (function<bool(AbsoluteAddress)> wanted, function<void(AbsoluteAddress)> value) {
+    vector<AbsoluteAddress> addresses;
+    for (size_t i = 0; i < size; i++)
+      if (wanted(i))
+        addresses.push_back(i);
+    put_varint(out, addresses.size());
+    AbsoluteAddress previous = 0;
+    for_each(addresses.begin(), addresses.end(), [&] (AbsoluteAddress address) {
+        put_varint(out, address - previous);
+        value(address);
+        previous = address;
+    });
+  };
+  put_sparse([&] (AbsoluteAddress a) { return nodes.is_active(a); },
+             [] (AbsoluteAddress) { });
+  put_sparse([&] (AbsoluteAddress a) { return nodes.output(a) != 0; },
+             [&] (AbsoluteAddress a) { out.push_back(nodes.output(a)); });
+  put_sparse([&] (AbsoluteAddress a) { return nodes.extra_state(a) != 0; },
+             [&] (AbsoluteAddress a) { out.push_back(nodes.extra_state(a)); });
+
+  auto& pending = context.pending_instructions;
+  put_varint(out, pending.size());
+  int64_t previous = 0;
+  for_each(pending.begin(), pending.end(), [&] (AbsoluteAddress address) {
+      put_varint(out, zigzag(int64_t(address) - previous));
+      previous = address;
+  });
+
+  put_bytes(out, context.input_data);
+  put_bytes(out, context.output_data);
+
+  auto& target = context.target;
+  vector<size_t> written;
+  for (size_t i = 0; i < target.size(); i++)
+    if (target.is_written(i))
+      written.push_back(i);
+  put_varint(out, written.size());
+  size_t previous_byte = 0;
+  for_each(written.begin(), written.end(), [&] (size_t position) {
+      put_varint(out, position - previous_byte);
+      out.push_back(target.get(position));
+      previous_byte = position;
+  });
+  return out;
+}
+
+void restore_snapshot(ExecutionContext& context, const vector<uint8_t>& in) {
+  SnapshotReader reader(in);
+  reader.need(sizeof(SNAPSHOT_MAGIC) + sizeof(uint64_t));
+  if (memcmp(in.data(), SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    throw runtime_error("Not a snapshot");
+  uint64_t hash;
+  memcpy(&hash, in.data() + sizeof(SNAPSHOT_MAGIC), sizeof(hash));
+  reader.at = sizeof(SNAPSHOT_MAGIC) + sizeof(hash);
+  auto& program = *context.program;
+  auto size = program.size();
+  if (hash != program_hash(program) || reader.varint() != size)
+    throw runtime_error("Snapshot is of a different program");
+
+  context.reset();
+  auto& nodes = context.nodes;
+  context.registers = reader.bytes();
+  if (context.registers.size() != MAX_REGISTERS)
+    throw runtime_error("Snapshot has " + to_string(context.registers.size()) + " registers");
+
+  auto read_sparse = [&] (function<void(AbsoluteAddress)> value) {
+    auto count = reader.bounded(size + 1, "count");
+    size_t address = 0;
+    for (size_t i = 0; i < count; i++) {
+      address += reader.varint();
+      if (address >= size)
+        throw runtime_error("Snapshot address out of range");
+      value(address);
+    }
+  };
+  read_sparse([&] (AbsoluteAddress a) { nodes.set_active(a); });
+  read_sparse([&] (AbsoluteAddress a) { nodes.output(a) = reader.byte(); });
+  // Only OP_IF keeps a state, and it selects one of its three dependencies
+  read_sparse([&] (AbsoluteAddress a) {
+      auto state = reader.byte();
+      if (program.instructions[a] != OP_IF || state > 2)
+        throw runtime_error("Snapshot has an invalid extra state");
+      nodes.extra_state(a) = state;
+  });
+
+  vector<AbsoluteAddress> pending(reader.bounded(size + 1, "count"));
+  int64_t previous = 0;
+  for (auto& address : pending) {
+    previous += unzigzag(reader.varint());
+    if (previous < 0 || previous >= (int64_t)size)
+      throw runtime_error("Snapshot address out of range");
+    address = previous;
+  }
+  // Pushes go to the front, so the last of the order goes in first
+  context.pending_instructions.reset(size);
+  for_each(pending.rbegin(), pending.rend(), [&] (AbsoluteAddress address) {
+      context.pending_instructions.push(address);
+  });
+
+  context.input_data = reader.bytes();
+  context.output_data = reader.bytes();
+  auto num_written = reader.bounded(in.size() + 1, "count");
+  size_t position = 0;
+  for (size_t i = 0; i < num_written; i++) {
+    position += reader.varint();
+    if (position >= RING_SIZE)
+      throw runtime_error("Snapshot address out of range");
+    context.target.set(position, reader.byte());
+  }
+  if (reader.at != in.size())
+    throw runtime_error("Trailing bytes in snapshot");
+}
+
+void write_snapshot_file(const string& path, const ExecutionContext& context) {
+  auto snapshot = save_snapshot(context);
+  ofstream out(path.c_str(), ios::binary | ios::trunc);
+  if (!out)
+    throw runtime_error("Cannot open " + path + " for writing");
+  out.write(reinterpret_cast<const char*>(snapshot.data()), snapshot.size());
+  if (!out)
+    throw runtime_error("Failed writing " + path);
+}
+
+void read_snapshot_file(const string& path, ExecutionContext& context) {
+  ifstream in(path.c_str(), ios::binary);
+  if (!in)
+    throw runtime_error("Cannot open " + path);
+  vector<uint8_t> snapshot((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  restore_snapshot(context, snapshot);
+}
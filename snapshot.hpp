@@ -0,0 +1,39 @@
+#pragma once
+
+#include "program.hpp"
+#include "vm.hpp"
+#include <stdint.h>
+#include <string>
+#include <vector>
+using namespace std;
+
+// Binary snapshot of an ExecutionContext between steps:
+//
+//   char    magic[8]       "GVMSNP02"
+//   uint64  program_hash   Little-endian; see program_hash
+//   varint  num_nodes
+//   varint  count, int8_t registers[count]     count == MAX_REGISTERS
+//   varint  count, varint active[count]         Ascending, delta-encoded
+//   varint  count, (varint delta, int8_t)[count] Nonzero outputs
+//   varint  count, (varint delta, uint8_t)[count] Nonzero extra states, OP_IF only, 1..2
+//   varint  count, zigzag varint pending[count]  Next step's order, delta-encoded
+//   varint  count, int8_t input_data[count]
+//   varint  count, int8_t output_data[count]
+//   varint  count, (varint delta, int8_t)[count] Bytes written to the target
+//
+// Varints are unsigned LEB128. The program itself is not stored: a
+// snapshot can only be restored into a context running a program with the
+// same hash, and everything a fresh context starts with (inactive nodes,
+// zero outputs and states) costs nothing. Nor is the genome mapped as
+// ring 0: load it into the context before restoring, as for a fresh run.
+
+// Hash of what a program executes: instructions, immediates and operands
+extern uint64_t program_hash(const Program&);
+
+extern vector<uint8_t> save_snapshot(const ExecutionContext&);
+// Replaces the context's mutable state; the context must already hold the
+// snapshot's program. Malformed snapshots throw runtime_error.
+extern void restore_snapshot(ExecutionContext&, const vector<uint8_t>&);
+
+extern void write_snapshot_file(const string& path, const ExecutionContext&);
+extern void read_snapshot_file(const string& path, ExecutionContext&);
@@ -0,0 +1,38 @@
+#include "stats.hpp"
+#include <algorithm>
+using namespace std;
+
+void ExecutionStats::reset() {
+  fill_n(this->executions, NUM_INSTRUCTIONS, 0);
+  fill_n(this->stalls, NUM_INSTRUCTIONS, 0);
+  this->steps = 0;
+  this->step_cycles = 0;
+  this->max_step_cycles = 0;
+  this->max_pending = 0;
+}
+
+ExecutionStats& ExecutionStats::operator+=(const ExecutionStats& other) {
+  for (int i = 0; i < NUM_INSTRUCTIONS; i++) {
+    this->executions[i] += other.executions[i];
+    this->stalls[i] += other.stalls[i];
+  }
+  this->steps += other.steps;
+  this->step_cycles += other.step_cycles;
+  this->max_step_cycles = max(this->max_step_cycles, other.max_step_cycles);
+  this->max_pending = max(this->max_pending, other.max_pending);
+  return *this;
+}
+
+void ExecutionStats::print(ostream& out) const {
+  out << "Steps: " << this->steps
+      << ", cycles: " << this->step_cycles
+      << ", max cycles per step: " << this->max_step_cycles
+      << ", max pending: " << this->max_pending << endl;
+  for (int i = 0; i < NUM_INSTRUCTIONS; i++) {
+    if (!this->executions[i] && !this->stalls[i])
+      continue;
+    out << instruction_names.at(Instruction(i))
+        << ": executed " << this->executions[i]
+        << ", stalled " << this->stalls[i] << endl;
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "ast.hpp"
+#include <chrono>
+#include <iostream>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+using namespace std;
+
+const int NUM_INSTRUCTIONS = OP_TRIGGER + 1;
+
+// Counters gathered by ExecutionContext when the VM is built with
+// VM_INSTRUMENT defined. Without it the hooks compile to nothing and the
+// counters stay at zero. Counters only ever add up, so the stats of many
+// runs, or of a whole population, can be summed with +=.
+struct ExecutionStats {
+  uint64_t executions[NUM_INSTRUCTIONS]; // Handler calls, per instruction
+  uint64_t stalls[NUM_INSTRUCTIONS];     // Visits that found an input inactive
+  uint64_t steps;
+  uint64_t step_cycles;     // Summed over all steps
+  uint64_t max_step_cycles;
+  uint64_t max_pending;     // Pending-set high-water mark
+
+  ExecutionStats() { this->reset(); }
+  void reset();
+  ExecutionStats& operator+=(const ExecutionStats&);
+  void print(ostream&) const;
+};
+
+#ifdef VM_INSTRUMENT
+#define VM_INSTRUMENTED(statement) statement
+#else
+#define VM_INSTRUMENTED(statement)
+#endif
+
+// Time stamp counter where there is one, nanoseconds elsewhere
+inline uint64_t cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
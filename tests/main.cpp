@@ -1,10 +1,40 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE Instructions
 
+#include "../aot/programs.hpp"
 #include "../ast.hpp"
+#include "../batch.hpp"
+#include "../cache.hpp"
+#include "../corpus.hpp"
+#include "../event.hpp"
+#include "../fold.hpp"
+#include "../island.hpp"
+#include "../jit.hpp"
+#include "../lockstep.hpp"
+#include "../memory.hpp"
+#include "../nodestore.hpp"
+#include "../pool.hpp"
+#include "../popfile.hpp"
+#include "../pipeline.hpp"
+#include "../population.hpp"
+#include "../program.hpp"
+#include "../prune.hpp"
+#include "../queue.hpp"
+#include "../relift.hpp"
+#include "../resumable.hpp"
+#include "../scoring.hpp"
+#include "../snapshot.hpp"
 #include "../vm.hpp"
 #include <boost/test/unit_test.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 using namespace std;
 
@@ -60,6 +90,31 @@ BOOST_AUTO_TEST_CASE( sample_addition_program) {
   BOOST_CHECK_EQUAL(context.output_data[0], 13);
 }
 
+BOOST_AUTO_TEST_CASE( debug_trace_goes_to_debug_output) {
+  vector<int8_t> addition_program{
+    OP_CONST, 6,
+    OP_CONST, 7,
+    OP_ADD, -1, -2,
+    OP_OUTPUT, -1,
+    OP_TRIGGER, -1,
+  };
+  auto nodes = lift_bytes_to_graph(addition_program);
+  ostringstream trace;
+  auto context = ExecutionContext(nodes);
+  context.debug = true;
+  context.debug_output = &trace;
+  context.step_until_done(10);
+  BOOST_CHECK_EQUAL(context.output_data.size(), 1);
+  BOOST_CHECK(trace.str().find("Executing OP_ADD") != string::npos);
+
+  auto quiet = ExecutionContext(nodes);
+  ostringstream no_trace;
+  quiet.debug_output = &no_trace;
+  quiet.step_until_done(10);
+  BOOST_CHECK(quiet.output_data == context.output_data);
+  BOOST_CHECK(no_trace.str().empty());
+}
+
 BOOST_AUTO_TEST_CASE( print_sample_program) {
   vector<InstructionNode> nodes = lift_bytes_to_graph(sample_program());
   BOOST_TEST_MESSAGE("Printing sample program");
@@ -140,6 +195,1199 @@ BOOST_AUTO_TEST_CASE( op_if_is_lazy) {
   BOOST_CHECK_EQUAL(context.output_data[0], 6);
 }
 
+BOOST_AUTO_TEST_CASE( batch_matches_fresh_contexts) {
+  vector<int8_t> if_program{
+    OP_CONST,    5,
+    OP_CONST,    6,
+    OP_CONST,    1,
+    OP_IF,      -1, -2, -3,
+    OP_OUTPUT,  -1,
+    OP_TRIGGER, -1,
+  };
+  auto nodes = lift_bytes_to_graph(if_program);
+  auto program = make_shared<const Program>(compile_program(nodes));
+  vector<vector<Data>> inputs{ {}, {1, 2, 3}, {4} };
+  auto outputs = evaluate_batch(program, inputs, 10);
+  BOOST_REQUIRE_EQUAL(outputs.size(), inputs.size());
+  for (size_t i = 0; i < inputs.size(); i++) {
+    auto context = ExecutionContext(nodes);
+    context.input_data = inputs[i];
+    context.step_until_done(10);
+    BOOST_CHECK(outputs[i] == context.output_data);
+  }
+  BOOST_CHECK_EQUAL((int)outputs[2][0], 6);
+}
+
+BOOST_AUTO_TEST_CASE( lockstep_matches_scalar_contexts) {
+  vector<int8_t> program_bytes{
+    OP_GET_REGISTER, 0,
+    OP_CONST,        100,
+    OP_ADD,          -2, -1,
+    OP_GET_REGISTER, 0,
+    OP_CONST,        7,
+    OP_IF,           -2, -1, -3,
+    OP_OUTPUT,       -1,
+    OP_TRIGGER,      -1,
+    OP_GET_REGISTER, 0,
+    OP_GET_REGISTER, 1,
+    OP_DIVIDE,       -2, -1,
+    OP_MULTIPLY,     -1, -3,
+    OP_OUTPUT,       -1,
+    OP_TRIGGER,      -1,
+  };
+  auto nodes = lift_bytes_to_graph(program_bytes);
+  auto program = make_shared<const Program>(compile_program(nodes));
+  auto r0 = [] (int lane) { return static_cast<Data>(lane * 37 - 128); };
+  auto r1 = [] (int lane) { return static_cast<Data>(lane % 5 - 2); };
+
+  LockstepContext lockstep(program, LANES);
+  for (int lane = 0; lane < LANES; lane++) {
+    lockstep.registers[0][lane] = r0(lane);
+    lockstep.registers[1][lane] = r1(lane);
+  }
+  lockstep.step_until_done(20);
+  BOOST_CHECK(lockstep.groups.size() > 1);
+  for (int lane = 0; lane < LANES; lane++) {
+    auto context = ExecutionContext(program);
+    context.registers[0] = r0(lane);
+    context.registers[1] = r1(lane);
+    context.step_until_done(20);
+    BOOST_CHECK(lockstep.output_data[lane] == context.output_data);
+  }
+  // The byte rings: one genome, a target per lane. Some register values
+  // lead the sample to its unimplemented OP_CUT, so both sides stop before
+  // any lane gets there.
+  auto genome = sample_genome();
+  auto sample = make_shared<const Program>(compile_program(lift_bytes_to_graph(genome)));
+  auto scalar_context = [&] (int lane) {
+    unique_ptr<ExecutionContext> context(new ExecutionContext(sample));
+    context->load_genome(genome);
+    context->registers[0] = r1(lane);
+    return context;
+  };
+  int num_steps = 100;
+  for (int lane = 0; lane < LANES; lane++) {
+    auto probe = scalar_context(lane);
+    int steps = 0;
+    try {
+      for (; steps < num_steps && !probe->pending_instructions.empty(); steps++)
+        probe->step();
+    } catch (const logic_error&) { }
+    num_steps = min(num_steps, steps);
+  }
+  BOOST_REQUIRE_GT(num_steps, 0);
+  LockstepContext copying(sample, LANES);
+  copying.load_genome(genome);
+  for (int lane = 0; lane < LANES; lane++)
+    copying.registers[0][lane] = r1(lane);
+  copying.step_until_done(num_steps);
+  bool wrote = false;
+  for (int lane = 0; lane < LANES; lane++) {
+    auto context = scalar_context(lane);
+    context->step_until_done(num_steps);
+    BOOST_CHECK(copying.output_data[lane] == context->output_data);
+    BOOST_CHECK(copying.targets[lane].bytes() == context->target.bytes());
+    wrote = wrote || context->target.size() > 0;
+  }
+  BOOST_CHECK(wrote);
+}
+
+BOOST_AUTO_TEST_CASE( batch_lockstep_matches_batch) {
+  // More inputs than lanes, so the last LockstepContext is partly empty
+  vector<vector<Data> > inputs(LANES + 8, vector<Data>{1, 2, 3});
+  auto genomes = random_genomes(5, 64, 64);
+  genomes.push_back(addition_genome());
+  genomes.push_back(sample_genome());
+  int lockstepped = 0;
+  for_each(genomes.begin(), genomes.end(), [&] (const Genome& genome) {
+      shared_ptr<const Program> program;
+      try {
+        program = prepare_program(lift_bytes_to_graph(genome));
+      } catch (const logic_error&) {
+        return;
+      }
+      lockstepped += lockstep_supports(*program);
+      vector<vector<Data> > expected, actual;
+      vector<PagedMemory> expected_targets, actual_targets;
+      string expected_error, actual_error;
+      try {
+        ExecutionContext context(program);
+        context.load_genome(genome);
+        expected = evaluate_batch(context, inputs, 200, &expected_targets);
+      } catch (const logic_error& e) {
+        expected_error = e.what();
+      }
+      try {
+        ExecutionContext context(program);
+        context.load_genome(genome);
+        actual = evaluate_batch_lockstep(context, inputs, 200, &actual_targets);
+      } catch (const logic_error& e) {
+        actual_error = e.what();
+      }
+      BOOST_CHECK_EQUAL(expected_error, actual_error);
+      BOOST_CHECK(expected == actual);
+      BOOST_REQUIRE_EQUAL(expected_targets.size(), actual_targets.size());
+      for (size_t i = 0; i < expected_targets.size(); i++)
+        BOOST_CHECK(expected_targets[i].bytes() == actual_targets[i].bytes());
+  });
+  BOOST_CHECK_GT(lockstepped, 0);
+  auto sample = prepare_program(lift_bytes_to_graph(sample_genome()));
+  BOOST_CHECK(!lockstep_supports(*sample));
+}
+
+BOOST_AUTO_TEST_CASE( population_evaluator_matches_serial) {
+  vector<Genome> genomes{
+    { OP_CONST, 6, OP_CONST, 7, OP_ADD, -1, -2, OP_OUTPUT, -1, OP_TRIGGER, -1 },
+    { OP_CONST, 5, OP_CONST, 6, OP_CONST, 1, OP_IF, -1, -2, -3, OP_OUTPUT, -1, OP_TRIGGER, -1 },
+    { OP_CONST, 1, 100, OP_TRIGGER, -1 },
+    sample_program(),
+  };
+  for (int i = 0; i < 50; i++)
+    genomes.push_back(genomes[i % 2]);
+  vector<vector<Data> > inputs{ {}, {1} };
+  PopulationEvaluator evaluator(4);
+  auto results = evaluator.evaluate(genomes, inputs, 100);
+  BOOST_REQUIRE_EQUAL(results.size(), genomes.size());
+  BOOST_CHECK(!results[2].ok);
+  BOOST_CHECK(results[3].ok);
+  for (size_t i = 0; i < genomes.size(); i++) {
+    auto expected = evaluate_genome(genomes[i], inputs, 100);
+    BOOST_CHECK_EQUAL(results[i].ok, expected.ok);
+    BOOST_CHECK(results[i].outputs == expected.outputs);
+  }
+  BOOST_CHECK_EQUAL((int)results[0].outputs[1][0], 13);
+}
+
+BOOST_AUTO_TEST_CASE( pooled_contexts_reuse_their_arenas) {
+  auto long_program = make_shared<const Program>(compile_program(lift_bytes_to_graph(sample_program())));
+  vector<int8_t> addition_program{
+    OP_CONST, 6,
+    OP_CONST, 7,
+    OP_ADD, -1, -2,
+    OP_OUTPUT, -1,
+    OP_TRIGGER, -1,
+  };
+  auto short_program = make_shared<const Program>(compile_program(lift_bytes_to_graph(addition_program)));
+  ContextPool pool;
+  ExecutionContext* first;
+  unsigned long growths;
+  {
+    PooledContext context(pool, long_program);
+    first = &*context;
+    growths = context->nodes.storage().num_growths();
+  }
+  BOOST_CHECK_EQUAL(pool.size(), 1);
+  for (int i = 0; i < 3; i++) {
+    PooledContext context(pool, short_program);
+    BOOST_CHECK_EQUAL(&*context, first);
+    BOOST_CHECK(!context->is_pending(0));
+    context->step_until_done(10);
+    BOOST_CHECK_EQUAL(context->output_data.size(), 1);
+    BOOST_CHECK_EQUAL(context->output_data[0], 13);
+    BOOST_CHECK_EQUAL(context->nodes.storage().num_growths(), growths);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( population_file_round_trip) {
+  vector<Genome> genomes{
+    sample_program(),
+    { },
+    { OP_CONST, 6, OP_CONST, 7, OP_ADD, -1, -2, OP_OUTPUT, -1, OP_TRIGGER, -1 },
+  };
+  char path[] = "/tmp/genetic-vm-popXXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+  write_population_file(path, genomes);
+  {
+    PopulationFile file(path);
+    BOOST_REQUIRE_EQUAL(file.size(), genomes.size());
+    for (size_t i = 0; i < genomes.size(); i++) {
+      auto span = file.genome(i);
+      BOOST_CHECK(Genome(span.begin(), span.end()) == genomes[i]);
+    }
+    BOOST_CHECK_EQUAL(lift_bytes_to_graph(file.genome(0)).size(), 14);
+    PopulationEvaluator evaluator(2);
+    auto results = evaluator.evaluate(file.genomes(), vector<vector<Data> >(1), 10);
+    BOOST_CHECK_EQUAL((int)results[2].outputs[0][0], 13);
+  }
+  { ofstream truncate(path, ios::binary | ios::trunc); truncate << "GVMPOP01"; }
+  BOOST_CHECK_THROW(PopulationFile file(path), runtime_error);
+  remove(path);
+}
+
+BOOST_AUTO_TEST_CASE( compiled_dependencies) {
+  vector<int8_t> if_program{
+    OP_CONST,    5,
+    OP_CONST,    6,
+    OP_ADD,     -1, -2,
+    OP_IF,      -1, -2, -3,
+    OP_TRIGGER, -1,
+  };
+  auto program = compile_program(lift_bytes_to_graph(if_program));
+  auto& add = program.compiled[2];
+  BOOST_CHECK_EQUAL(add.num_dependencies, 2);
+  BOOST_CHECK_EQUAL(add.dependencies[0], 1);
+  BOOST_CHECK_EQUAL(add.dependencies[1], 0);
+  auto& op_if = program.compiled[3];
+  BOOST_CHECK(op_if.per_state);
+  BOOST_CHECK_EQUAL(op_if.waits_end(1) - op_if.waits_begin(1), 1);
+  BOOST_CHECK_EQUAL(*op_if.waits_begin(0), 2);
+  BOOST_CHECK_EQUAL(*op_if.waits_begin(1), 1);
+  BOOST_CHECK_EQUAL(*op_if.waits_begin(2), 0);
+  BOOST_CHECK_EQUAL(program.compiled[0].num_dependencies, 0);
+}
+
+BOOST_AUTO_TEST_CASE( node_store_active_bits) {
+  NodeStore store;
+  store.reset(130);
+  BOOST_CHECK_EQUAL(store.num_active_words(), 3);
+  store.set_active(0);
+  store.set_active(64);
+  store.set_active(129);
+  BOOST_CHECK( store.is_active(0));
+  BOOST_CHECK(!store.is_active(63));
+  BOOST_CHECK( store.is_active(64));
+  BOOST_CHECK( store.is_active(129));
+  store.clear_active(64);
+  BOOST_CHECK(!store.is_active(64));
+  BOOST_CHECK( store.is_active(0));
+}
+
+BOOST_AUTO_TEST_CASE( relift_matches_full_lift) {
+  auto same_nodes = [] (const InstructionNode& a, const InstructionNode& b) {
+    return a.address == b.address && a.instruction == b.instruction
+      && memcmp(&a.input, &b.input, sizeof(a.input)) == 0;
+  };
+  mt19937 rng(12345);
+  uniform_int_distribution<int> byte(0, 20);
+  for (int trial = 0; trial < 500; trial++) {
+    vector<int8_t> genome(1 + rng() % 64);
+    for (auto& b : genome)
+      b = byte(rng);
+    auto parent = lift_genome(genome);
+    BOOST_REQUIRE_EQUAL(parent.nodes.size(), lift_bytes_to_graph(genome).size());
+
+    vector<ByteEdit> edits(1 + rng() % 3);
+    for (auto& edit : edits)
+      edit = ByteEdit{rng() % genome.size(), int8_t(byte(rng))};
+    apply_edits(genome, edits);
+    auto child = relift(parent, genome, edits);
+    auto expected = lift_genome(genome);
+
+    BOOST_REQUIRE_EQUAL(child.nodes.size(), expected.nodes.size());
+    BOOST_CHECK_EQUAL(child.tail, expected.tail);
+    BOOST_CHECK(child.offsets == expected.offsets);
+    for (size_t i = 0; i < child.nodes.size(); i++)
+      BOOST_CHECK(same_nodes(child.nodes[i], expected.nodes[i]));
+  }
+}
+
+#ifdef VM_INSTRUMENT
+BOOST_AUTO_TEST_CASE( execution_stats_count_instructions) {
+  vector<int8_t> addition_program{
+    OP_CONST, 6,
+    OP_CONST, 7,
+    OP_ADD, -1, -2,
+    OP_OUTPUT, -1,
+    OP_TRIGGER, -1,
+  };
+  auto context = ExecutionContext(lift_bytes_to_graph(addition_program));
+  context.step_until_done(10);
+  auto& stats = context.stats;
+  BOOST_CHECK_EQUAL(stats.executions[OP_CONST], 2);
+  BOOST_CHECK_EQUAL(stats.executions[OP_ADD], 1);
+  BOOST_CHECK_EQUAL(stats.executions[OP_OUTPUT], 1);
+  BOOST_CHECK_EQUAL(stats.executions[OP_TRIGGER], 1);
+  BOOST_CHECK_EQUAL(stats.stalls[OP_TRIGGER], 3);
+  BOOST_CHECK_EQUAL(stats.stalls[OP_OUTPUT], 2);
+  BOOST_CHECK_EQUAL(stats.stalls[OP_ADD], 1);
+  BOOST_CHECK_EQUAL(stats.stalls[OP_CONST], 0);
+  BOOST_CHECK_EQUAL(stats.steps, 4);
+  BOOST_CHECK_EQUAL(stats.max_pending, 5);
+
+  auto total = stats;
+  total += stats;
+  BOOST_CHECK_EQUAL(total.executions[OP_CONST], 4);
+  BOOST_CHECK_EQUAL(total.steps, 8);
+  BOOST_CHECK_EQUAL(total.max_pending, 5);
+
+  vector<Genome> genomes(3, addition_program);
+  PopulationEvaluator evaluator(2);
+  auto results = evaluator.evaluate(genomes, vector<vector<Data> >(2), 10);
+  ExecutionStats population;
+  for_each(results.begin(), results.end(), [&] (const GenomeResult& result) {
+      population += result.stats;
+  });
+  BOOST_CHECK_EQUAL(population.executions[OP_OUTPUT], 6);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE( prune_drops_unreachable_nodes) {
+  vector<int8_t> dead_constants{
+    OP_CONST, 6,
+    OP_CONST, 7,
+    OP_ADD, -1, -2,
+    OP_OUTPUT, -1,
+    OP_TRIGGER, -1,
+    OP_CONST, 3,
+    OP_CONST, 4,
+  };
+  auto pruned = prune_program(compile_program(lift_bytes_to_graph(dead_constants)));
+  BOOST_CHECK_EQUAL(pruned.size(), 5);
+  BOOST_REQUIRE_EQUAL(pruned.triggers.size(), 1);
+  BOOST_CHECK_EQUAL(pruned.triggers[0], 4);
+  auto context = ExecutionContext(make_shared<const Program>(pruned));
+  context.step_until_done(10);
+  BOOST_REQUIRE_EQUAL(context.output_data.size(), 1);
+  BOOST_CHECK_EQUAL(context.output_data[0], 13);
+
+  // GET_BYTE reads its index without waiting on it
+  vector<int8_t> unscheduled_operand{
+    OP_CONST, 1,
+    OP_GET_BYTE, 0, -1,
+    OP_OUTPUT, -1,
+    OP_TRIGGER, -1,
+  };
+  pruned = prune_program(compile_program(lift_bytes_to_graph(unscheduled_operand)));
+  BOOST_REQUIRE_EQUAL(pruned.size(), 4);
+  BOOST_CHECK_EQUAL(pruned.instructions[3], OP_NOP);
+  BOOST_CHECK_EQUAL(pruned.operand(0, 0), 3);
+}
+
+BOOST_AUTO_TEST_CASE( pruned_programs_match_originals) {
+  mt19937 rng(777);
+  uniform_int_distribution<int> byte(0, 20);
+  for (int trial = 0; trial < 300; trial++) {
+    vector<int8_t> genome(2 + rng() % 80);
+    for (auto& b : genome)
+      b = byte(rng);
+    auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(genome)));
+    auto pruned = make_shared<const Program>(prune_program(*program));
+    BOOST_CHECK_LE(pruned->size(), program->size() + 1);
+    ExecutionContext full(program), compact(pruned);
+    full.registers[3] = compact.registers[3] = trial;
+    bool full_threw = false, compact_threw = false;
+    try { full.step_until_done(200); } catch (const logic_error&) { full_threw = true; }
+    try { compact.step_until_done(200); } catch (const logic_error&) { compact_threw = true; }
+    BOOST_CHECK_EQUAL(full_threw, compact_threw);
+    BOOST_CHECK(full.output_data == compact.output_data);
+    BOOST_CHECK(full.registers == compact.registers);
+    BOOST_CHECK_EQUAL(full.pending_instructions.size(), compact.pending_instructions.size());
+  }
+}
+
+BOOST_AUTO_TEST_CASE( result_cache_evaluates_duplicates_once) {
+  Genome addition{ OP_CONST, 6, OP_CONST, 7, OP_ADD, -1, -2, OP_OUTPUT, -1, OP_TRIGGER, -1 };
+  // Same nodes; the trailing OP_ADD is incomplete and never lifted
+  Genome addition_with_tail = addition;
+  addition_with_tail.push_back(OP_ADD);
+  Genome subtraction{ OP_CONST, 6, OP_CONST, 7, OP_SUBTRACT, -1, -2, OP_OUTPUT, -1, OP_TRIGGER, -1 };
+  vector<Genome> genomes;
+  for (int i = 0; i < 20; i++) {
+    genomes.push_back(addition);
+    genomes.push_back(addition_with_tail);
+    genomes.push_back(subtraction);
+  }
+  vector<vector<Data> > inputs{ {}, {1} };
+  PopulationEvaluator evaluator(4);
+  auto expected = evaluator.evaluate(genomes, inputs, 100);
+  evaluator.cache = make_shared<ResultCache>(100);
+  auto results = evaluator.evaluate(genomes, inputs, 100);
+  BOOST_CHECK_EQUAL(evaluator.cache->misses(), 2);
+  BOOST_CHECK_EQUAL(evaluator.cache->hits(), genomes.size() - 2);
+  for (size_t i = 0; i < genomes.size(); i++)
+    BOOST_CHECK(results[i].outputs == expected[i].outputs);
+
+  // A different iteration cap is a different test set
+  evaluator.evaluate(genomes, inputs, 50);
+  BOOST_CHECK_EQUAL(evaluator.cache->misses(), 4);
+
+  ResultCache small(2, 1);
+  ContextPool contexts;
+  for (int i = 0; i < 5; i++) {
+    Genome constant{ OP_CONST, int8_t(i), OP_OUTPUT, -1, OP_TRIGGER, -1 };
+    auto result = evaluate_genome(constant, inputs, 10, contexts, small);
+    BOOST_CHECK_EQUAL(result.outputs[0][0], i);
+  }
+  BOOST_CHECK_EQUAL(small.size(), 2);
+  Genome oldest{ OP_CONST, 0, OP_OUTPUT, -1, OP_TRIGGER, -1 };
+  evaluate_genome(oldest, inputs, 10, contexts, small);
+  BOOST_CHECK_EQUAL(small.misses(), 6);
+}
+
+BOOST_AUTO_TEST_CASE( fold_collapses_constant_chains) {
+  vector<int8_t> chain{
+    OP_CONST, 100,
+    OP_CONST, 100,
+    OP_ADD, -1, -2,     // 200 wraps to -56
+    OP_CONST, 0,
+    OP_DIVIDE, -2, -1,  // Division by zero gives 0
+    OP_CONST, 5,
+    OP_ADD, -1, -2,
+    OP_CONST, 9,
+    OP_NOP,
+    OP_IF, -1, -2, -3,  // NOP's 0 is even, so the third input is taken
+    OP_OUTPUT, -1,
+    OP_BLOCK1, -1,
+    OP_TRIGGER, -1,
+  };
+  auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(chain)));
+  BOOST_REQUIRE(can_fold(*program));
+  auto folded = make_shared<const Program>(fold_program(*program));
+  BOOST_CHECK_EQUAL(folded->size(), 3);
+  ExecutionContext original(program), optimized(folded);
+  original.step_until_done(100);
+  optimized.step_until_done(100);
+  BOOST_REQUIRE_EQUAL(original.output_data.size(), 1);
+  BOOST_CHECK_EQUAL((int)original.output_data[0], 5);
+  BOOST_CHECK(original.output_data == optimized.output_data);
+#ifdef VM_INSTRUMENT
+  BOOST_CHECK_LT(optimized.stats.steps, original.stats.steps);
+#endif
+
+  vector<int8_t> two_outputs{
+    OP_CONST, 1,
+    OP_OUTPUT, -1,
+    OP_CONST, 2,
+    OP_OUTPUT, -1,
+    OP_BLOCK2, -1, -3,
+    OP_TRIGGER, -1,
+  };
+  BOOST_CHECK(!can_fold(compile_program(lift_bytes_to_graph(two_outputs))));
+}
+
+BOOST_AUTO_TEST_CASE( folded_programs_match_originals) {
+  mt19937 rng(4242);
+  // Everything but BIND, CUT, GET_BYTE, SET_BYTE and SET_REGISTER
+  vector<int8_t> opcodes{ OP_ADD, OP_BLOCK1, OP_BLOCK2, OP_BLOCK3, OP_BLOCK4, OP_CONST, OP_DIVIDE,
+                          OP_GEQ, OP_GET_REGISTER, OP_IF, OP_LEQ, OP_MULTIPLY, OP_OUTPUT,
+                          OP_NOP, OP_SUBTRACT, OP_TRIGGER };
+  int num_folded = 0;
+  for (int trial = 0; trial < 3000; trial++) {
+    vector<int8_t> genome(2 + rng() % 40);
+    for (size_t i = 0; i < genome.size(); i++)
+      genome[i] = (rng() % 3) ? opcodes[rng() % opcodes.size()] : int8_t(rng());
+    genome[genome.size() - 2] = OP_TRIGGER;
+    genome[genome.size() - 1] = -int8_t(1 + rng() % 4);
+    vector<InstructionNode> nodes;
+    try {
+      nodes = lift_bytes_to_graph(genome);
+    } catch (const logic_error&) {
+      continue;
+    }
+    auto program = make_shared<const Program>(compile_program(nodes));
+    if (!can_fold(*program))
+      continue;
+    num_folded++;
+    auto folded = make_shared<const Program>(fold_program(*program));
+    ExecutionContext original(program), optimized(folded);
+    original.registers[trial % MAX_REGISTERS] = optimized.registers[trial % MAX_REGISTERS] = trial;
+    original.step_until_done(1000);
+    optimized.step_until_done(1000);
+    BOOST_REQUIRE(original.pending_instructions.empty());
+    BOOST_CHECK(optimized.pending_instructions.empty());
+    BOOST_CHECK(original.output_data == optimized.output_data);
+    BOOST_CHECK(original.registers == optimized.registers);
+#ifdef VM_INSTRUMENT
+    BOOST_CHECK_LE(optimized.stats.steps, original.stats.steps);
+#endif
+  }
+  BOOST_CHECK_GT(num_folded, 100);
+}
+
+BOOST_AUTO_TEST_CASE( fold_shrinks_constant_subtrees_in_place) {
+  mt19937 rng(2718);
+  vector<int8_t> binops{ OP_ADD, OP_DIVIDE, OP_GEQ, OP_LEQ, OP_MULTIPLY, OP_SUBTRACT };
+  vector<int8_t> genome;
+  // Appends an expression, children first, and returns its node count.
+  // Most leaves are constants.
+  function<int(int)> expression = [&] (int depth) {
+    if (depth == 0 || rng() % 4 == 0) {
+      genome.push_back(rng() % 5 ? OP_CONST : OP_GET_REGISTER);
+      genome.push_back(rng());
+      return 1;
+    }
+    auto size1 = expression(depth - 1);
+    auto size2 = expression(depth - 1);
+    genome.insert(genome.end(), { binops[rng() % binops.size()], int8_t(-1 - size2), -1 });
+    return 1 + size1 + size2;
+  };
+  int num_folded = 0, num_live = 0;
+  for (int trial = 0; trial < 1000; trial++) {
+    genome.clear();
+    for (int statements = 1 + rng() % 4; statements > 0; statements--) {
+      expression(1 + rng() % 4);
+      switch (rng() % 5) {
+      case 0:
+        genome.insert(genome.end(), { OP_OUTPUT, -1, OP_TRIGGER, -1 });
+        break;
+      case 1:
+        genome.insert(genome.end(), { OP_SET_REGISTER, int8_t(rng()), -1, OP_TRIGGER, -1 });
+        break;
+      case 2:
+        // Shared with a second reader, so it must stay
+        genome.insert(genome.end(), { OP_SET_BYTE, 1, -1, -1, OP_OUTPUT, -2, OP_BLOCK2, -1, -2,
+                                      OP_TRIGGER, -1 });
+        break;
+      case 3:
+        genome.insert(genome.end(), { OP_IF, -1, -1, -1, OP_OUTPUT, -1, OP_TRIGGER, -1 });
+        break;
+      default:
+        // Rereads the expression every time round a loop
+        genome.insert(genome.end(), { OP_TRIGGER, 2, OP_ADD, -2, 2, OP_SUBTRACT, -1, 1,
+                                      OP_SET_REGISTER, int8_t(rng()), -2 });
+        break;
+      }
+    }
+    auto program = make_shared<const Program>(prune_program(compile_program(lift_bytes_to_graph(genome))));
+    if (can_fold(*program))
+      continue;
+    auto folded = make_shared<const Program>(fold_program(*program));
+    BOOST_REQUIRE_LE(folded->size(), program->size());
+    if (folded->size() == program->size())
+      continue;
+    num_folded++;
+    ExecutionContext original(program), optimized(folded);
+    original.registers[trial % MAX_REGISTERS] = optimized.registers[trial % MAX_REGISTERS] = trial;
+    for (int step = 0; step < 300 && !original.pending_instructions.empty(); step++) {
+      original.step();
+      optimized.step();
+      BOOST_REQUIRE(original.output_data == optimized.output_data);
+      BOOST_REQUIRE(original.registers == optimized.registers);
+      BOOST_REQUIRE(original.target.bytes() == optimized.target.bytes());
+      BOOST_REQUIRE_EQUAL(original.settled(), optimized.settled());
+    }
+    BOOST_CHECK_EQUAL(original.pending_instructions.empty(), optimized.pending_instructions.empty());
+    // Still looping, so the folded expressions ran many times
+    num_live += !original.pending_instructions.empty() && !original.settled();
+  }
+  BOOST_CHECK_GT(num_folded, 300);
+  BOOST_CHECK_GT(num_live, 100);
+}
+
+BOOST_AUTO_TEST_CASE( jit_matches_interpreter) {
+  if (!jit_available())
+    return;
+  mt19937 rng(99);
+  uniform_int_distribution<int> byte(0, 20);
+  int num_traced = 0, num_looping = 0;
+  for (int trial = 0; trial < 500; trial++) {
+    // Whole instructions with small relative inputs, so nodes connect. Most
+    // programs have no OP_IF, BIND or CUT, so they can be traced.
+    vector<int8_t> genome;
+    for (int i = 0, n = 1 + rng() % 40; i < n; i++) {
+      auto instruction = instruction_from_bytes(byte(rng));
+      if ((instruction == OP_IF || instruction == OP_BIND || instruction == OP_CUT) && trial % 4)
+        instruction = OP_SUBTRACT;
+      genome.push_back(instruction);
+      for (int j = num_inputs_for_instruction_type(instruction_type(instruction)); j > 0; j--)
+        genome.push_back(int8_t(rng() % 9) - 4);
+    }
+    if (trial % 3 == 0) {
+      // A loop that rereads one of the nodes before it every time round
+      vector<int8_t> loop{ OP_TRIGGER, 2, OP_ADD, int8_t(-2 - rng() % 4), 2, OP_SUBTRACT, -1, 1,
+                           OP_SET_REGISTER, int8_t(rng()), -2 };
+      genome.insert(genome.end(), loop.begin(), loop.end());
+    }
+    genome.push_back(OP_TRIGGER);
+    genome.push_back(-int8_t(1 + rng() % 4));
+    auto nodes = lift_bytes_to_graph(genome);
+    auto program = make_shared<const Program>(compile_program(nodes));
+    auto jitted = make_shared<const Program>(jit_compile(*program));
+    if (jitted->trace) {
+      num_traced++;
+      num_looping += jitted->trace->cycle_start < jitted->trace->steps.size();
+    }
+    ExecutionContext interpreted(program), native(jitted);
+    interpreted.registers[trial % MAX_REGISTERS] = native.registers[trial % MAX_REGISTERS] = trial;
+    // Uneven slices, so traced runs stop and resume mid-trace, and run on
+    // past the end of traces that were cut short
+    for (int slice : { 1, 7, 50, 3000 }) {
+      StopReason interpreted_reason = STOP_DONE, native_reason = STOP_DONE;
+      bool interpreted_threw = false, native_threw = false;
+      try { interpreted_reason = interpreted.step_until_done(slice); } catch (const logic_error&) { interpreted_threw = true; }
+      try { native_reason = native.step_until_done(slice); } catch (const logic_error&) { native_threw = true; }
+      BOOST_REQUIRE_EQUAL(interpreted_threw, native_threw);
+      if (interpreted_threw)
+        break;
+      BOOST_REQUIRE_EQUAL(interpreted_reason, native_reason);
+      for (size_t i = 0; i < program->size(); i++) {
+        BOOST_REQUIRE_EQUAL(interpreted.nodes.is_active(i), native.nodes.is_active(i));
+        BOOST_REQUIRE_EQUAL((int)interpreted.nodes.output(i), (int)native.nodes.output(i));
+        BOOST_REQUIRE_EQUAL((int)interpreted.nodes.extra_state(i), (int)native.nodes.extra_state(i));
+      }
+      BOOST_REQUIRE(vector<AbsoluteAddress>(interpreted.pending_instructions.begin(), interpreted.pending_instructions.end())
+                    == vector<AbsoluteAddress>(native.pending_instructions.begin(), native.pending_instructions.end()));
+      BOOST_REQUIRE_EQUAL(interpreted.settled(), native.settled());
+      BOOST_REQUIRE(interpreted.output_data == native.output_data);
+      BOOST_REQUIRE(interpreted.registers == native.registers);
+      BOOST_REQUIRE(interpreted.target.bytes() == native.target.bytes());
+      if (interpreted_reason != STOP_ITERATION_LIMIT)
+        break;
+    }
+
+    // Pruning renumbers nodes, so it must not keep the trace
+    auto pruned = make_shared<const Program>(prune_program(*jitted));
+    BOOST_CHECK(!pruned->trace);
+    ExecutionContext reference(make_shared<const Program>(prune_program(*program))), after(pruned);
+    reference.registers[trial % MAX_REGISTERS] = after.registers[trial % MAX_REGISTERS] = trial;
+    bool reference_threw = false, after_threw = false;
+    try { reference.step_until_done(100); } catch (const logic_error&) { reference_threw = true; }
+    try { after.step_until_done(100); } catch (const logic_error&) { after_threw = true; }
+    BOOST_CHECK_EQUAL(reference_threw, after_threw);
+    BOOST_CHECK(reference.output_data == after.output_data);
+    BOOST_CHECK(reference.registers == after.registers);
+  }
+  BOOST_CHECK_GT(num_traced, 300);
+  BOOST_CHECK_GT(num_looping, 20);
+}
+
+BOOST_AUTO_TEST_CASE( jit_traces_livelocks) {
+  if (!jit_available())
+    return;
+  auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(livelock_genome())));
+  auto jitted = make_shared<const Program>(jit_compile(*program));
+  BOOST_REQUIRE(jitted->trace);
+  BOOST_CHECK_LT(jitted->trace->cycle_start, jitted->trace->steps.size());
+  ExecutionContext interpreted(program), native(jitted);
+  BOOST_CHECK_EQUAL(interpreted.step_until_done(100000), STOP_ITERATION_LIMIT);
+  BOOST_CHECK_EQUAL(native.step_until_done(100000), STOP_ITERATION_LIMIT);
+  BOOST_CHECK(interpreted.registers == native.registers);
+  BOOST_CHECK(interpreted.state_hash() == native.state_hash());
+  // Cycle detection needs every state, so it stays on the interpreter
+  native.reset();
+  BOOST_CHECK_EQUAL(native.step_until_done(1000, true), STOP_CYCLE);
+}
+
+BOOST_AUTO_TEST_CASE( jit_follows_branches_off_the_trace) {
+  if (!jit_available())
+    return;
+  // Outputs 5 if register 0 is odd and 9 otherwise; the trace is recorded
+  // with every register 0
+  vector<int8_t> genome{
+    OP_GET_REGISTER, 0,
+    OP_CONST,        5,
+    OP_CONST,        9,
+    OP_IF,           -3, -2, -1,
+    OP_OUTPUT,       -1,
+    OP_TRIGGER,      -1,
+  };
+  auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(genome)));
+  auto jitted = make_shared<const Program>(jit_compile(*program));
+  BOOST_REQUIRE(jitted->trace);
+  BOOST_CHECK_EQUAL(jitted->trace->branch_nodes.size(), 1);
+  for (Data cond : { 0, 1, -1, 2 }) {
+    ExecutionContext interpreted(program), native(jitted);
+    interpreted.registers[0] = native.registers[0] = cond;
+    BOOST_CHECK_EQUAL(interpreted.step_until_done(100), native.step_until_done(100));
+    BOOST_REQUIRE_EQUAL(native.output_data.size(), 1);
+    BOOST_CHECK_EQUAL((int)native.output_data[0], cond % 2 ? 5 : 9);
+    BOOST_CHECK(interpreted.output_data == native.output_data);
+    BOOST_CHECK(interpreted.state_hash() == native.state_hash());
+  }
+}
+
+// Steps a generated context and an interpreter side by side
+template <typename Aot>
+void check_aot_matches_interpreter(const vector<int8_t>& genome) {
+  Aot aot;
+  ExecutionContext interpreted(lift_bytes_to_graph(genome));
+  aot.load_genome(genome);
+  interpreted.load_genome(genome);
+  for (int step = 0; step < 300 && !interpreted.pending_instructions.empty(); step++) {
+    bool interpreted_threw = false, aot_threw = false;
+    try { interpreted.step(); } catch (const logic_error&) { interpreted_threw = true; }
+    try { aot.step(); } catch (const logic_error&) { aot_threw = true; }
+    BOOST_REQUIRE_EQUAL(interpreted_threw, aot_threw);
+    if (interpreted_threw)
+      break;
+    BOOST_REQUIRE(vector<AbsoluteAddress>(interpreted.pending_instructions.begin(), interpreted.pending_instructions.end())
+                  == vector<AbsoluteAddress>(aot.pending_instructions.begin(), aot.pending_instructions.end()));
+    for (size_t i = 0; i < Aot::num_nodes; i++) {
+      BOOST_REQUIRE_EQUAL(interpreted.nodes.is_active(i), aot.nodes.is_active(i));
+      BOOST_REQUIRE_EQUAL((int)interpreted.nodes.output(i), (int)aot.nodes.output(i));
+    }
+    BOOST_REQUIRE(interpreted.registers == aot.registers);
+    BOOST_REQUIRE(interpreted.output_data == aot.output_data);
+    BOOST_REQUIRE(interpreted.target.bytes() == aot.target.bytes());
+    BOOST_REQUIRE_EQUAL(interpreted.settled(), aot.settled());
+  }
+
+  // Whole runs stop for the same reason
+  interpreted.reset();
+  interpreted.load_genome(genome);
+  aot.reset();
+  aot.load_genome(genome);
+  StopReason interpreted_reason = STOP_DONE, aot_reason = STOP_DONE;
+  try { interpreted_reason = interpreted.step_until_done(300); } catch (const logic_error&) { }
+  try { aot_reason = aot.step_until_done(300); } catch (const logic_error&) { }
+  BOOST_CHECK_EQUAL(interpreted_reason, aot_reason);
+}
+
+BOOST_AUTO_TEST_CASE( aot_programs_match_interpreter) {
+  check_aot_matches_interpreter<AotAddition>(addition_genome());
+  check_aot_matches_interpreter<AotEndlessLoop>(endless_loop_genome());
+  check_aot_matches_interpreter<AotEndlessLoops16>(endless_loops_genome(16));
+  check_aot_matches_interpreter<AotSample>(sample_genome());
+  check_aot_matches_interpreter<AotLivelock>(livelock_genome());
+  check_aot_matches_interpreter<AotLivelocks16>(livelocks_genome(16));
+
+  AotAddition addition;
+  auto outputs = evaluate_batch(addition, vector<vector<Data> >(2), 10);
+  BOOST_REQUIRE_EQUAL(outputs.size(), 2);
+  BOOST_CHECK(outputs[1] == vector<Data>{13});
+}
+
+BOOST_AUTO_TEST_CASE( resumed_runs_match_uninterrupted_ones) {
+  auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(livelock_genome())));
+  ExecutionContext whole(program), sliced(program);
+  whole.step_until_done(1000);
+  long steps = 0;
+  while (steps < 1000)
+    steps += run_within(sliced, Budget(min(7L, 1000 - steps)));
+  BOOST_CHECK(whole.registers == sliced.registers);
+  BOOST_CHECK(vector<AbsoluteAddress>(whole.pending_instructions.begin(), whole.pending_instructions.end())
+              == vector<AbsoluteAddress>(sliced.pending_instructions.begin(), sliced.pending_instructions.end()));
+
+  vector<vector<Data> > inputs(3);
+  ContextPool contexts;
+  // Given a copy that nothing else holds
+  ResumableEvaluation evaluation(livelock_genome(), make_shared<const vector<vector<Data> > >(inputs),
+                                 500, contexts);
+  int slices = 0;
+  while (!evaluation.done()) {
+    evaluation.resume(Budget(64));
+    slices++;
+  }
+  BOOST_CHECK_EQUAL(evaluation.steps(), 1500);
+  BOOST_CHECK_EQUAL(slices, (1500 + 63) / 64);
+  auto expected = evaluate_genome(livelock_genome(), inputs, 500);
+  auto result = evaluation.result();
+  BOOST_CHECK(result.ok);
+  BOOST_CHECK(result.outputs == expected.outputs);
+}
+
+BOOST_AUTO_TEST_CASE( time_sliced_evaluator_kills_stragglers) {
+  vector<Genome> genomes;
+  for (int i = 0; i < 20; i++)
+    genomes.push_back(i % 4 ? addition_genome() : livelock_genome());
+  vector<vector<Data> > inputs(2);
+  TimeSlicedEvaluator evaluator(2, Budget(100));
+  auto start = chrono::steady_clock::now();
+  auto results = evaluator.evaluate(genomes, inputs, 1000000000, start + chrono::milliseconds(200));
+  BOOST_CHECK(chrono::steady_clock::now() - start < chrono::seconds(5));
+  for (size_t i = 0; i < genomes.size(); i++) {
+    if (i % 4) {
+      BOOST_CHECK(results[i].ok);
+      BOOST_CHECK(results[i].outputs == vector<vector<Data> >(2, vector<Data>{13}));
+    } else {
+      BOOST_CHECK(!results[i].ok);
+      BOOST_CHECK_EQUAL(results[i].error, "Deadline exceeded");
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE( snapshots_resume_identically) {
+  auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(endless_loops_genome(4))));
+  ExecutionContext original(program);
+  original.input_data = vector<Data>{1, 2, 3};
+  original.step_until_done(37);
+  auto snapshot = save_snapshot(original);
+  BOOST_CHECK_LT(snapshot.size(), 128);
+
+  ExecutionContext restored(program);
+  restore_snapshot(restored, snapshot);
+  BOOST_CHECK(save_snapshot(restored) == snapshot);
+  for (int step = 0; step < 200; step++) {
+    original.step();
+    restored.step();
+  }
+  BOOST_CHECK(original.registers == restored.registers);
+  BOOST_CHECK(original.input_data == restored.input_data);
+  BOOST_CHECK(save_snapshot(original) == save_snapshot(restored));
+
+  char path[] = "/tmp/snapshotXXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd >= 0);
+  close(fd);
+  write_snapshot_file(path, original);
+  ExecutionContext from_file(program);
+  read_snapshot_file(path, from_file);
+  unlink(path);
+  BOOST_CHECK(save_snapshot(from_file) == save_snapshot(original));
+
+  ExecutionContext other(lift_bytes_to_graph(addition_genome()));
+  BOOST_CHECK_THROW(restore_snapshot(other, snapshot), runtime_error);
+  snapshot.pop_back();
+  BOOST_CHECK_THROW(restore_snapshot(restored, snapshot), runtime_error);
+
+  // Step code indexes registers modulo MAX_REGISTERS
+  ExecutionContext short_registers(program);
+  short_registers.registers.resize(2);
+  BOOST_CHECK_THROW(restore_snapshot(restored, save_snapshot(short_registers)), runtime_error);
+
+  // OP_IF's state picks which dependency it waits on
+  auto sample = make_shared<const Program>(compile_program(lift_bytes_to_graph(sample_genome())));
+  auto branch = find(sample->instructions.begin(), sample->instructions.end(), OP_IF) - sample->instructions.begin();
+  BOOST_REQUIRE_LT(branch, sample->size());
+  ExecutionContext corrupted(sample), target(sample);
+  corrupted.nodes.extra_state(branch) = 2;
+  BOOST_CHECK_NO_THROW(restore_snapshot(target, save_snapshot(corrupted)));
+  corrupted.nodes.extra_state(branch) = 3;
+  BOOST_CHECK_THROW(restore_snapshot(target, save_snapshot(corrupted)), runtime_error);
+  corrupted.nodes.extra_state(branch) = 0;
+  corrupted.nodes.extra_state(branch == 0 ? 1 : 0) = 1;
+  BOOST_CHECK_THROW(restore_snapshot(target, save_snapshot(corrupted)), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( event_driven_matches_polling) {
+  mt19937 rng(2020);
+  uniform_int_distribution<int> byte(0, 20);
+  for (int trial = 0; trial < 500; trial++) {
+    vector<int8_t> genome;
+    for (int i = 0, n = 1 + rng() % 40; i < n; i++) {
+      auto instruction = instruction_from_bytes(byte(rng));
+      genome.push_back(instruction);
+      for (int j = num_inputs_for_instruction_type(instruction_type(instruction)); j > 0; j--)
+        genome.push_back(int8_t(rng() % 9) - 4);
+    }
+    genome.push_back(OP_TRIGGER);
+    genome.push_back(-int8_t(1 + rng() % 4));
+    auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(genome)));
+    ExecutionContext polling(program);
+    EventContext events(program);
+    polling.registers[trial % MAX_REGISTERS] = events.context.registers[trial % MAX_REGISTERS] = trial;
+    for (int step = 0; step < 100 && !polling.pending_instructions.empty(); step++) {
+      bool polling_threw = false, events_threw = false;
+      try { polling.step(); } catch (const logic_error&) { polling_threw = true; }
+      try { events.step(); } catch (const logic_error&) { events_threw = true; }
+      BOOST_REQUIRE_EQUAL(polling_threw, events_threw);
+      if (polling_threw)
+        break;
+      for (size_t i = 0; i < program->size(); i++) {
+        BOOST_REQUIRE_EQUAL(polling.nodes.is_active(i), events.context.nodes.is_active(i));
+        BOOST_REQUIRE_EQUAL((int)polling.nodes.output(i), (int)events.context.nodes.output(i));
+        BOOST_REQUIRE_EQUAL((int)polling.nodes.extra_state(i), (int)events.context.nodes.extra_state(i));
+      }
+      BOOST_REQUIRE(vector<AbsoluteAddress>(polling.pending_instructions.begin(), polling.pending_instructions.end())
+                    == events.pending_order());
+    }
+    BOOST_CHECK(polling.output_data == events.context.output_data);
+    BOOST_CHECK(polling.registers == events.context.registers);
+  }
+}
+
+BOOST_AUTO_TEST_CASE( event_driven_skips_waiting_nodes) {
+  auto program = make_shared<const Program>(compile_program(lift_bytes_to_graph(endless_loops_genome(16))));
+  ExecutionContext polling(program);
+  EventContext events(program);
+  uint64_t polled = 0;
+  for (int step = 0; step < 1000; step++) {
+    polled += polling.pending_instructions.size();
+    polling.step();
+  }
+  events.step_until_done(1000);
+  BOOST_CHECK(polling.registers == events.context.registers);
+  BOOST_CHECK_EQUAL(polling.pending_instructions.size(), events.size());
+  BOOST_CHECK_LT(events.visits, polled);
+
+  events.reset();
+  BOOST_CHECK_EQUAL(events.visits, 0);
+  BOOST_CHECK_EQUAL(events.size(), program->triggers.size());
+}
+
+BOOST_AUTO_TEST_CASE( bounded_queue_delivers_everything_once) {
+  BoundedQueue<int> queue(5);
+  BOOST_CHECK_EQUAL(queue.capacity(), 8);
+  const int per_producer = 20000;
+  atomic<int> producers_left(2);
+  atomic<long> sum(0), count(0);
+  vector<thread> threads;
+  for (int p = 0; p < 2; p++)
+    threads.push_back(thread([&, p] () {
+        for (int i = 1; i <= per_producer; i++) {
+          int value = i + p * per_producer;
+          while (!queue.try_push(value))
+            this_thread::yield();
+        }
+        producers_left--;
+    }));
+  for (int c = 0; c < 2; c++)
+    threads.push_back(thread([&] () {
+        int value;
+        for (;;) {
+          if (queue.try_pop(value)) {
+            sum += value;
+            count++;
+          } else if (producers_left == 0 && !queue.try_pop(value)) {
+            break;
+          } else {
+            this_thread::yield();
+          }
+        }
+    }));
+  for_each(threads.begin(), threads.end(), [] (thread& t) { t.join(); });
+  long n = 2 * per_producer;
+  BOOST_CHECK_EQUAL(count, n);
+  BOOST_CHECK_EQUAL(sum, n * (n + 1) / 2);
+}
+
+BOOST_AUTO_TEST_CASE( pipeline_matches_serial_evaluation) {
+  auto parents = random_genomes(7, 16, 48);
+  parents.push_back(addition_genome());
+  vector<double> parent_fitness(parents.size(), 0);
+  parent_fitness.back() = 1;
+  vector<vector<Data> > inputs(2, vector<Data>{1, 2});
+  auto fitness = [] (const GenomeResult& result) { return result.ok ? 1.0 : 0.0; };
+  PipelineOptions options;
+  options.lifters = 2;
+  options.queue_capacity = 4;
+  GenerationPipeline pipeline(options);
+  auto children = pipeline.run(parents, parent_fitness, 200, inputs, 100, fitness);
+  BOOST_REQUIRE_EQUAL(children.size(), 200);
+  for_each(children.begin(), children.end(), [&] (const Offspring& child) {
+      auto expected = evaluate_genome(child.genome, inputs, 100);
+      BOOST_CHECK_EQUAL(child.result.ok, expected.ok);
+      BOOST_CHECK_EQUAL(child.result.error, expected.error);
+      BOOST_CHECK(child.result.outputs == expected.outputs);
+      BOOST_CHECK_EQUAL(child.fitness, fitness(expected));
+  });
+  BOOST_CHECK_EQUAL(pipeline.stats.breed.items, 200);
+  BOOST_CHECK_EQUAL(pipeline.stats.lift.items, 200);
+  BOOST_CHECK_EQUAL(pipeline.stats.evaluate.items, 200);
+
+  // Children depend only on the seed and the generation
+  GenerationPipeline again(options);
+  auto repeated = again.run(parents, parent_fitness, 200, inputs, 100, fitness);
+  for (size_t i = 0; i < children.size(); i++)
+    BOOST_CHECK(children[i].genome == repeated[i].genome);
+  auto next = again.run(parents, parent_fitness, 200, inputs, 100, fitness);
+  BOOST_CHECK(next[0].genome != repeated[0].genome || next[1].genome != repeated[1].genome);
+
+  auto throwing = [] (const GenomeResult&) -> double { throw runtime_error("fitness"); };
+  BOOST_CHECK_THROW(pipeline.run(parents, parent_fitness, 50, inputs, 100, throwing), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE( paged_memory_copies_on_write) {
+  vector<int8_t> bytes(100);
+  for (size_t i = 0; i < bytes.size(); i++)
+    bytes[i] = i * 7;
+  auto parent = make_shared<const PagedMemory>(bytes);
+  BOOST_CHECK(parent->bytes() == bytes);
+  BOOST_CHECK_EQUAL(parent->num_pages(), (100 + PAGE_SIZE - 1) / PAGE_SIZE);
+
+  // A faithful copy holds the parent's own pages
+  PagedMemory child(parent);
+  BOOST_CHECK_EQUAL(child.get(3), 0);
+  for (size_t i = 0; i < bytes.size(); i++)
+    child.set(i, bytes[i]);
+  BOOST_CHECK(child.bytes() == bytes);
+  BOOST_CHECK_EQUAL(child.shared_pages(*parent), parent->num_pages());
+
+  // Changing a byte copies just its page
+  child.set(PAGE_SIZE + 1, 1);
+  BOOST_CHECK_EQUAL(child.shared_pages(*parent), parent->num_pages() - 1);
+  BOOST_CHECK_EQUAL(child.get(PAGE_SIZE + 1), 1);
+  BOOST_CHECK_EQUAL(parent->get(PAGE_SIZE + 1), bytes[PAGE_SIZE + 1]);
+  PagedMemory copy = child;
+  copy.set(0, 1);
+  BOOST_CHECK_EQUAL(child.get(0), bytes[0]);
+
+  // Bytes written out of order are zero until written, even on a borrowed page
+  PagedMemory sparse(parent);
+  sparse.set(10, bytes[10]);
+  BOOST_CHECK_EQUAL(sparse.size(), 11);
+  BOOST_CHECK_EQUAL(sparse.get(9), 0);
+  BOOST_CHECK_EQUAL(sparse.shared_pages(*parent), 1);
+  sparse.clear();
+  BOOST_CHECK_EQUAL(sparse.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( self_copy_shares_genome_pages) {
+  // Copies its first n bytes to the target, one chained group per byte
+  const int n = 40;
+  vector<int8_t> genome;
+  for (int i = 0; i < n; i++) {
+    vector<int8_t> group{
+      OP_CONST,    int8_t(i),
+      OP_GET_BYTE, 0, -1,
+      OP_SET_BYTE, 1, -2, -1,
+    };
+    genome.insert(genome.end(), group.begin(), group.end());
+    if (i == 0)
+      genome.insert(genome.end(), {OP_BLOCK2, -3, -1});
+    else
+      genome.insert(genome.end(), {OP_BLOCK3, -3, -1, -4});
+  }
+  genome.insert(genome.end(), {OP_TRIGGER, -1});
+  ExecutionContext context(lift_bytes_to_graph(genome));
+  context.load_genome(genome);
+  context.step_until_done(1000);
+  BOOST_CHECK(context.pending_instructions.empty());
+  BOOST_CHECK(context.target.bytes() == vector<int8_t>(genome.begin(), genome.begin() + n));
+  BOOST_REQUIRE(context.self_pages);
+  BOOST_CHECK_EQUAL(context.target.shared_pages(*context.self_pages), (n + PAGE_SIZE - 1) / PAGE_SIZE);
+
+  // Each run's copy leaves the evaluation still sharing the genome's pages
+  auto result = evaluate_genome(genome, vector<vector<Data> >(2), 1000);
+  BOOST_REQUIRE(result.ok);
+  BOOST_REQUIRE_EQUAL(result.targets.size(), 2);
+  for_each(result.targets.begin(), result.targets.end(), [&] (const PagedMemory& offspring) {
+      BOOST_CHECK(offspring.bytes() == vector<int8_t>(genome.begin(), genome.begin() + n));
+      BOOST_CHECK_EQUAL(offspring.borrowed_pages(), (n + PAGE_SIZE - 1) / PAGE_SIZE);
+  });
+  BOOST_CHECK_EQUAL(result.targets[0].shared_pages(result.targets[1]), (n + PAGE_SIZE - 1) / PAGE_SIZE);
+
+  // Reading the genome does not copy it
+  vector<int8_t> peek{OP_CONST, 2, OP_GET_BYTE, 0, -1, OP_OUTPUT, -1, OP_TRIGGER, -1};
+  ExecutionContext reader(lift_bytes_to_graph(peek));
+  reader.load_genome(peek);
+  reader.step_until_done(10);
+  BOOST_CHECK_EQUAL(reader.output_data.size(), 1);
+  BOOST_CHECK(!reader.self_pages);
+
+  // Another run starts from an empty target; a new program unloads the genome
+  context.reset();
+  BOOST_CHECK_EQUAL(context.target.size(), 0);
+  context.reset(make_shared<const Program>(compile_program(lift_bytes_to_graph(genome))));
+  context.step_until_done(1000);
+  BOOST_CHECK(context.target.bytes() == vector<int8_t>(n, 0));
+}
+
+BOOST_AUTO_TEST_CASE( scoring_stops_hopeless_genomes_early) {
+  // Outputs 13 at once, then stalls
+  auto genome = addition_genome();
+  auto loop = endless_loop_genome();
+  genome.insert(genome.end(), loop.begin(), loop.end());
+  vector<vector<Data> > inputs(3);
+  ContextPool contexts;
+
+  Scoring scoring;
+  scoring.expected.assign(3, vector<Data>{13});
+  auto full = score_genome(genome, inputs, 1000, scoring, contexts);
+  BOOST_CHECK(full.ok);
+  BOOST_CHECK(!full.stopped_early);
+  BOOST_CHECK_EQUAL(full.score, 3);
+  BOOST_CHECK_LT(full.steps, 3 * 10);
+  BOOST_CHECK(full.outputs == evaluate_genome(genome, inputs, 1000).outputs);
+
+  // After one wrong output, at most 2 of the 3 points are left
+  scoring.expected.assign(3, vector<Data>{42});
+  scoring.threshold = 2;
+  auto cut = score_genome(genome, inputs, 1000, scoring, contexts);
+  BOOST_CHECK(cut.ok);
+  BOOST_CHECK(cut.stopped_early);
+  BOOST_CHECK_EQUAL(cut.score, 0);
+  BOOST_CHECK_EQUAL(cut.best_possible, 2);
+  BOOST_CHECK_LT(cut.steps, 10);
+  BOOST_CHECK_EQUAL(cut.outputs.size(), 1);
+
+  // Partial credit can keep it in the running
+  scoring.credit = [] (Data produced, Data expected) { return 1 - abs(produced - expected) / 256.0; };
+  scoring.threshold = 2.5;
+  auto partial = score_genome(genome, inputs, 1000, scoring, contexts);
+  BOOST_CHECK(!partial.stopped_early);
+  BOOST_CHECK_CLOSE(partial.score, 3 * (1 - 29 / 256.0), 1e-9);
+
+  PopulationEvaluator evaluator(2);
+  scoring.threshold = 2.9;
+  auto scores = score_population(evaluator, vector<Genome>(4, genome), inputs, 1000, scoring);
+  BOOST_REQUIRE_EQUAL(scores.size(), 4);
+  BOOST_CHECK(scores[3].stopped_early);
+  BOOST_CHECK_EQUAL(scores[3].outputs.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( step_until_done_detects_fixed_points_and_cycles) {
+  // Two nodes that wait on each other: after one step nothing can change
+  vector<int8_t> deadlock{
+    OP_ADD,     1, 1,
+    OP_ADD,    -1, -1,
+    OP_TRIGGER, -2,
+  };
+  ExecutionContext stuck(lift_bytes_to_graph(deadlock));
+  BOOST_CHECK_EQUAL(stuck.step_until_done(1000), STOP_FIXED_POINT);
+  BOOST_CHECK(stuck.settled());
+  BOOST_CHECK(!stuck.pending_instructions.empty());
+#ifdef VM_INSTRUMENT
+  BOOST_CHECK_LT(stuck.stats.steps, 5);
+#endif
+
+  EventContext events(make_shared<const Program>(compile_program(lift_bytes_to_graph(deadlock))));
+  BOOST_CHECK_EQUAL(events.step_until_done(1000), STOP_FIXED_POINT);
+  BOOST_CHECK(!events.empty());
+
+  // The corpus loop's IF waits on a block that waits on the IF
+  ExecutionContext blocked(lift_bytes_to_graph(endless_loop_genome()));
+  BOOST_CHECK_EQUAL(blocked.step_until_done(1000), STOP_FIXED_POINT);
+
+  // Fires every step, but the state goes round in a short cycle
+  ExecutionContext loop(lift_bytes_to_graph(livelock_genome()));
+  BOOST_CHECK_EQUAL(loop.step_until_done(1000), STOP_ITERATION_LIMIT);
+  loop.reset();
+  BOOST_CHECK_EQUAL(loop.step_until_done(1000, true), STOP_CYCLE);
+  // A cycle found within 100 steps leaves budget unspent
+  loop.reset();
+  BOOST_CHECK_EQUAL(loop.step_until_done(100, true), STOP_CYCLE);
+
+  ExecutionContext addition(lift_bytes_to_graph(addition_genome()));
+  BOOST_CHECK_EQUAL(addition.step_until_done(1000, true), STOP_DONE);
+  BOOST_CHECK(addition.output_data == vector<Data>{13});
+}
+
+BOOST_AUTO_TEST_CASE( islands_over_sockets_match_in_process_run) {
+  IslandOptions options;
+  options.island_size = 8;
+  options.epochs = 3;
+  options.generations_per_epoch = 2;
+  options.breeding.evaluators = 1;
+  IslandProblem problem;
+  problem.inputs.assign(2, vector<Data>());
+  problem.max_iterations = 50;
+  // Closeness of the first output to 42
+  problem.fitness = [] (const GenomeResult& result) {
+    if (!result.ok || result.outputs.empty() || result.outputs[0].empty())
+      return 0.0;
+    return 1 - abs(result.outputs[0][0] - 42) / 256.0;
+  };
+  auto founders = random_genomes(11, 5, 32);
+  founders.push_back(addition_genome());
+
+  auto check_same = [] (const IslandResult& expected, const IslandResult& actual) {
+    BOOST_REQUIRE_EQUAL(actual.islands.size(), expected.islands.size());
+    BOOST_CHECK_EQUAL(actual.evaluations, expected.evaluations);
+    for (size_t i = 0; i < expected.islands.size(); i++) {
+      BOOST_REQUIRE_EQUAL(actual.islands[i].size(), expected.islands[i].size());
+      for (size_t j = 0; j < expected.islands[i].size(); j++) {
+        BOOST_CHECK(actual.islands[i][j].genome == expected.islands[i][j].genome);
+        BOOST_CHECK_EQUAL(actual.islands[i][j].fitness, expected.islands[i][j].fitness);
+      }
+    }
+  };
+
+  auto serial = evolve_islands(founders, 3, options, problem);
+  BOOST_CHECK_EQUAL(serial.evaluations, founders.size() + 3 * 3 * 2 * 8);
+  BOOST_CHECK_GE(serial.best().fitness, 1 - 29 / 256.0);
+  auto path = "/tmp/gvm_islands_" + to_string(getpid());
+  check_same(serial, run_local_islands("unix:" + path, founders, 3, options, problem));
+  BOOST_CHECK(access(path.c_str(), F_OK) != 0);
+
+  check_same(evolve_islands(founders, 2, options, problem),
+             run_local_islands("127.0.0.1:0", founders, 2, options, problem));
+
+  BOOST_CHECK_THROW(run_local_islands("nowhere", founders, 2, options, problem), runtime_error);
+
+  // A coordinator whose workers never come gives up when told to
+  IslandCoordinator lonely("127.0.0.1:0", options);
+  int polls = 0;
+  BOOST_CHECK_THROW(lonely.run(founders, 2, [&] () {
+        if (++polls == 2)
+          throw runtime_error("no workers");
+      }), runtime_error);
+  BOOST_CHECK_EQUAL(polls, 2);
+  BOOST_CHECK_THROW(evolve_islands(founders, founders.size() + 1, options, problem), logic_error);
+}
+
 BOOST_AUTO_TEST_CASE( num_instructions) {
   auto num_instructions = 21;
   auto num_instruction_types = 8;
@@ -0,0 +1,92 @@
+#include "threadpool.hpp"
+#include <algorithm>
+using namespace std;
+
+WorkStealingPool::WorkStealingPool(int num_threads) : remaining(0), batch(0), stopping(false) {
+  if (num_threads <= 0)
+    num_threads = max(1u, thread::hardware_concurrency());
+  for (int i = 0; i < num_threads; i++)
+    this->queues.push_back(unique_ptr<Queue>(new Queue()));
+  for (int i = 0; i < num_threads; i++)
+    this->workers.push_back(thread(&WorkStealingPool::work, this, i));
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    lock_guard<mutex> guard(this->lock);
+    this->stopping = true;
+  }
+  this->work_available.notify_all();
+  for_each(this->workers.begin(), this->workers.end(), [] (thread& worker) {
+      worker.join();
+  });
+}
+
+void WorkStealingPool::run(size_t num_jobs, function<void(size_t)> _job) {
+  if (num_jobs == 0)
+    return;
+  lock_guard<mutex> serialize(this->running);
+  unique_lock<mutex> guard(this->lock);
+  this->job = _job;
+  this->error = nullptr;
+  this->remaining = num_jobs;
+  size_t num_queues = this->queues.size();
+  for (size_t i = 0; i < num_queues; i++) {
+    auto& queue = *this->queues[i];
+    lock_guard<mutex> queue_guard(queue.lock);
+    for (size_t index = i * num_jobs / num_queues; index < (i + 1) * num_jobs / num_queues; index++)
+      queue.jobs.push_back(index);
+  }
+  this->batch++;
+  this->work_available.notify_all();
+  this->batch_done.wait(guard, [&] { return this->remaining == 0; });
+  if (this->error)
+    rethrow_exception(this->error);
+}
+
+bool WorkStealingPool::take(int id, size_t& index) {
+  int num_queues = this->queues.size();
+  for (int i = 0; i < num_queues; i++) {
+    auto& queue = *this->queues[(id + i) % num_queues];
+    lock_guard<mutex> guard(queue.lock);
+    if (queue.jobs.empty())
+      continue;
+    // Own work from the front, stolen work from the back
+    if (i == 0) {
+      index = queue.jobs.front();
+      queue.jobs.pop_front();
+    } else {
+      index = queue.jobs.back();
+      queue.jobs.pop_back();
+    }
+    return true;
+  }
+  return false;
+}
+
+void WorkStealingPool::work(int id) {
+  unsigned long seen = 0;
+  while (true) {
+    {
+      unique_lock<mutex> guard(this->lock);
+      this->work_available.wait(guard, [&] { return this->stopping || this->batch != seen; });
+      if (this->stopping)
+        return;
+      seen = this->batch;
+    }
+    size_t index;
+    while (this->take(id, index)) {
+      try {
+        this->job(index);
+      } catch (...) {
+        lock_guard<mutex> guard(this->lock);
+        if (!this->error)
+          this->error = current_exception();
+      }
+      if (--this->remaining == 0) {
+        lock_guard<mutex> guard(this->lock);
+        this->batch_done.notify_all();
+      }
+    }
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+// Fixed set of worker threads that run batches of indexed jobs.
+//
+// Each worker has its own deque of job indices. A batch is dealt out in
+// contiguous runs, workers take jobs from the front of their own deque,
+// and a worker whose deque is empty steals from the back of another's.
+// Long-running jobs therefore do not hold up the jobs queued behind them.
+struct WorkStealingPool {
+  explicit WorkStealingPool(int num_threads = 0); // 0 means one per core
+  ~WorkStealingPool();
+  int size() const { return workers.size(); }
+
+  // Runs job(0) .. job(num_jobs - 1) and waits for all of them. If any job
+  // throws, the first exception is rethrown here once the batch is done.
+  // Batches from different callers run one after another.
+  void run(size_t num_jobs, function<void(size_t)> job);
+
+private:
+  struct Queue {
+    mutex lock;
+    deque<size_t> jobs;
+  };
+  vector<thread> workers;
+  vector<unique_ptr<Queue> > queues;
+
+  mutex running;
+  mutex lock;
+  condition_variable work_available;
+  condition_variable batch_done;
+  function<void(size_t)> job;
+  atomic<size_t> remaining;
+  exception_ptr error;
+  unsigned long batch;
+  bool stopping;
+
+  void work(int id);
+  bool take(int id, size_t& index);
+};
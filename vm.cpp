@@ -1,269 +1,409 @@
 #include "vm.hpp"
+#include "cache.hpp"
+#include "jit.hpp"
 #include <algorithm>
 #include <iostream>
 #include <stdexcept>
 using namespace std;
 
-ExecutionContext::ExecutionContext(const vector<InstructionNode>& _nodes) {
-  this->nodes = _nodes;
-  for_each(_nodes.begin(), _nodes.end(), [&] (const InstructionNode& node) {
-      if (node.instruction != OP_TRIGGER)
-        return;
-      pending_instructions.insert(node.address);
-  });
-  this->registers = vector<Data>();
-  for (int i = 10; i --> 0;) this->registers.push_back(0);
+ExecutionContext::ExecutionContext(const vector<InstructionNode>& _nodes)
+  : ExecutionContext(make_shared<const Program>(compile_program(_nodes))) { }
+
+ExecutionContext::ExecutionContext(shared_ptr<const Program> _program)
+  : self(nullptr, 0), program(_program) {
+  this->reset();
   debug = false;
+  debug_output = &cout;
+}
+
+// Switches to another program, reusing this context's buffers. They only
+// grow if the program is longer than any this context has run before.
+void ExecutionContext::reset(shared_ptr<const Program> _program) {
+  this->program = _program;
+  this->load_genome(ByteSpan(nullptr, 0));
+  this->reset();
+}
+
+void ExecutionContext::load_genome(ByteSpan genome) {
+  this->self = genome;
+  this->self_pages.reset();
+  this->target = PagedMemory();
+}
+
+// Returns the context to the state a freshly constructed one would be in.
+// Buffers are already sized for the program, so this does not allocate.
+void ExecutionContext::reset() {
+  auto& triggers = this->program->triggers;
+  this->input_data.clear();
+  this->output_data.clear();
+  this->registers.assign(MAX_REGISTERS, 0);
+  this->target.clear();
+  this->last_step_settled = false;
+  this->nodes.reset(this->program->size());
+  this->pending_instructions.reset(this->program->size());
+  for_each(triggers.begin(), triggers.end(), [&] (AbsoluteAddress address) {
+      this->pending_instructions.push(address);
+  });
 }
 
 void ExecutionContext::print_nodes() {
-  print_instruction_nodes(this->nodes);
+  for (size_t i = 0; i < this->program->size(); i++)
+    *this->debug_output << show_instruction_node(this->get_address(i)) << endl;
 }
 
 void ExecutionContext::print_pending() {
   auto& pending = this->pending_instructions;
-  cout << "Pending instructions:" << endl;
+  auto& out = *this->debug_output;
+  out << "Pending instructions:" << endl;
   for_each(pending.begin(), pending.end(), [&] (AbsoluteAddress address) {
       auto node = this->get_address(address);
-      cout << "Address " << address << ", which is a " << show_instruction_node(node) << endl;
+      out << "Address " << address << ", which is a " << show_instruction_node(node) << endl;
     });
 }
 
 void ExecutionContext::print_registers() {
   auto& registers = this->registers;
+  auto& out = *this->debug_output;
   int i = 1;
   for_each(registers.begin(), registers.end(), [&] (const Data& value) {
-      cout << "Register " << i++ << ": " << (int)value << endl;
+      out << "Register " << i++ << ": " << (int)value << endl;
   });
 }
 
-InstructionNode& ExecutionContext::get_address(AbsoluteAddress address) {
-  return this->nodes[address % this->nodes.size()];
+// Reassembles a node from the program and the node store, for display.
+InstructionNode ExecutionContext::get_address(AbsoluteAddress address) const {
+  address = this->program->resolve(address);
+  auto node = this->program->nodes[address];
+  node.active = this->nodes.is_active(address);
+  node.output = this->nodes.output(address);
+  node.extra_state = this->nodes.extra_state(address);
+  return node;
 }
 
-bool ExecutionContext::should_execute(const InstructionNode& node) {
-  auto ds = dependencies(node);
-  return all_of(ds.begin(), ds.end(), [&] (AbsoluteAddress address) {
-      return this->get_address(address).active;
+bool ExecutionContext::should_execute(AbsoluteAddress address) {
+  auto& compiled = this->program->compiled[address];
+  auto extra_state = this->nodes.extra_state(address);
+  return all_of(compiled.waits_begin(extra_state), compiled.waits_end(extra_state), [&] (AbsoluteAddress dependency) {
+      return this->nodes.is_active(dependency);
   });
 }
 
-void ExecutionContext::ensure_dependencies_are_triggered(const InstructionNode& node) {
-  auto ds = dependencies(node);
-  for_each(ds.begin(), ds.end(), [&] (AbsoluteAddress address) {
-      auto d = this->get_address(address);
-      if (d.active)
+void ExecutionContext::ensure_dependencies_are_triggered(AbsoluteAddress address) {
+  auto& compiled = this->program->compiled[address];
+  auto extra_state = this->nodes.extra_state(address);
+  for_each(compiled.waits_begin(extra_state), compiled.waits_end(extra_state), [&] (AbsoluteAddress dependency) {
+      if (this->nodes.is_active(dependency))
         return;
-      this->pending_instructions.insert(address);
+      this->pending_instructions.push(dependency);
   });
 }
 
 void ExecutionContext::step() {
-    unordered_set<AbsoluteAddress> nodes_to_remove;
+  if (this->debug)
+    this->step_impl<true>();
+  else
+    this->step_impl<false>();
+}
+
+// Debug tracing is a template parameter so that the ordinary build of the
+// loop carries no per-instruction check for it.
+template <bool Debug>
+void ExecutionContext::step_impl() {
     auto& pending = this->pending_instructions;
+    VM_INSTRUMENTED(auto start = cycle_counter());
+    auto num_pending = pending.size();
+    bool executed = false;
+    pending.begin_step();
     for_each(
-        pending.begin(),
-        pending.end(),
-        [&] (const AbsoluteAddress& address) {
-          auto& node = get_address(address);
-          if (this->should_execute(node)) {
-            if (this->execute_node(node)) {
-              node.active = true;
-              nodes_to_remove.insert(address);
+        pending.step_begin(),
+        pending.step_end(),
+        [&] (AbsoluteAddress address) {
+          if (this->should_execute(address)) {
+            executed = true;
+            if (this->execute_node<Debug>(address)) {
+              this->nodes.set_active(address);
+              pending.retire(address);
+              return;
             }
           } else {
-            this->ensure_dependencies_are_triggered(node);
+            VM_INSTRUMENTED(this->stats.stalls[this->program->instructions[address]]++);
+            this->ensure_dependencies_are_triggered(address);
           }
+          pending.keep(address);
         });
-    for_each(nodes_to_remove.begin(), nodes_to_remove.end(), [&] (AbsoluteAddress address) {
-        pending.erase(pending.find(address));
-    });
+    VM_INSTRUMENTED(this->stats.max_pending = max<uint64_t>(this->stats.max_pending, pending.size()));
+    pending.end_step();
+    // Without executions nothing retires, so the size only grows by pushes
+    this->last_step_settled = !executed && pending.size() == num_pending;
+#ifdef VM_INSTRUMENT
+    auto cycles = cycle_counter() - start;
+    this->stats.steps++;
+    this->stats.step_cycles += cycles;
+    this->stats.max_step_cycles = max(this->stats.max_step_cycles, cycles);
+#endif
 }
 
-void ExecutionContext::step_until_done(int max_iterations) {
-  while (!(this->pending_instructions.empty()) && max_iterations-- > 0) {
+StopReason ExecutionContext::step_until_done(int max_iterations, bool detect_cycles) {
+  StopReason reason;
+  if (!detect_cycles && run_step_trace(*this, max_iterations, reason))
+    return reason;
+  uint64_t saved_hash = detect_cycles ? this->state_hash() : 0;
+  long power = 1, length = 0;
+  while (!this->pending_instructions.empty()) {
+    if (max_iterations-- <= 0)
+      return STOP_ITERATION_LIMIT;
     this->step();
+    if (this->last_step_settled)
+      return STOP_FIXED_POINT;
+    if (!detect_cycles)
+      continue;
+    auto hash = this->state_hash();
+    if (hash == saved_hash)
+      return STOP_CYCLE;
+    // Brent: compare against the state at the last power of two steps
+    if (++length == power) {
+      saved_hash = hash;
+      power *= 2;
+      length = 0;
+    }
   }
+  return STOP_DONE;
+}
+
+uint64_t ExecutionContext::state_hash() const {
+  auto hash_data = [] (uint64_t seed, const void* data, size_t bytes) {
+    return hash_bytes(static_cast<const uint8_t*>(data), bytes, seed);
+  };
+  auto num_nodes = this->program->size();
+  uint64_t num_outputs = this->output_data.size();
+  auto hash = hash_data(14695981039346656037ULL, &num_outputs, sizeof(num_outputs));
+  hash = hash_data(hash, this->registers.data(), this->registers.size());
+  hash = hash_data(hash, this->nodes.active(), this->nodes.num_active_words() * sizeof(uint64_t));
+  hash = hash_data(hash, this->nodes.outputs(), num_nodes);
+  hash = hash_data(hash, this->nodes.extra_states(), num_nodes);
+  auto& pending = this->pending_instructions;
+  hash = hash_data(hash, pending.begin(), (pending.end() - pending.begin()) * sizeof(AbsoluteAddress));
+  auto target = this->target.bytes();
+  return hash_data(hash, target.data(), target.size());
 }
 
 bool ExecutionContext::is_pending(AbsoluteAddress address) {
-   return !(this->pending_instructions.find(address) ==
-           this->pending_instructions.end());
+  return this->pending_instructions.contains(this->program->resolve(address));
 }
 
-bool ExecutionContext::execute_node(InstructionNode& node) {
-  if (this->debug)
-    cout << "Executing " << show_instruction_node(node) << endl;
-  switch (node.instruction) {
+template <bool Debug>
+bool ExecutionContext::execute_node(AbsoluteAddress address) {
+  if (Debug)
+    *this->debug_output << "Executing " << show_instruction_node(this->get_address(address)) << endl;
+  VM_INSTRUMENTED(this->stats.executions[this->program->instructions[address]]++);
+  return this->program->handlers[address](*this, address);
+}
+// EventContext runs nodes through these too
+template bool ExecutionContext::execute_node<false>(AbsoluteAddress);
+template bool ExecutionContext::execute_node<true>(AbsoluteAddress);
+
+template <void (ExecutionContext::*handler)(AbsoluteAddress)>
+bool ExecutionContext::run_handler(ExecutionContext& context, AbsoluteAddress address) {
+  (context.*handler)(address);
+  return true;
+}
+
+bool ExecutionContext::run_OP_IF(ExecutionContext& context, AbsoluteAddress address) {
+  return context.handle_OP_IF(address);
+}
+
+static bool run_unhandled(ExecutionContext& context, AbsoluteAddress address) {
+  throw logic_error("Unhandled instruction" + show_instruction_node(context.get_address(address)));
+}
+
+NodeHandler handler_for(Instruction instruction) {
+  typedef ExecutionContext C;
+  switch (instruction) {
   case OP_ADD:
-    handle_OP_ADD(node); break;
+    return C::run_handler<&C::handle_OP_ADD>;
   case OP_BIND:
-    handle_OP_BIND(node); break;
+    return C::run_handler<&C::handle_OP_BIND>;
   case OP_BLOCK1:
-    handle_OP_BLOCK1(node); break;
+    return C::run_handler<&C::handle_OP_BLOCK1>;
   case OP_BLOCK2:
-    handle_OP_BLOCK2(node); break;
+    return C::run_handler<&C::handle_OP_BLOCK2>;
   case OP_BLOCK3:
-    handle_OP_BLOCK3(node); break;
+    return C::run_handler<&C::handle_OP_BLOCK3>;
   case OP_BLOCK4:
-    handle_OP_BLOCK4(node); break;
+    return C::run_handler<&C::handle_OP_BLOCK4>;
   case OP_CONST:
-    handle_OP_CONST(node); break;
+    return C::run_handler<&C::handle_OP_CONST>;
   case OP_CUT:
-    handle_OP_CUT(node); break;
+    return C::run_handler<&C::handle_OP_CUT>;
   case OP_DIVIDE:
-    handle_OP_DIVIDE(node); break;
+    return C::run_handler<&C::handle_OP_DIVIDE>;
   case OP_GEQ:
-    handle_OP_GEQ(node); break;
+    return C::run_handler<&C::handle_OP_GEQ>;
   case OP_GET_BYTE:
-    handle_OP_GET_BYTE(node); break;
+    return C::run_handler<&C::handle_OP_GET_BYTE>;
   case OP_GET_REGISTER:
-    handle_OP_GET_REGISTER(node); break;
+    return C::run_handler<&C::handle_OP_GET_REGISTER>;
   case OP_IF:
-    return handle_OP_IF(node); break;
+    return C::run_OP_IF;
   case OP_LEQ:
-    handle_OP_LEQ(node); break;
+    return C::run_handler<&C::handle_OP_LEQ>;
   case OP_MULTIPLY:
-    handle_OP_MULTIPLY(node); break;
+    return C::run_handler<&C::handle_OP_MULTIPLY>;
   case OP_OUTPUT:
-    handle_OP_OUTPUT(node); break;
+    return C::run_handler<&C::handle_OP_OUTPUT>;
   case OP_NOP:
-    handle_OP_NOP(node); break;
+    return C::run_handler<&C::handle_OP_NOP>;
   case OP_SET_BYTE:
-    handle_OP_SET_BYTE(node); break;
+    return C::run_handler<&C::handle_OP_SET_BYTE>;
   case OP_SET_REGISTER:
-    handle_OP_SET_REGISTER(node); break;
+    return C::run_handler<&C::handle_OP_SET_REGISTER>;
   case OP_SUBTRACT:
-    handle_OP_SUBTRACT(node); break;
+    return C::run_handler<&C::handle_OP_SUBTRACT>;
   case OP_TRIGGER:
-    handle_OP_TRIGGER(node); break;
+    return C::run_handler<&C::handle_OP_TRIGGER>;
   default:
-    throw logic_error("Unhandled instruction" + show_instruction_node(node));
+    return run_unhandled;
   }
-  return true;
-};
-
-Data ExecutionContext::consume_node(AbsoluteAddress root, RelativeAddress offset) {
-  return this->consume_node(translate_relative(root, offset));
 }
 
-Data ExecutionContext::consume_node(AbsoluteAddress address) {
-  auto& node = this->get_address(address);
-  return this->consume_node(node);
+Data ExecutionContext::consume_operand(AbsoluteAddress address, int operand) {
+  return this->consume_node(this->program->operand(address, operand));
 }
 
-Data ExecutionContext::consume_node(InstructionNode& node) {
-  node.active = false;
-  return node.output;
+Data ExecutionContext::consume_node(AbsoluteAddress address) {
+  this->nodes.clear_active(address);
+  return this->nodes.output(address);
 }
 
-void ExecutionContext::handle_OP_ADD(InstructionNode& node) {
-  auto d1 = consume_node(node.address, node.input.binop.i1);
-  auto d2 = consume_node(node.address, node.input.binop.i2);
-  node.output = d1 + d2;
+void ExecutionContext::handle_OP_ADD(AbsoluteAddress address) {
+  auto d1 = consume_operand(address, 0);
+  auto d2 = consume_operand(address, 1);
+  this->nodes.output(address) = d1 + d2;
 }
 
-void ExecutionContext::handle_OP_BIND(InstructionNode&) {
+void ExecutionContext::handle_OP_BIND(AbsoluteAddress) {
   throw logic_error("Unimplemented instruction");
 }
 
-void ExecutionContext::handle_OP_BLOCK1(InstructionNode&) { }
-void ExecutionContext::handle_OP_BLOCK2(InstructionNode&) { }
-void ExecutionContext::handle_OP_BLOCK3(InstructionNode&) { }
-void ExecutionContext::handle_OP_BLOCK4(InstructionNode&) { }
+void ExecutionContext::handle_OP_BLOCK1(AbsoluteAddress) { }
+void ExecutionContext::handle_OP_BLOCK2(AbsoluteAddress) { }
+void ExecutionContext::handle_OP_BLOCK3(AbsoluteAddress) { }
+void ExecutionContext::handle_OP_BLOCK4(AbsoluteAddress) { }
 
-void ExecutionContext::handle_OP_CONST(InstructionNode& node) {
-  node.output = node.input.data;
+void ExecutionContext::handle_OP_CONST(AbsoluteAddress address) {
+  this->nodes.output(address) = this->program->immediates[address];
 }
 
-void ExecutionContext::handle_OP_CUT(InstructionNode&) {
+void ExecutionContext::handle_OP_CUT(AbsoluteAddress) {
   throw logic_error("Unimplemented instruction");
 }
 
-void ExecutionContext::handle_OP_DIVIDE(InstructionNode& node) {
-  auto i1 = this->consume_node(node.address, node.input.binop.i1);
-  auto i2 = this->consume_node(node.address, node.input.binop.i2);
+void ExecutionContext::handle_OP_DIVIDE(AbsoluteAddress address) {
+  auto i1 = this->consume_operand(address, 0);
+  auto i2 = this->consume_operand(address, 1);
   if (i2 == 0)
-    node.output = 0;
+    this->nodes.output(address) = 0;
   else
-    node.output = i1 / i2;
+    this->nodes.output(address) = i1 / i2;
 }
 
-void ExecutionContext::handle_OP_GEQ(InstructionNode& node) {
-  auto i1 = this->consume_node(node.address, node.input.binop.i1);
-  auto i2 = this->consume_node(node.address, node.input.binop.i2);
-  node.output = i1 >= i2;
+void ExecutionContext::handle_OP_GEQ(AbsoluteAddress address) {
+  auto i1 = this->consume_operand(address, 0);
+  auto i2 = this->consume_operand(address, 1);
+  this->nodes.output(address) = i1 >= i2;
 }
 
-void ExecutionContext::handle_OP_GET_BYTE(InstructionNode&) {
-  throw logic_error("Unimplemented instruction");
+void ExecutionContext::handle_OP_GET_BYTE(AbsoluteAddress address) {
+  auto index = this->consume_operand(address, 0);
+  this->nodes.output(address) = this->read_byte(this->program->immediates[address], index);
 }
 
-void ExecutionContext::handle_OP_GET_REGISTER(InstructionNode& node) {
-  auto index = translate_register(node.input.data);
-  node.output = this->registers[index];
+void ExecutionContext::handle_OP_GET_REGISTER(AbsoluteAddress address) {
+  auto index = translate_register(this->program->immediates[address]);
+  this->nodes.output(address) = this->registers[index];
 }
 
-bool ExecutionContext::handle_OP_IF(InstructionNode& node) {
+bool ExecutionContext::handle_OP_IF(AbsoluteAddress address) {
   int cond, d1, d2;
-  switch (node.extra_state) {
+  auto& extra_state = this->nodes.extra_state(address);
+  switch (extra_state) {
   case 0:
-    cond = this->consume_node(node.address, node.input.triop.i1);
-    node.extra_state = (cond % 2) ? 1 : 2;
+    cond = this->consume_operand(address, 0);
+    extra_state = (cond % 2) ? 1 : 2;
     return false;
   case 1:
-    d1 = this->consume_node(node.address, node.input.triop.i2);
-    node.extra_state = 0;
-    node.output = d1;
+    d1 = this->consume_operand(address, 1);
+    extra_state = 0;
+    this->nodes.output(address) = d1;
     return true;
   case 2:
-    d2 = this->consume_node(node.address, node.input.triop.i3);
-    node.extra_state = 0;
-    node.output = d2;
+    d2 = this->consume_operand(address, 2);
+    extra_state = 0;
+    this->nodes.output(address) = d2;
     return true;
   }
   throw logic_error("OP_IF in invalid state");
 }
 
-void ExecutionContext::handle_OP_LEQ(InstructionNode& node) {
-  auto i1 = this->consume_node(node.address, node.input.binop.i1);
-  auto i2 = this->consume_node(node.address, node.input.binop.i2);
-  node.output = i1 <= i2;
+void ExecutionContext::handle_OP_LEQ(AbsoluteAddress address) {
+  auto i1 = this->consume_operand(address, 0);
+  auto i2 = this->consume_operand(address, 1);
+  this->nodes.output(address) = i1 <= i2;
 }
 
-void ExecutionContext::handle_OP_MULTIPLY(InstructionNode& node) {
-  auto i1 = this->consume_node(node.address, node.input.binop.i1);
-  auto i2 = this->consume_node(node.address, node.input.binop.i2);
-  node.output = i1 * i2;
+void ExecutionContext::handle_OP_MULTIPLY(AbsoluteAddress address) {
+  auto i1 = this->consume_operand(address, 0);
+  auto i2 = this->consume_operand(address, 1);
+  this->nodes.output(address) = i1 * i2;
 }
 
-void ExecutionContext::handle_OP_OUTPUT(InstructionNode& node) {
-  auto data = this->consume_node(node.address, node.input.unop.i);
+void ExecutionContext::handle_OP_OUTPUT(AbsoluteAddress address) {
+  auto data = this->consume_operand(address, 0);
   this->output_data.push_back(data);
 }
 
-void ExecutionContext::handle_OP_NOP(InstructionNode&) { }
+void ExecutionContext::handle_OP_NOP(AbsoluteAddress) { }
 
-void ExecutionContext::handle_OP_SET_BYTE(InstructionNode& node) {
-  throw logic_error("Unimplemented instruction");
+// Writes to the genome itself are dropped; it is read-only.
+void ExecutionContext::handle_OP_SET_BYTE(AbsoluteAddress address) {
+  auto index = this->consume_operand(address, 0);
+  auto value = this->consume_operand(address, 1);
+  if (translate_ring(this->program->immediates[address]) == RING_TARGET)
+    this->write_target(static_cast<uint8_t>(index), value);
+  this->nodes.output(address) = value;
+}
+
+void ExecutionContext::write_target(uint8_t position, Data value) {
+  if (!this->self_pages && this->self.size > 0) {
+    this->self_pages = make_shared<const PagedMemory>(this->self);
+    this->target.set_base(this->self_pages);
+  }
+  this->target.set(position, value);
 }
 
-void ExecutionContext::handle_OP_SET_REGISTER(InstructionNode& node) {
-  auto index = translate_register(node.input.ring_unop.r);
-  int8_t value = this->consume_node(node.address, node.input.ring_unop.i1);
-  
+void ExecutionContext::handle_OP_SET_REGISTER(AbsoluteAddress address) {
+  auto index = translate_register(this->program->immediates[address]);
+  int8_t value = this->consume_operand(address, 0);
+
   this->registers[index] = value;
-  node.output = value;
+  this->nodes.output(address) = value;
 }
 
-void ExecutionContext::handle_OP_SUBTRACT(InstructionNode& node) {
-  auto i1 = this->consume_node(node.address, node.input.binop.i1);
-  auto i2 = this->consume_node(node.address, node.input.binop.i2);
-  node.output = i1 - i2;
+void ExecutionContext::handle_OP_SUBTRACT(AbsoluteAddress address) {
+  auto i1 = this->consume_operand(address, 0);
+  auto i2 = this->consume_operand(address, 1);
+  this->nodes.output(address) = i1 - i2;
 }
 
-void ExecutionContext::handle_OP_TRIGGER(InstructionNode&) { }
+void ExecutionContext::handle_OP_TRIGGER(AbsoluteAddress) { }
 
 uint8_t ExecutionContext::translate_register(int8_t index) {
   return static_cast<uint8_t>(index) % (this->registers.size());
 }
+
+Data ExecutionContext::read_byte(Ring ring, Data index) {
+  auto position = static_cast<uint8_t>(index);
+  if (translate_ring(ring) == RING_TARGET)
+    return this->target.get(position);
+  return position < this->self.size ? this->self.data[position] : 0;
+}
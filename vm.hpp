@@ -1,55 +1,109 @@
 #pragma once
 
 #include "ast.hpp"
+#include "memory.hpp"
+#include "nodestore.hpp"
+#include "program.hpp"
+#include "stats.hpp"
+#include "worklist.hpp"
 #include <iostream>
-#include <unordered_set>
+#include <memory>
 using namespace std;
 
 const int MAX_REGISTERS = 10;
 
+// Why step_until_done returned
+enum StopReason {
+  STOP_DONE,            // Nothing left pending
+  STOP_ITERATION_LIMIT, // Ran max_iterations steps
+  STOP_FIXED_POINT,     // A step ran and triggered nothing, so every later one would too
+  STOP_CYCLE,           // Back in a state seen before; see state_hash
+};
+
+// The interpreter's handler for an instruction, which compile_program and
+// the passes that build programs store per node
+extern NodeHandler handler_for(Instruction);
+
 struct ExecutionContext {
   bool debug;
+  ostream* debug_output; // Where debug traces and print_* go; defaults to cout
   vector<Data> input_data;
   vector<Data> output_data;
   vector<Data> registers;
-  vector<InstructionNode> nodes;
-  unordered_set<AbsoluteAddress> pending_instructions;
-  InstructionNode& get_address(AbsoluteAddress);
+  ByteSpan self;                             // Ring 0, read in place; see load_genome
+  shared_ptr<const PagedMemory> self_pages; // Ring 0 as pages, the target's base
+  PagedMemory target;                       // Ring 1; cleared by reset()
+  shared_ptr<const Program> program;
+  NodeStore nodes;
+  Worklist pending_instructions;
+  ExecutionStats stats; // Only counted with VM_INSTRUMENT; reset() keeps them
+  InstructionNode get_address(AbsoluteAddress) const;
   bool is_pending(AbsoluteAddress);
 
   void print_nodes();
   void print_pending();
   void print_registers();
   void step();
-  void step_until_done(int max_iterations);
+  // With detect_cycles, the state is hashed after every step and compared
+  // against earlier ones (Brent's algorithm), which catches livelocks that
+  // keep firing nodes without changing anything observable. That costs a
+  // pass over the node store per step; fixed points are always detected
+  // and cost nothing. Without it, programs with a StepTrace run the steps
+  // it covers as native code; see jit.hpp.
+  StopReason step_until_done(int max_iterations, bool detect_cycles = false);
+  // Whether the last step neither ran nor triggered any node
+  bool settled() const { return last_step_settled; }
+  // Hash of everything a step reads or writes: registers, node store,
+  // pending order, target memory and how much has been output
+  uint64_t state_hash() const;
+  void reset();
+  void reset(shared_ptr<const Program>); // Also unloads the genome
+  // Maps the genome the program was lifted from as ring 0. The genome must
+  // outlive the runs; it is not copied. The first write to the target
+  // copies it into self_pages, which become the target's base so a copy of
+  // the genome shares its pages; runs that never write the target never
+  // build them.
+  void load_genome(ByteSpan);
   ExecutionContext(const vector<InstructionNode>&);
+  ExecutionContext(shared_ptr<const Program>);
 private:
+  bool last_step_settled;
+  void write_target(uint8_t position, Data value);
   Data consume_node(AbsoluteAddress);
-  Data consume_node(AbsoluteAddress, RelativeAddress);
-  Data consume_node(InstructionNode&);
-  void ensure_dependencies_are_triggered(const InstructionNode&);
-  bool execute_node(InstructionNode&); // Returns whether should delist node
-  void handle_OP_ADD(InstructionNode&);
-  void handle_OP_BIND(InstructionNode&);
-  void handle_OP_BLOCK1(InstructionNode&);
-  void handle_OP_BLOCK2(InstructionNode&);
-  void handle_OP_BLOCK3(InstructionNode&);
-  void handle_OP_BLOCK4(InstructionNode&);
-  void handle_OP_CONST(InstructionNode&);
-  void handle_OP_CUT(InstructionNode&);
-  void handle_OP_DIVIDE(InstructionNode&);
-  void handle_OP_GEQ(InstructionNode&);
-  void handle_OP_GET_BYTE(InstructionNode&);
-  void handle_OP_GET_REGISTER(InstructionNode&);
-  bool handle_OP_IF(InstructionNode&);
-  void handle_OP_LEQ(InstructionNode&);
-  void handle_OP_MULTIPLY(InstructionNode&);
-  void handle_OP_OUTPUT(InstructionNode&);
-  void handle_OP_NOP(InstructionNode&);
-  void handle_OP_SET_BYTE(InstructionNode&);
-  void handle_OP_SET_REGISTER(InstructionNode&);
-  void handle_OP_SUBTRACT(InstructionNode&);
-  void handle_OP_TRIGGER(InstructionNode&);
-  bool should_execute(const InstructionNode&);
+  Data consume_operand(AbsoluteAddress, int);
+  void ensure_dependencies_are_triggered(AbsoluteAddress);
+  template <bool Debug> void step_impl();
+  template <bool Debug> bool execute_node(AbsoluteAddress); // Returns whether should delist node
+  // Adapters from the handlers below to the per-node NodeHandler pointers
+  // in Program; see handler_for.
+  template <void (ExecutionContext::*handler)(AbsoluteAddress)>
+  static bool run_handler(ExecutionContext&, AbsoluteAddress);
+  static bool run_OP_IF(ExecutionContext&, AbsoluteAddress);
+  friend NodeHandler handler_for(Instruction);
+  friend struct EventContext; // Drives execute_node with its own scheduler
+  friend bool run_step_trace(ExecutionContext&, int&, StopReason&);
+  void handle_OP_ADD(AbsoluteAddress);
+  void handle_OP_BIND(AbsoluteAddress);
+  void handle_OP_BLOCK1(AbsoluteAddress);
+  void handle_OP_BLOCK2(AbsoluteAddress);
+  void handle_OP_BLOCK3(AbsoluteAddress);
+  void handle_OP_BLOCK4(AbsoluteAddress);
+  void handle_OP_CONST(AbsoluteAddress);
+  void handle_OP_CUT(AbsoluteAddress);
+  void handle_OP_DIVIDE(AbsoluteAddress);
+  void handle_OP_GEQ(AbsoluteAddress);
+  void handle_OP_GET_BYTE(AbsoluteAddress);
+  void handle_OP_GET_REGISTER(AbsoluteAddress);
+  bool handle_OP_IF(AbsoluteAddress);
+  void handle_OP_LEQ(AbsoluteAddress);
+  void handle_OP_MULTIPLY(AbsoluteAddress);
+  void handle_OP_OUTPUT(AbsoluteAddress);
+  void handle_OP_NOP(AbsoluteAddress);
+  void handle_OP_SET_BYTE(AbsoluteAddress);
+  void handle_OP_SET_REGISTER(AbsoluteAddress);
+  void handle_OP_SUBTRACT(AbsoluteAddress);
+  void handle_OP_TRIGGER(AbsoluteAddress);
+  bool should_execute(AbsoluteAddress);
   uint8_t translate_register(int8_t);
+  Data read_byte(Ring, Data index);
 };
@@ -0,0 +1,97 @@
+#include "worklist.hpp"
+#include <algorithm>
+#include <stdexcept>
+using namespace std;
+
+Worklist::Worklist() : states_at(0), draining(0), num_pending(0) {
+  this->reset(0);
+}
+
+void Worklist::reset(size_t num_nodes) {
+  auto buffer_bytes = 2 * num_nodes * sizeof(AbsoluteAddress);
+  this->arena.reset(arena_bytes(num_nodes) + 2 * arena_bytes(buffer_bytes));
+  this->states_at = this->arena.carve(num_nodes);
+  fill_n(this->states(), num_nodes, NS_IDLE);
+  for (int i = 0; i < 2; i++) {
+    auto& buffer = this->buffers[i];
+    buffer.slots_at = this->arena.carve(buffer_bytes);
+    buffer.middle = num_nodes;
+    buffer.clear();
+  }
+  this->draining = 0;
+  this->num_pending = 0;
+}
+
+Worklist::Buffer& Worklist::filling() {
+  return this->buffers[1 - this->draining];
+}
+
+const Worklist::Buffer& Worklist::filling() const {
+  return this->buffers[1 - this->draining];
+}
+
+bool Worklist::contains(AbsoluteAddress address) const {
+  return this->states()[address] != NS_IDLE;
+}
+
+bool Worklist::empty() const {
+  return this->num_pending == 0;
+}
+
+size_t Worklist::size() const {
+  return this->num_pending;
+}
+
+Worklist::const_iterator Worklist::begin() const {
+  auto& buffer = this->filling();
+  return this->slots(buffer) + buffer.head;
+}
+
+Worklist::const_iterator Worklist::end() const {
+  auto& buffer = this->filling();
+  return this->slots(buffer) + buffer.tail;
+}
+
+void Worklist::push(AbsoluteAddress address) {
+  auto& state = this->states()[address];
+  if (state != NS_IDLE)
+    return;
+  auto& buffer = this->filling();
+  this->slots(buffer)[--buffer.head] = address;
+  state = NS_PENDING;
+  this->num_pending++;
+}
+
+void Worklist::begin_step() {
+  this->draining = 1 - this->draining;
+  this->filling().clear();
+}
+
+Worklist::const_iterator Worklist::step_begin() const {
+  auto& buffer = this->buffers[this->draining];
+  return this->slots(buffer) + buffer.head;
+}
+
+Worklist::const_iterator Worklist::step_end() const {
+  auto& buffer = this->buffers[this->draining];
+  return this->slots(buffer) + buffer.tail;
+}
+
+void Worklist::keep(AbsoluteAddress address) {
+  auto& buffer = this->filling();
+  this->slots(buffer)[buffer.tail++] = address;
+}
+
+void Worklist::retire(AbsoluteAddress address) {
+  this->states()[address] = NS_RETIRING;
+}
+
+void Worklist::end_step() {
+  auto states = this->states();
+  for_each(this->step_begin(), this->step_end(), [&] (AbsoluteAddress address) {
+      if (states[address] != NS_RETIRING)
+        return;
+      states[address] = NS_IDLE;
+      this->num_pending--;
+  });
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "arena.hpp"
+#include "ast.hpp"
+#include <stdint.h>
+#include <vector>
+using namespace std;
+
+// Pending-instruction scheduler used by ExecutionContext::step.
+//
+// Every node has a dense state byte, and pending addresses live in two
+// preallocated buffers: the one drained by the current step and the one
+// filled for the next step. Nodes triggered during a step are queued ahead
+// of the survivors, most recent first, so dependencies are visited before
+// the nodes waiting on them. The state bytes and both buffers are carved
+// from one arena, and nothing is allocated after reset().
+struct Worklist {
+  typedef const AbsoluteAddress* const_iterator;
+
+  Worklist();
+  void reset(size_t num_nodes);
+
+  bool contains(AbsoluteAddress) const;
+  bool empty() const;
+  size_t size() const;
+
+  // Pending nodes in the order the next step will visit them
+  const_iterator begin() const;
+  const_iterator end() const;
+
+  void push(AbsoluteAddress); // Newly triggered node
+
+  // A step drains the nodes that were pending when it began. Each visited
+  // node is either kept for the next step or retired. Retired nodes still
+  // count as pending until end_step(), so they cannot be re-triggered by
+  // the step that executed them.
+  void begin_step();
+  const_iterator step_begin() const;
+  const_iterator step_end() const;
+  void keep(AbsoluteAddress);
+  void retire(AbsoluteAddress);
+  void end_step();
+
+private:
+  enum NodeState { NS_IDLE, NS_PENDING, NS_RETIRING };
+  // Offsets into the arena; each buffer has room for every node on either
+  // side of its midpoint, so push() grows it downwards and keep() upwards.
+  struct Buffer {
+    size_t slots_at, middle;
+    size_t head, tail;
+    void clear() { head = tail = middle; }
+  };
+  Arena arena;
+  size_t states_at;
+  Buffer buffers[2];
+  int draining;
+  size_t num_pending;
+  uint8_t* states() { return arena.at<uint8_t>(states_at); }
+  const uint8_t* states() const { return arena.at<uint8_t>(states_at); }
+  AbsoluteAddress* slots(const Buffer& buffer) { return arena.at<AbsoluteAddress>(buffer.slots_at); }
+  const AbsoluteAddress* slots(const Buffer& buffer) const { return arena.at<AbsoluteAddress>(buffer.slots_at); }
+  Buffer& filling();
+  const Buffer& filling() const;
+};